@@ -0,0 +1,542 @@
+/*
+ * TWIN-BENCH.C --Benchmarks for the rendering hot paths.
+ *
+ * Usage:
+ * twin-bench [-n frames] [-s rows,columns] [-F features] [-r file] [name...]
+ *
+ * Contents:
+ * sink_write()     --Count the bytes a frame would send.
+ * run_workload()   --Run one workload, and report its per-frame costs.
+ *
+ * Remarks:
+ * Each workload draws a frame, composes it if need be, and calls
+ * xterm_sync() into an in-memory sink, so nothing waits on a terminal.
+ * The results are printed as one JSON object per line (per workload):
+ * ns, bytes, syscalls and allocations per frame.  The first few frames
+ * are a warm-up (style table, buffers), and aren't measured.
+ *
+ * Syscalls are counted by interposing poll(), ioctl() and read(), and
+ * the sink's writes stand in for write(): with a frame-sized stdio
+ * buffer, that's one per flush.  Allocations are counted by
+ * interposing malloc() and friends.
+ *
+ * With "-r file", the "replay" workload applies a recorded TwinServer
+ * stream (e.g. captured from a remote-demo server socket), a frame at
+ * a time.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include <apex.h>
+#include <apex/log.h>
+#include <xterminator.h>
+#include <twremote.h>
+
+#define BENCH_FRAMES 1000
+#define BENCH_WARMUP 10
+#define BENCH_TREE_DEPTH 16            /* nested windows */
+
+typedef struct BenchCount_t
+{
+    uint64_t bytes;                    /* sent to the sink */
+    uint64_t syscalls;
+    uint64_t allocs, alloc_bytes;
+} BenchCount;
+
+typedef struct Bench_t
+{
+    Xterminator *xterm;
+    Twindow *root;
+    Twindow tree[BENCH_TREE_DEPTH];    /* for "window-tree" */
+    uint8_t *recording;                /* for "replay" */
+    size_t n_recording, replayed;
+    int pipe[2];
+    TwinClient client;
+} Bench;
+
+typedef struct Workload_t
+{
+    const char *name;
+    int (*setup)(Bench * bench);       /* (optional) */
+    void (*frame)(Bench * bench, int n);
+    void (*cleanup)(Bench * bench);    /* (optional) */
+} Workload;
+
+static BenchCount count;
+static int counting;                   /* count syscalls, allocations */
+static int rows = 24, columns = 80;
+static int features = -1;              /* -1: as detected */
+static const char *recording_path;
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t n, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void __libc_free(void *ptr);
+
+
+void *malloc(size_t size)
+{
+    count.allocs += counting;
+    count.alloc_bytes += counting ? size : 0;
+    return __libc_malloc(size);
+}
+
+
+void *calloc(size_t n, size_t size)
+{
+    count.allocs += counting;
+    count.alloc_bytes += counting ? n * size : 0;
+    return __libc_calloc(n, size);
+}
+
+
+void *realloc(void *ptr, size_t size)
+{
+    count.allocs += counting;
+    count.alloc_bytes += counting ? size : 0;
+    return __libc_realloc(ptr, size);
+}
+
+
+void free(void *ptr)
+{
+    __libc_free(ptr);
+}
+
+
+int poll(struct pollfd *fds, nfds_t n_fds, int timeout)
+{
+    static int (*real_poll)(struct pollfd *, nfds_t, int);
+
+    if (real_poll == NULL)
+    {
+        real_poll = (int (*)(struct pollfd *, nfds_t, int))
+            dlsym(RTLD_NEXT, "poll");
+    }
+    count.syscalls += counting;
+    return real_poll(fds, n_fds, timeout);
+}
+
+
+int ioctl(int fd, unsigned long request, ...)
+{
+    static int (*real_ioctl)(int, unsigned long, ...);
+    va_list args;
+    void *arg;
+
+    if (real_ioctl == NULL)
+    {
+        real_ioctl = (int (*)(int, unsigned long, ...))
+            dlsym(RTLD_NEXT, "ioctl");
+    }
+    va_start(args, request);
+    arg = va_arg(args, void *);
+    va_end(args);
+    count.syscalls += counting;
+    return real_ioctl(fd, request, arg);
+}
+
+
+ssize_t read(int fd, void *buffer, size_t size)
+{
+    static ssize_t (*real_read)(int, void *, size_t);
+
+    if (real_read == NULL)
+    {
+        real_read = (ssize_t (*)(int, void *, size_t))
+            dlsym(RTLD_NEXT, "read");
+    }
+    count.syscalls += counting;
+    return real_read(fd, buffer, size);
+}
+
+
+/*
+ * sink_write() --Count the bytes a frame would send.
+ */
+static ssize_t sink_write(void *UNUSED(cookie), const char *UNUSED(data),
+                          size_t size)
+{
+    count.bytes += size;
+    count.syscalls += counting;
+    return (ssize_t) size;
+}
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+
+/*
+ * boxes: --Random line-graphic boxes, as in root-demo.
+ */
+static void boxes_frame(Bench * bench, int UNUSED(n))
+{
+    Twindow *root = bench->root;
+
+    twin_box(root,
+             rand() % (root->geometry.size.row - 3),
+             rand() % (root->geometry.size.column - 8),
+             rand() % 4 + 2, rand() % 8 + 2);
+}
+
+
+/*
+ * colour-cube: --The 216 colour cube, shifting through the palette.
+ */
+static void colour_cube_frame(Bench * bench, int n)
+{
+    Twindow *root = bench->root;
+
+    for (int r = 0; r < 6 && r < root->geometry.size.row; ++r)
+    {
+        twin_cursor(root, r, 0);
+        for (int c = 0; c < 36; ++c)
+        {
+            root->style.bg = 16 + (uint32_t) (r * 36 + c + n) % 216;
+            twin_puts(root, "  ");
+        }
+    }
+    root->style.bg = TWIN_DEFAULT_COLOUR;
+}
+
+
+/*
+ * dashboard: --A grid of numeric fields, a few changing each frame.
+ */
+static void dashboard_frame(Bench * bench, int UNUSED(n))
+{
+    Twindow *root = bench->root;
+    int n_rows = root->geometry.size.row - 1;
+    int n_columns = root->geometry.size.column / 20;
+
+    for (int i = 0; i < n_rows * n_columns / 4; ++i)
+    {
+        int r = rand() % n_rows;
+        int c = rand() % n_columns;
+
+        root->style.fg = (uint32_t) (r + c) % 7 + 1;
+        twin_cursor(root, r, c * 20);
+        twin_puts(root, "cpu");
+        twin_put_fixed(root, rand() % 100000, 2, 8);
+        twin_put_int(root, rand() % 10000, 6);
+    }
+    root->style.fg = TWIN_DEFAULT_COLOUR;
+}
+
+
+/*
+ * repaint: --Every cell changes, every frame.
+ */
+static void repaint_frame(Bench * bench, int n)
+{
+    Twindow *root = bench->root;
+    char line[root->geometry.size.column + 1];
+
+    memset(line, 'a' + n % 26, sizeof(line) - 1);
+    line[sizeof(line) - 1] = '\0';
+    root->style.fg = (uint32_t) n % 7 + 1;
+    for (int r = 0; r < root->geometry.size.row; ++r)
+    {
+        twin_cursor(root, r, 0);
+        twin_puts(root, line);
+    }
+    root->style.fg = TWIN_DEFAULT_COLOUR;
+}
+
+
+/*
+ * scroll-log: --A scrolling log pane, under a status line.
+ */
+static void scroll_log_frame(Bench * bench, int n)
+{
+    Twindow *root = bench->root;
+    TwinRegion log = {
+        {1, 0}, {root->geometry.size.row - 1, root->geometry.size.column - 1}
+    };
+
+    twin_cursor(root, 0, 0);
+    twin_printf(root, "lines: %d", n);
+    twin_scroll(root, log, 1);
+    root->style.fg = (uint32_t) n % 7 + 1;
+    twin_cursor(root, log.max.row, 0);
+    twin_printf(root, "%08d log line, with some text to make it wider", n);
+    root->style.fg = TWIN_DEFAULT_COLOUR;
+}
+
+
+/*
+ * window-tree: --A deep stack of nested windows, composed each frame.
+ */
+static int window_tree_setup(Bench * bench)
+{
+    Twindow *parent = bench->root;
+
+    for (int i = 0; i < BENCH_TREE_DEPTH; ++i)
+    {
+        int height = parent->geometry.size.row - 1;
+        int width = parent->geometry.size.column - 2;
+
+        if (height < 1 || width < 1)
+        {
+            height = width = 1;
+        }
+        twin_init(&bench->tree[i], parent, 1, 2, height, width,
+                  malloc(TWIN_FRAME_SIZE(height, width)));
+        twin_add_child(parent, &bench->tree[i]);
+        parent = &bench->tree[i];
+    }
+    return 1;
+}
+
+
+static void window_tree_frame(Bench * bench, int n)
+{
+    static const TwinCoordinate no_offset = { 0, 0 };
+
+    for (int i = 0; i < 4; ++i)
+    {
+        Twindow *twin = &bench->tree[rand() % BENCH_TREE_DEPTH];
+
+        twin->style.fg = (uint32_t) (n + i) % 7 + 1;
+        twin_cursor(twin, 0, 0);
+        twin_printf(twin, "%d", n);
+    }
+    twin_compose(bench->root, bench->root, no_offset);
+}
+
+
+static void window_tree_cleanup(Bench * bench)
+{
+    bench->root->child = NULL;         /* (root is freed with the xterm) */
+    for (int i = 0; i < BENCH_TREE_DEPTH; ++i)
+    {
+        free(bench->tree[i].frame);
+    }
+}
+
+
+/*
+ * replay: --A recorded TwinServer stream, a frame at a time.
+ */
+static int replay_setup(Bench * bench)
+{
+    struct stat st;
+    int fd;
+
+    if (recording_path == NULL)
+    {
+        return 0;                      /* (nothing to replay) */
+    }
+    if ((fd = open(recording_path, O_RDONLY)) < 0 || fstat(fd, &st) < 0)
+    {
+        log_sys_quit(1, "cannot open \"%s\"", recording_path);
+    }
+    bench->n_recording = (size_t) st.st_size;
+    bench->replayed = 0;
+    if ((bench->recording = malloc(bench->n_recording)) == NULL
+        || read(fd, bench->recording, bench->n_recording)
+        != (ssize_t) bench->n_recording || pipe(bench->pipe) < 0)
+    {
+        log_sys_quit(1, "cannot read \"%s\"", recording_path);
+    }
+    close(fd);
+    init_twin_client(&bench->client, bench->xterm);
+    bench->client.fd = bench->pipe[0];
+    return 1;
+}
+
+
+static void replay_frame(Bench * bench, int UNUSED(n))
+{
+    if (bench->replayed + TWIN_REMOTE_HEADER > bench->n_recording)
+    {
+        bench->replayed = 0;           /* (the snapshot comes first) */
+    }
+
+    const uint8_t *frame = bench->recording + bench->replayed;
+    size_t size = TWIN_REMOTE_HEADER + (frame[5] | frame[6] << 8
+                                        | frame[7] << 16
+                                        | (uint32_t) frame[8] << 24);
+    int saved = counting;
+
+    if (bench->replayed + size > bench->n_recording)
+    {
+        bench->replayed = bench->n_recording;
+        return;                        /* truncated recording */
+    }
+    bench->replayed += size;
+    for (size_t sent = 0; sent < size;)
+    {                                  /* (a pipe holds 64k) */
+        size_t n = (size - sent < 65536) ? size - sent : 65536;
+
+        counting = 0;
+        if (write(bench->pipe[1], frame + sent, n) != (ssize_t) n)
+        {
+            log_sys_quit(1, "cannot write replay pipe");
+        }
+        counting = saved;
+        sent += n;
+        if (twin_client_read(&bench->client) < 0)
+        {
+            log_quit(1, "\"%s\": malformed recording", recording_path);
+        }
+    }
+}
+
+
+static void replay_cleanup(Bench * bench)
+{
+    free_twin_client(&bench->client);
+    close(bench->pipe[0]);
+    close(bench->pipe[1]);
+    free(bench->recording);
+}
+
+
+static const Workload workloads[] = {
+    {"boxes", NULL, boxes_frame, NULL},
+    {"colour-cube", NULL, colour_cube_frame, NULL},
+    {"dashboard", NULL, dashboard_frame, NULL},
+    {"repaint", NULL, repaint_frame, NULL},
+    {"scroll-log", NULL, scroll_log_frame, NULL},
+    {"window-tree", window_tree_setup, window_tree_frame,
+     window_tree_cleanup},
+    {"replay", replay_setup, replay_frame, replay_cleanup},
+};
+
+
+/*
+ * run_workload() --Run one workload, and report its per-frame costs.
+ */
+static void run_workload(const Workload * workload, int n_frames)
+{
+    static const cookie_io_functions_t sink = { NULL, sink_write, NULL, NULL };
+    FILE *output = fopencookie(NULL, "w", sink);
+    Bench bench = { 0 };
+    uint64_t ns = 0;
+
+    if (output == NULL
+        || (bench.xterm = new_xterminator(-1, output)) == NULL)
+    {
+        log_sys_quit(1, "cannot initialise terminal");
+    }
+    bench.root = &bench.xterm->root;
+    if (features >= 0)
+    {
+        bench.xterm->features = features;
+    }
+    open_xterminator(bench.xterm);
+    srand(0);
+    if (workload->setup != NULL && !workload->setup(&bench))
+    {
+        free_xterminator(bench.xterm);
+        fclose(output);
+        return;
+    }
+
+    for (int n = 0; n < BENCH_WARMUP + n_frames; ++n)
+    {
+        uint64_t start;
+
+        if (n == BENCH_WARMUP)
+        {
+            memset(&count, 0, sizeof(count));
+            counting = 1;
+        }
+        start = now_ns();
+        workload->frame(&bench, n);
+        xterm_sync(bench.xterm);
+        ns += (n >= BENCH_WARMUP) ? now_ns() - start : 0;
+    }
+    counting = 0;
+
+    printf("{\"workload\": \"%s\", \"rows\": %d, \"columns\": %d, "
+           "\"frames\": %d, \"ns_per_frame\": %.1f, "
+           "\"bytes_per_frame\": %.1f, \"syscalls_per_frame\": %.2f, "
+           "\"allocs_per_frame\": %.3f, \"alloc_bytes_per_frame\": %.1f}\n",
+           workload->name, rows, columns, n_frames,
+           (double) ns / n_frames, (double) count.bytes / n_frames,
+           (double) count.syscalls / n_frames,
+           (double) count.allocs / n_frames,
+           (double) count.alloc_bytes / n_frames);
+    fflush(stdout);
+
+    if (workload->cleanup != NULL)
+    {
+        workload->cleanup(&bench);
+    }
+    free_xterminator(bench.xterm);
+    fclose(output);
+}
+
+
+int main(int argc, char *argv[])
+{
+    int n_frames = BENCH_FRAMES;
+    char size[16];
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:s:F:r:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'n':
+            n_frames = atoi(optarg);
+            break;
+        case 's':
+            if (sscanf(optarg, "%d,%d", &rows, &columns) != 2)
+            {
+                log_quit(2, "bad size \"%s\" (use rows,columns)", optarg);
+            }
+            break;
+        case 'F':
+            features = (int) strtol(optarg, NULL, 0);
+            break;
+        case 'r':
+            recording_path = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n frames] [-s rows,columns] "
+                    "[-F features] [-r recording] [workload...]\n", argv[0]);
+            return 2;
+        }
+    }
+    if (n_frames < 1 || rows < 8 || columns < 40)
+    {
+        log_quit(2, "too few frames, or too small a screen");
+    }
+    snprintf(size, sizeof(size), "%d", rows);
+    setenv("LINES", size, 1);          /* (the sink isn't a tty) */
+    snprintf(size, sizeof(size), "%d", columns);
+    setenv("COLUMNS", size, 1);
+
+    for (size_t i = 0; i < NEL(workloads); ++i)
+    {
+        int selected = (optind == argc);
+
+        for (int arg = optind; arg < argc; ++arg)
+        {
+            selected |= (strcmp(argv[arg], workloads[i].name) == 0);
+        }
+        if (selected)
+        {
+            run_workload(&workloads[i], n_frames);
+        }
+    }
+    return 0;
+}
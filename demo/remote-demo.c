@@ -0,0 +1,123 @@
+/*
+ * REMOTE-DEMO.C --Demo program for remote rendering.
+ *
+ * Usage:
+ * remote-demo serve address  --draw a log into a headless root window
+ * remote-demo view address   --render a server's frames on this terminal
+ *
+ * The address is a Unix socket path, or "host:port".
+ */
+#include <unistd.h>
+#include <stdio.h>
+#include <poll.h>
+#include <signal.h>
+
+#include <apex.h>
+#include <apex/log.h>
+#include <xterminator.h>
+#include <twremote.h>
+#include <twheel.h>
+
+#define SERVE_ROWS 24
+#define SERVE_COLUMNS 80
+
+static Xterminator xterm;
+
+
+static void exit_gracefully(int UNUSED(signal))
+{
+    close_xterminator(&xterm);
+    exit(0);
+}
+
+
+/*
+ * serve() --Draw a scrolling log, and stream it to any viewers.
+ */
+static int serve(const char *address)
+{
+    static TwinStyle frame[TWIN_FRAME_SIZE(SERVE_ROWS, SERVE_COLUMNS)
+                           / sizeof(TwinStyle)];
+    static const TwinRegion log = {
+        {2, 0}, {SERVE_ROWS - 1, SERVE_COLUMNS - 1}
+    };
+    Twindow root;
+    TwinServer server;
+
+    twin_init(&root, NULL, 0, 0, SERVE_ROWS, SERVE_COLUMNS, frame);
+    init_twin_server(&server, &root);
+    server.compress = 1;
+    if (twin_server_listen(&server, address) < 0)
+    {
+        log_sys_quit(1, "cannot listen on \"%s\"", address);
+    }
+    for (unsigned long n = 0;; ++n)
+    {
+        struct pollfd client = { server.fd, POLLIN, 0 };
+
+        poll(&client, 1, 100);
+        twin_server_accept(&server);
+
+        root.style.fg = 6;
+        twin_cursor(&root, 0, 0);
+        twin_printf(&root, "time: %llu ms, %zu bytes sent",
+                    (unsigned long long) twin_clock(), server.bytes);
+        twin_scroll(&root, log, 1);
+        root.style.fg = (int) (n % 7) + 1;
+        twin_cursor(&root, SERVE_ROWS - 1, 0);
+        twin_printf(&root, "log line %lu", n);
+        twin_server_sync(&server);
+    }
+    return 0;
+}
+
+
+/*
+ * view() --Render a server's frames on this terminal.
+ */
+static int view(const char *address)
+{
+    TwinClient client;
+
+    if (xterminator_init(&xterm, STDIN_FILENO, stdout) == NULL)
+    {
+        log_sys_quit(1, "cannot initialise terminal");
+    }
+    init_twin_client(&client, &xterm);
+    if (twin_client_connect(&client, address) < 0)
+    {
+        log_sys_quit(1, "cannot connect to \"%s\"", address);
+    }
+    open_xterminator(&xterm);
+    signal(SIGINT, exit_gracefully);
+    signal(SIGQUIT, exit_gracefully);
+
+    for (;;)
+    {
+        struct pollfd server = { client.fd, POLLIN, 0 };
+
+        poll(&server, 1, xterm_sync_timeout(&xterm));
+        if (twin_client_read(&client) < 0)
+        {
+            break;                     /* server has gone */
+        }
+        xterm_sync(&xterm);
+    }
+    exit_gracefully(0);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp(argv[1], "serve") == 0)
+    {
+        return serve(argv[2]);
+    }
+    if (argc == 3 && strcmp(argv[1], "view") == 0)
+    {
+        return view(argv[2]);
+    }
+    fprintf(stderr, "usage: %s serve|view address\n", argv[0]);
+    return 2;
+}
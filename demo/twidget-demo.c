@@ -3,6 +3,7 @@
  */
 #include <unistd.h>
 #include <stdio.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/ioctl.h>
 
@@ -10,16 +11,43 @@
 #include <apex/log.h>
 #include <xterminator.h>
 #include <twidget.h>
+#include <twheel.h>
 
 static int resize_signal;
 static Xterminator xterm;
 static TwidgetText poem;
 static TwinGeometry poem_geometry = { {10, 20}, {4, 20} };
+static TwidgetQueue queue;
+static TwinWheel wheel;
+static TwidgetMetric spark, bar, gauge, heat;
+static TwinTimer spark_timer, bar_timer, gauge_timer, heat_timer;
+static TwinGeometry spark_geometry = { {2, 20}, {2, 30} };
+static TwinGeometry bar_geometry = { {5, 20}, {1, 30} };
+static TwinGeometry gauge_geometry = { {6, 20}, {1, 30} };
+static TwinGeometry heat_geometry = { {7, 20}, {1, 30} };
 
 const char poem_text[] =
     "The boy stood on the burning deck,\nwith a pocket full of crackers";
 
 
+/*
+ * sample_control() --Add a random-walk sample to a metric, on ticks.
+ */
+static int sample_control(Twindow * twin, TwinEvent event, void *UNUSED(arg))
+{
+    static int value = 50;
+
+    if (event != twin_tick)
+    {
+        return 0;
+    }
+    value += rand() % 21 - 10;
+    value = (value < 0) ? 0 : (value > 99) ? 99 : value;
+    twidget_metric_add((TwidgetMetric *) twin, value);
+    return 1;
+}
+
+
 static void xterminate(void)
 {
     close_xterminator(&xterm);
@@ -75,8 +103,57 @@ int main(int argc, char *argv[])
     }
     open_xterminator(&xterm);
     init_twidget_text(&poem, "poem", &xterm.root, &poem_geometry, poem_text);
+    init_twidget_spark(&spark, "spark", &xterm.root, &spark_geometry, 0, 99);
+    init_twidget_bar(&bar, "bar", &xterm.root, &bar_geometry, 0, 99);
+    init_twidget_gauge(&gauge, "gauge", &xterm.root, &gauge_geometry, 0, 99);
+    init_twidget_heat(&heat, "heat", &xterm.root, &heat_geometry, 0, 99);
+    init_twidget_queue(&queue);
+    twidget_queue_attach(&queue, &poem.widget);
+    twidget_queue_attach(&queue, &spark.widget);
+    twidget_queue_attach(&queue, &bar.widget);
+    twidget_queue_attach(&queue, &gauge.widget);
+    twidget_queue_attach(&queue, &heat.widget);
+
+    init_twin_wheel(&wheel, twin_clock());
+    spark.widget.control = sample_control;
+    bar.widget.control = sample_control;
+    gauge.widget.control = sample_control;
+    heat.widget.control = sample_control;
+    twin_timer_start(&wheel, &spark_timer, &spark.widget, 50, 50);
+    twin_timer_start(&wheel, &bar_timer, &bar.widget, 100, 100);
+    twin_timer_start(&wheel, &gauge_timer, &gauge.widget, 250, 250);
+    twin_timer_start(&wheel, &heat_timer, &heat.widget, 1000, 1000);
+
+    for (uint64_t end = twin_clock() + 30000; twin_clock() < end;)
+    {
+        static const TwinCoordinate no_offset = { 0, 0 };
+        int timeout = twin_wheel_timeout(&wheel, twin_clock());
+        int sync_timeout = xterm_sync_timeout(&xterm);
+        int read_timeout = xterm_read_timeout(&xterm);
+
+        if (sync_timeout >= 0 && (timeout < 0 || sync_timeout < timeout))
+        {                              /* a frame was deferred: retry */
+            timeout = sync_timeout;
+        }
+        if (read_timeout >= 0 && (timeout < 0 || read_timeout < timeout))
+        {                              /* input is held back: release it */
+            timeout = read_timeout;
+        }
+        struct pollfd input = { xterm.input, POLLIN, 0 };
 
-    xterm_sync(&xterm);
+        if ((poll(&input, 1, timeout) == 1 && (input.revents & POLLIN))
+            || (read_timeout >= 0 && xterm_read_timeout(&xterm) == 0))
+        {                              /* (picks up capability replies) */
+            char key[XT_PROBE_PENDING];
+
+            xterm_read(&xterm, key, sizeof(key));
+        }
+        twin_wheel_advance(&wheel, twin_clock());
+        twidget_queue_dispatch(&queue);
+        twidget_queue_draw(&queue);    /* only what changed */
+        twin_compose(&xterm.root, &xterm.root, no_offset);
+        xterm_sync(&xterm);
+    }
     sleep(500);
     exit_gracefully(0);
 }
@@ -0,0 +1,151 @@
+/*
+ * TWCANVAS.C --Large, sparse windows, seen through a viewport.
+ *
+ * Contents:
+ * init_twin_canvas()  --Initialise a canvas window, with its viewport.
+ * free_twin_canvas()  --Release a canvas window's tiles.
+ * twin_canvas_pan()   --Move the viewport over the canvas.
+ * twin_canvas_tile()  --Get the tile containing a cell.
+ * twin_canvas_clear() --Release all tiles, leaving the canvas blank.
+ *
+ * Remarks:
+ * The tile index is dense (a pointer per tile), which is small: a
+ * 10000x10000 canvas needs 100k pointers; the tiles themselves are
+ * only allocated when written.  twin_compose() copies the viewport
+ * tile by tile (see twin.c).
+ */
+#include <apex.h>
+#include <apex/log.h>
+#include "twcanvas.h"
+
+extern inline int twin_tile_cell(int row, int column);
+
+
+/*
+ * init_twin_canvas() --Initialise a canvas window, with its viewport.
+ *
+ * Parameters:
+ * twin          --the window to initialise
+ * canvas        --the canvas's tile store
+ * parent        --the parent window (composed onto), or NULL
+ * row, column   --the viewport's position, in the parent
+ * height, width --the viewport's size (at most the canvas's)
+ * canvas_rows, canvas_columns --the canvas's (logical) size
+ *
+ * Returns: (Twindow *)
+ * Success: twin; Failure: NULL.
+ */
+Twindow *init_twin_canvas(Twindow * twin, TwinCanvas * canvas,
+                          Twindow * parent, int row, int column,
+                          int height, int width,
+                          int canvas_rows, int canvas_columns)
+{
+    memset(canvas, 0, sizeof(*canvas));
+    canvas->tile_rows = (canvas_rows + TWIN_TILE_ROWS - 1) / TWIN_TILE_ROWS;
+    canvas->tile_columns =
+        (canvas_columns + TWIN_TILE_COLUMNS - 1) / TWIN_TILE_COLUMNS;
+    canvas->tile = calloc((size_t) canvas->tile_rows * canvas->tile_columns,
+                          sizeof(TwinTile *));
+    if (canvas->tile == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return NULL;
+    }
+    canvas->viewport.size.row = (height > canvas_rows) ? canvas_rows : height;
+    canvas->viewport.size.column =
+        (width > canvas_columns) ? canvas_columns : width;
+    canvas->composed.row = canvas->composed.column = -1;    /* never */
+
+    twin_init(twin, parent, row, column, canvas_rows, canvas_columns, NULL);
+    twin->canvas = canvas;
+    return twin;
+}
+
+
+void free_twin_canvas(Twindow * twin)
+{
+    TwinCanvas *canvas = twin->canvas;
+
+    if (canvas != NULL)
+    {
+        twin_canvas_clear(canvas);
+        free(canvas->tile);
+        canvas->tile = NULL;
+        twin->canvas = NULL;
+    }
+}
+
+
+/*
+ * twin_canvas_pan() --Move the viewport over the canvas.
+ *
+ * Parameters:
+ * twin        --the canvas window
+ * row, column --the canvas cell to show at the viewport's top-left
+ *
+ * Remarks:
+ * The offset is clamped so the viewport stays within the canvas.
+ * Nothing is redrawn: the next twin_compose() shows the new view.
+ */
+Twindow *twin_canvas_pan(Twindow * twin, int row, int column)
+{
+    TwinCanvas *canvas = twin->canvas;
+    int max_row = twin->geometry.size.row - canvas->viewport.size.row;
+    int max_column = twin->geometry.size.column - canvas->viewport.size.column;
+
+    row = (row > max_row) ? max_row : row;
+    column = (column > max_column) ? max_column : column;
+    canvas->viewport.position.row = (row < 0) ? 0 : row;
+    canvas->viewport.position.column = (column < 0) ? 0 : column;
+    return twin;
+}
+
+
+/*
+ * twin_canvas_tile() --Get the tile containing a cell.
+ *
+ * Parameters:
+ * canvas      --the canvas
+ * row, column --the cell (which must be within the canvas)
+ * alloc       --if set, allocate the tile if it doesn't exist
+ *
+ * Returns: (TwinTile *)
+ * The tile, or NULL if it's blank (and alloc isn't set), or there's
+ * no memory.
+ */
+TwinTile *twin_canvas_tile(TwinCanvas * canvas, int row, int column,
+                           int alloc)
+{
+    TwinTile **slot = &canvas->tile[(row / TWIN_TILE_ROWS)
+                                    * canvas->tile_columns
+                                    + column / TWIN_TILE_COLUMNS];
+
+    if (*slot == NULL && alloc)
+    {
+        TwinTile *tile = malloc(sizeof(TwinTile));
+
+        if (tile == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            return NULL;
+        }
+        memset(tile->styles, 0, sizeof(tile->styles));  /* TWIN_STYLE_BLANK */
+        memset(tile->glyphs, ' ', sizeof(tile->glyphs));
+        *slot = tile;
+        canvas->n_tile += 1;
+    }
+    return *slot;
+}
+
+
+void twin_canvas_clear(TwinCanvas * canvas)
+{
+    size_t n = (size_t) canvas->tile_rows * canvas->tile_columns;
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        free(canvas->tile[i]);
+        canvas->tile[i] = NULL;
+    }
+    canvas->n_tile = 0;
+}
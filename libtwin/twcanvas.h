@@ -0,0 +1,61 @@
+/*
+ * TWCANVAS.H --Large, sparse windows, seen through a viewport.
+ *
+ * Remarks:
+ * A canvas is a Twindow whose geometry.size is its logical size,
+ * which can be much larger than the screen; it's drawn with the usual
+ * twin_*() calls, in canvas coordinates.  Its cells are kept in tiles
+ * that are allocated on first write (unwritten tiles read as blank),
+ * so memory is proportional to the content.
+ *
+ * Only the viewport is composed onto the parent, at the window's
+ * position; panning moves the viewport, so the app doesn't redraw.
+ */
+#ifndef TWCANVAS_H
+#define TWCANVAS_H
+
+#include <stddef.h>
+#include <twin.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+#define TWIN_TILE_ROWS 16
+#define TWIN_TILE_COLUMNS 64
+#define TWIN_TILE_CELLS (TWIN_TILE_ROWS * TWIN_TILE_COLUMNS)
+
+    typedef struct TwinTile_t
+    {
+        TwinStyle styles[TWIN_TILE_CELLS];
+        uint8_t glyphs[TWIN_TILE_CELLS];
+    } TwinTile;
+
+    typedef struct TwinCanvas_t
+    {
+        TwinTile **tile;               /* by tile row, column; NULL: blank */
+        int tile_rows, tile_columns;
+        size_t n_tile;                 /* tiles allocated */
+        TwinGeometry viewport;         /* position: offset in the canvas */
+        TwinCoordinate composed;       /* viewport offset, when composed */
+    } TwinCanvas;
+
+    Twindow *init_twin_canvas(Twindow * twin, TwinCanvas * canvas,
+                              Twindow * parent, int row, int column,
+                              int height, int width,
+                              int canvas_rows, int canvas_columns);
+    void free_twin_canvas(Twindow * twin);
+    Twindow *twin_canvas_pan(Twindow * twin, int row, int column);
+    TwinTile *twin_canvas_tile(TwinCanvas * canvas, int row, int column,
+                               int alloc);
+    void twin_canvas_clear(TwinCanvas * canvas);
+
+    inline int twin_tile_cell(int row, int column)
+    {
+        return (row % TWIN_TILE_ROWS) * TWIN_TILE_COLUMNS
+            + column % TWIN_TILE_COLUMNS;
+    }
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWCANVAS_H */
@@ -0,0 +1,390 @@
+/*
+ * TWHEEL.C --A hierarchical timing wheel, for widget ticks.
+ *
+ * Contents:
+ * init_twin_wheel()     --Initialise an empty timing wheel.
+ * twin_timer_start()    --Start (or restart) a timer.
+ * twin_timer_cancel()   --Stop a timer.
+ * twin_wheel_advance()  --Advance time, expiring timers.
+ * twin_wheel_deadline() --Get the time of the next expiry.
+ * twin_wheel_timeout()  --Get the time until the next expiry, for poll().
+ *
+ * Remarks:
+ * A timer is filed at level k if its expiry differs from now only in
+ * the bits of levels 0..k, in the slot given by its level k bits.  So
+ * level 0 holds the timers due in the current 64ms, level 1 those due
+ * in the current 4s, and so on; timers beyond the top level wait on
+ * the overflow list.  When time crosses a level k slot boundary, that
+ * slot's timers are refiled (cascaded) into the lower levels.
+ *
+ * The occupied bitmaps make finding the next occupied slot O(levels),
+ * so advancing jumps straight over idle time, and an event loop can
+ * sleep until exactly the next deadline.
+ */
+#include <apex.h>
+#include <apex/log.h>
+#include "twheel.h"
+
+#define LEVEL_SHIFT(level) ((level) * TWHEEL_BITS)
+#define TOP_SHIFT LEVEL_SHIFT(TWHEEL_LEVELS)
+
+/*
+ * init_twin_wheel() --Initialise an empty timing wheel.
+ */
+TwinWheel *init_twin_wheel(TwinWheel * wheel, uint64_t now)
+{
+    memset(wheel, 0, sizeof(*wheel));
+    wheel->now = now;
+    return wheel;
+}
+
+
+static void wheel_link(TwinTimer ** head, TwinTimer * timer)
+{
+    timer->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+
+/*
+ * wheel_file() --File a timer in the slot for its expiry.
+ */
+static void wheel_file(TwinWheel * wheel, TwinTimer * timer)
+{
+    uint64_t diff = timer->expires ^ wheel->now;
+
+    for (int level = 0; level < TWHEEL_LEVELS; ++level)
+    {
+        if ((diff >> LEVEL_SHIFT(level + 1)) == 0)
+        {
+            int slot = (int) ((timer->expires >> LEVEL_SHIFT(level))
+                              & (TWHEEL_SIZE - 1));
+
+            timer->level = level;
+            timer->slot = slot;
+            wheel_link(&wheel->slot[level][slot], timer);
+            wheel->occupied[level] |= (uint64_t) 1 << slot;
+            return;
+        }
+    }
+    timer->level = TWHEEL_LEVELS;      /* i.e. overflow */
+    timer->slot = 0;
+    wheel_link(&wheel->overflow, timer);
+}
+
+
+/*
+ * wheel_unlink() --Remove a timer from its slot.
+ */
+static void wheel_unlink(TwinWheel * wheel, TwinTimer * timer)
+{
+    *timer->pprev = timer->next;
+    if (timer->next != NULL)
+    {
+        timer->next->pprev = timer->pprev;
+    }
+    if (timer->level < TWHEEL_LEVELS
+        && wheel->slot[timer->level][timer->slot] == NULL)
+    {
+        wheel->occupied[timer->level] &= ~((uint64_t) 1 << timer->slot);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+
+/*
+ * timer_detach() --Remove a timer from its widget's running timers.
+ */
+static void timer_detach(TwinTimer * timer)
+{
+    if (timer->widget == NULL)
+    {
+        return;
+    }
+    for (TwinTimer ** link = &timer->widget->timer; *link != NULL;
+         link = &(*link)->sibling)
+    {
+        if (*link == timer)
+        {
+            *link = timer->sibling;
+            break;
+        }
+    }
+    timer->sibling = NULL;
+}
+
+
+/*
+ * twin_timer_start() --Start (or restart) a timer.
+ *
+ * Parameters:
+ * wheel    --the timing wheel
+ * timer    --the timer (owned by the caller)
+ * widget   --the widget to send twin_tick events to
+ * delay    --ms until the first expiry
+ * interval --ms between subsequent expiries, or 0 for a one-shot
+ */
+void twin_timer_start(TwinWheel * wheel, TwinTimer * timer, Twidget * widget,
+                      unsigned int delay, unsigned int interval)
+{
+    if (timer->pprev != NULL)
+    {
+        twin_timer_cancel(wheel, timer);
+    }
+    timer->widget = widget;
+    timer->wheel = wheel;
+    if (widget != NULL)
+    {                                  /* (so freeing it can cancel us) */
+        timer->sibling = widget->timer;
+        widget->timer = timer;
+    }
+    timer->interval = interval;
+    timer->expires = wheel->now + (delay > 0 ? delay : 1);
+    wheel_file(wheel, timer);
+    ++wheel->n_timer;
+}
+
+
+/*
+ * twin_timer_cancel() --Stop a timer.
+ */
+void twin_timer_cancel(TwinWheel * wheel, TwinTimer * timer)
+{
+    if (timer->pprev != NULL)
+    {
+        wheel_unlink(wheel, timer);
+        timer_detach(timer);
+        --wheel->n_timer;
+    }
+}
+
+
+/*
+ * wheel_refile() --Refile every timer in a list (a slot, or overflow).
+ */
+static void wheel_refile(TwinWheel * wheel, TwinTimer ** head)
+{
+    TwinTimer *timer = *head;
+
+    *head = NULL;
+    while (timer != NULL)
+    {
+        TwinTimer *next = timer->next;
+
+        wheel_file(wheel, timer);
+        timer = next;
+    }
+}
+
+
+/*
+ * wheel_expire() --Deliver a twin_tick to an expired timer's widget.
+ *
+ * Parameters:
+ * wheel    --the timing wheel
+ * timer    --the expired timer
+ * now      --the caller's time (ms), which may be past the expiry
+ */
+static void wheel_expire(TwinWheel * wheel, TwinTimer * timer, uint64_t now)
+{
+    Twidget *widget = timer->widget;
+
+    --wheel->n_timer;
+    if (timer->interval > 0)
+    {                                  /* periodic: skip missed ticks */
+        uint64_t late = now - timer->expires;
+
+        timer->expires = now + timer->interval - late % timer->interval;
+        wheel_file(wheel, timer);
+        ++wheel->n_timer;
+    }
+    else
+    {
+        timer_detach(timer);           /* one-shot: done */
+    }
+    if (widget == NULL)
+    {
+        return;
+    }
+    if (!twidget_post(widget, twin_tick, timer)
+        && widget->control != NULL
+        && widget->control(&widget->window, twin_tick, timer))
+    {                                  /* no queue: deliver directly */
+        twidget_invalidate(widget);
+    }
+}
+
+
+/*
+ * wheel_step() --Move to a deadline, cascading slots, and expiring timers.
+ *
+ * Parameters:
+ * wheel    --the timing wheel
+ * deadline --the time to move to (the next slot that needs attention)
+ * now      --the caller's time, for rescheduling periodic timers
+ */
+static int wheel_step(TwinWheel * wheel, uint64_t deadline, uint64_t now)
+{
+    int n = 0;
+    int slot = (int) (deadline & (TWHEEL_SIZE - 1));
+    TwinTimer *timer;
+
+    wheel->now = deadline;
+    if ((deadline & (((uint64_t) 1 << TOP_SHIFT) - 1)) == 0)
+    {
+        wheel_refile(wheel, &wheel->overflow);
+    }
+    for (int level = TWHEEL_LEVELS - 1; level > 0; --level)
+    {
+        if ((deadline & (((uint64_t) 1 << LEVEL_SHIFT(level)) - 1)) == 0)
+        {                              /* crossed a slot boundary */
+            int s = (int) ((deadline >> LEVEL_SHIFT(level))
+                           & (TWHEEL_SIZE - 1));
+
+            wheel->occupied[level] &= ~((uint64_t) 1 << s);
+            wheel_refile(wheel, &wheel->slot[level][s]);
+        }
+    }
+
+    timer = wheel->slot[0][slot];
+    wheel->slot[0][slot] = NULL;
+    wheel->occupied[0] &= ~((uint64_t) 1 << slot);
+    while (timer != NULL)
+    {
+        TwinTimer *next = timer->next;
+
+        timer->next = NULL;
+        timer->pprev = NULL;
+        wheel_expire(wheel, timer, now);
+        timer = next;
+        ++n;
+    }
+    return n;
+}
+
+
+/*
+ * wheel_next() --Get the time of the next slot that needs attention.
+ *
+ * Returns: (uint64_t)
+ * The time (ms), or TWHEEL_NEVER if there are no timers.
+ *
+ * Remarks:
+ * For level 0 this is an expiry; for higher levels it's the start of
+ * the first occupied slot, when that slot must be cascaded.  The
+ * lowest occupied level always has the earliest.
+ */
+static uint64_t wheel_next(TwinWheel * wheel, TwinTimer ** head)
+{
+    for (int level = 0; level < TWHEEL_LEVELS; ++level)
+    {
+        int shift = LEVEL_SHIFT(level);
+        int current = (int) ((wheel->now >> shift) & (TWHEEL_SIZE - 1));
+        uint64_t later = (current == TWHEEL_SIZE - 1) ? 0
+            : wheel->occupied[level] & (~(uint64_t) 0 << (current + 1));
+
+        if (later != 0)
+        {
+            uint64_t base = wheel->now >> (shift + TWHEEL_BITS)
+                << (shift + TWHEEL_BITS);
+            int slot = __builtin_ctzll(later);
+
+            *head = wheel->slot[level][slot];
+            return base | ((uint64_t) slot << shift);
+        }
+    }
+    *head = wheel->overflow;
+    if (wheel->overflow != NULL)
+    {                                  /* the next top-level wrap */
+        return ((wheel->now >> TOP_SHIFT) + 1) << TOP_SHIFT;
+    }
+    return TWHEEL_NEVER;
+}
+
+
+/*
+ * twin_wheel_deadline() --Get the time of the next expiry.
+ *
+ * Returns: (uint64_t)
+ * The time (ms), or TWHEEL_NEVER if there are no timers.
+ *
+ * Remarks:
+ * The next expiry is in the first occupied slot of the lowest
+ * occupied level, so only that slot's timers are examined.
+ */
+uint64_t twin_wheel_deadline(TwinWheel * wheel)
+{
+    TwinTimer *timer;
+    uint64_t deadline = TWHEEL_NEVER;
+
+    wheel_next(wheel, &timer);
+    for (; timer != NULL; timer = timer->next)
+    {
+        if (timer->expires < deadline)
+        {
+            deadline = timer->expires;
+        }
+    }
+    return deadline;
+}
+
+
+/*
+ * twin_wheel_advance() --Advance time, expiring timers.
+ *
+ * Returns: (int)
+ * The number of timers that expired.
+ *
+ * Remarks:
+ * Time jumps from deadline to deadline, so the cost depends on the
+ * number of timers that expire, not the time elapsed.  A periodic
+ * timer that's late (e.g. after a stall) expires once, and is
+ * rescheduled for its next period after now: the missed ticks are
+ * skipped.
+ */
+int twin_wheel_advance(TwinWheel * wheel, uint64_t now)
+{
+    int n = 0;
+
+    while (wheel->now < now)
+    {
+        TwinTimer *head;
+        uint64_t deadline = wheel_next(wheel, &head);
+
+        if (deadline > now)
+        {
+            wheel->now = now;          /* nothing due: jump */
+            break;
+        }
+        n += wheel_step(wheel, deadline, now);
+    }
+    return n;
+}
+
+
+/*
+ * twin_wheel_timeout() --Get the time until the next expiry, for poll().
+ *
+ * Returns: (int)
+ * The time (ms), or -1 if there are no timers.
+ */
+int twin_wheel_timeout(TwinWheel * wheel, uint64_t now)
+{
+    uint64_t deadline = twin_wheel_deadline(wheel);
+
+    if (deadline == TWHEEL_NEVER)
+    {
+        return -1;
+    }
+    if (deadline <= now)
+    {
+        return 0;
+    }
+    return (deadline - now > INT32_MAX) ? INT32_MAX : (int) (deadline - now);
+}
@@ -0,0 +1,57 @@
+/*
+ * TWHEEL.H --A hierarchical timing wheel, for widget ticks.
+ *
+ * Remarks:
+ * Timers are kept in 4 levels of 64 slots, at a resolution of 1ms;
+ * starting and cancelling a timer are O(1).  Expired timers post a
+ * twin_tick event to their widget, so expiries within a frame are
+ * coalesced by the widget's queue.
+ */
+#ifndef TWHEEL_H
+#define TWHEEL_H
+
+#include <stdint.h>
+#include <twidget.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+#define TWHEEL_BITS 6
+#define TWHEEL_SIZE (1 << TWHEEL_BITS) /* slots per level */
+#define TWHEEL_LEVELS 4
+#define TWHEEL_NEVER UINT64_MAX
+
+    typedef struct TwinTimer_t
+    {
+        struct TwinTimer_t *next;
+        struct TwinTimer_t **pprev;    /* NULL: not running */
+        uint64_t expires;              /* time (ms) */
+        unsigned int interval;         /* ms, or 0 for a one-shot */
+        int level, slot;               /* where it's filed */
+        Twidget *widget;               /* gets the twin_tick event */
+        struct TwinWheel_t *wheel;     /* the wheel it's running on */
+        struct TwinTimer_t *sibling;   /* next of widget's running timers */
+    } TwinTimer;
+
+    typedef struct TwinWheel_t
+    {
+        uint64_t now;                  /* time (ms) */
+        TwinTimer *slot[TWHEEL_LEVELS][TWHEEL_SIZE];
+        uint64_t occupied[TWHEEL_LEVELS];  /* non-empty slots (bits) */
+        TwinTimer *overflow;           /* beyond the top level */
+        int n_timer;                   /* running timers */
+    } TwinWheel;
+
+    TwinWheel *init_twin_wheel(TwinWheel * wheel, uint64_t now);
+    void twin_timer_start(TwinWheel * wheel, TwinTimer * timer,
+                          Twidget * widget, unsigned int delay,
+                          unsigned int interval);
+    void twin_timer_cancel(TwinWheel * wheel, TwinTimer * timer);
+    int twin_wheel_advance(TwinWheel * wheel, uint64_t now);
+    uint64_t twin_wheel_deadline(TwinWheel * wheel);
+    int twin_wheel_timeout(TwinWheel * wheel, uint64_t now);
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWHEEL_H */
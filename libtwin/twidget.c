@@ -2,13 +2,51 @@
  * TWIDGET.C --Routines for Text Widgets.
  *
  * Contents:
+ * init_twidget()        --Initialise a widget, and attach it to its parent.
+ * twidget_draw()        --Run a stale widget's draw proc.
+ * twidget_invalidate()  --Note that a widget's model has changed.
+ * init_twidget_queue()  --Initialise an empty event queue.
+ * twidget_queue_attach() --Attach a widget to an event queue.
+ * twidget_queue_cancel() --Cancel a widget's queued events and pending redraw.
+ * twidget_post()        --Queue an event for a widget.
+ * twidget_queue_dispatch() --Deliver the queued events to their widgets.
+ * twidget_queue_draw()  --Draw the widgets on the dirty list.
+ * init_twidget_spark()  --Initialise a sparkline metric widget.
+ * init_twidget_bar()    --Initialise a horizontal bar metric widget.
+ * init_twidget_gauge()  --Initialise a gauge metric widget.
+ * init_twidget_heat()   --Initialise a heat-strip metric widget.
+ * twidget_metric_add()  --Add a sample to a metric widget.
+ * init_twidget_log()    --Initialise a log pane widget.
+ * twidget_log_append()  --Append a line of text to a log pane.
+ * init_twidget_view()   --Initialise a text view of a buffer.
+ * init_twidget_view_file() --Initialise a text view of a (mapped) file.
+ * twidget_view_refresh() --Catch up with a file that has grown.
+ * twidget_view_goto()   --Move the view to a line and column.
+ * twidget_view_scroll() --Move the view by some lines.
+ * twidget_view_tail()   --Move the view to the end of the text.
+ * init_twidget_table()  --Initialise a virtual table widget.
+ * twidget_table_fix()   --Pin some rows and columns of a table.
+ * twidget_table_goto()  --Move a table to a row and column.
+ * twidget_table_scroll() --Move a table by some rows.
+ * twidget_table_refresh() --Note that a table's data has changed.
+ * twidget_table_invalidate() --Discard a table's rendered rows.
  *
  * Remarks:
+ * Metric widgets draw with the VT100 line-graphics glyphs (see
+ * TermGraphic): scan lines for sparklines, the checker block for bars,
+ * the horizontal line and diamond for gauges.  Heat strips use RGB
+ * background colours.
  */
 #include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <apex.h>
 #include <apex/log.h>
 #include "twidget.h"
+#include "twheel.h"
+#include "twutf8.h"
+#include "xterminator.h"
 
 
 Twidget *init_twidget(Twidget * widget, const char *name, Twindow * parent,
@@ -20,22 +58,286 @@ Twidget *init_twidget(Twidget * widget, const char *name, Twindow * parent,
 
     if (parent != NULL)
     {
+        void *frame = malloc(TWIN_FRAME_SIZE(geometry->size.row,
+                                             geometry->size.column));
+
+        if (frame == NULL)
+        {
+            return NULL;               /* failure: no memory */
+        }
+        twin_init(twin, parent,
+                  geometry->position.row, geometry->position.column,
+                  geometry->size.row, geometry->size.column, frame);
         widget->name = name;
-        twin->parent = parent;
         twin_add_child(parent, twin);
-        twin->geometry = *geometry;
         widget->control = control;
         return widget;                 /* success: return initialised  */
     }
     return NULL;                       /* failure: no parent */
 }
 
+
+/*
+ * twidget_draw() --Run a stale widget's draw proc.
+ *
+ * Returns: (int)
+ * 1 if the widget was drawn, 0 otherwise.
+ */
+int twidget_draw(Twidget * widget)
+{
+    Twindow *twin = &widget->window;
+
+    if (!(twin->state & TwinStale) || widget->draw == NULL)
+    {
+        return 0;                      /* nothing to do */
+    }
+    twin->state &= ~TwinStale;
+    widget->draw(twin, twin_draw, NULL);
+    return 1;
+}
+
+
+#define TWIDGET_DIRTY (1u << 31)       /* Twidget.pending: on dirty list */
+
+/*
+ * twidget_invalidate() --Note that a widget's model has changed.
+ *
+ * Remarks:
+ * If the widget is attached to a queue, it's put on the queue's dirty
+ * list (once); otherwise the caller must twidget_draw() it.
+ */
+void twidget_invalidate(Twidget * widget)
+{
+    widget->window.state |= TwinStale;
+    if (widget->queue != NULL && !(widget->pending & TWIDGET_DIRTY))
+    {
+        widget->pending |= TWIDGET_DIRTY;
+        widget->dirty = widget->queue->dirty;
+        widget->queue->dirty = widget;
+    }
+}
+
+
+/*
+ * init_twidget_queue() --Initialise an empty event queue.
+ */
+TwidgetQueue *init_twidget_queue(TwidgetQueue * queue)
+{
+    memset(queue, 0, sizeof(*queue));
+    return queue;
+}
+
+
+/*
+ * twidget_queue_cancel() --Cancel a widget's queued events and pending redraw.
+ *
+ * Remarks:
+ * The widget's queued events are marked cancelled (dispatch skips
+ * them), and it's taken off the dirty list, so it's safe to free (or
+ * re-attach) the widget afterwards.
+ */
+void twidget_queue_cancel(Twidget * widget)
+{
+    TwidgetQueue *queue = widget->queue;
+
+    if (queue == NULL)
+    {
+        return;
+    }
+    for (int i = 0; i < queue->count; ++i)
+    {
+        TwidgetEvent *event =
+            &queue->event[(queue->head + i) % TWIDGET_QUEUE_SIZE];
+
+        if (event->widget == widget)
+        {
+            event->widget = NULL;
+        }
+    }
+    for (Twidget ** link = &queue->dirty; *link != NULL;
+         link = &(*link)->dirty)
+    {
+        if (*link == widget)
+        {
+            *link = widget->dirty;
+            break;
+        }
+    }
+    widget->pending = 0;
+    widget->dirty = NULL;
+}
+
+
+/*
+ * twidget_queue_attach() --Attach a widget to an event queue.
+ *
+ * Remarks:
+ * Any events queued on a previous queue are cancelled.
+ */
+void twidget_queue_attach(TwidgetQueue * queue, Twidget * widget)
+{
+    twidget_queue_cancel(widget);
+    widget->queue = queue;
+    if (widget->window.state & TwinStale)
+    {
+        twidget_invalidate(widget);    /* catch up with prior changes */
+    }
+}
+
+
+/*
+ * twidget_post() --Queue an event for a widget.
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (no queue, or the queue is full).
+ *
+ * Remarks:
+ * Duplicates of coalescing events (tick, move, resize, draw, delete)
+ * keep their original place in the queue, but take the latest arg.
+ */
+int twidget_post(Twidget * widget, TwinEvent event, void *arg)
+{
+    TwidgetQueue *queue = widget->queue;
+
+    if (queue == NULL)
+    {
+        return 0;
+    }
+    if (event < TWIDGET_N_COALESCE && (widget->pending & (1u << event)))
+    {                                  /* coalesce */
+        queue->event[widget->queued[event]].arg = arg;
+        return 1;
+    }
+    if (queue->count == TWIDGET_QUEUE_SIZE)
+    {
+        err("%s(): %s: queue full", __func__, widget->name);
+        return 0;
+    }
+
+    int slot = (queue->head + queue->count) % TWIDGET_QUEUE_SIZE;
+
+    queue->event[slot].widget = widget;
+    queue->event[slot].event = event;
+    queue->event[slot].arg = arg;
+    ++queue->count;
+    if (event < TWIDGET_N_COALESCE)
+    {
+        widget->pending |= 1u << event;
+        widget->queued[event] = slot;
+    }
+    return 1;
+}
+
+
+/*
+ * twidget_queue_dispatch() --Deliver the queued events to their widgets.
+ *
+ * Returns: (int)
+ * The number of events delivered.
+ *
+ * Remarks:
+ * twin_draw events just invalidate the widget; the rest go to the
+ * control proc, which returns non-zero if the model changed.  Events
+ * posted during dispatch are delivered by the next call.
+ */
+int twidget_queue_dispatch(TwidgetQueue * queue)
+{
+    int n_event = queue->count;
+    int n = 0;
+
+    for (int i = 0; i < n_event; ++i)
+    {
+        TwidgetEvent *event = &queue->event[queue->head];
+        Twidget *widget = event->widget;
+
+        queue->head = (queue->head + 1) % TWIDGET_QUEUE_SIZE;
+        --queue->count;
+        if (widget == NULL)
+        {
+            continue;                  /* cancelled */
+        }
+        ++n;
+        if (event->event < TWIDGET_N_COALESCE)
+        {
+            widget->pending &= ~(1u << event->event);
+        }
+        if (event->event == twin_draw)
+        {
+            twidget_invalidate(widget);
+        }
+        else if (widget->control != NULL
+                 && widget->control(&widget->window, event->event,
+                                    event->arg))
+        {
+            twidget_invalidate(widget);
+        }
+    }
+    return n;
+}
+
+
+/*
+ * twidget_queue_draw() --Draw the widgets on the dirty list.
+ *
+ * Returns: (int)
+ * The number of widgets drawn.
+ *
+ * Remarks:
+ * This should be called before composing: the cost of a frame is
+ * then proportional to what has changed, not the number of widgets.
+ */
+int twidget_queue_draw(TwidgetQueue * queue)
+{
+    int n = 0;
+
+    while (queue->dirty != NULL)
+    {
+        Twidget *widget = queue->dirty;
+
+        queue->dirty = widget->dirty;
+        widget->dirty = NULL;
+        widget->pending &= ~TWIDGET_DIRTY;
+        n += twidget_draw(widget);
+    }
+    return n;
+}
+
 static int twin_text_control(Twindow * twin, TwinEvent event, void *arg)
 {
     return 0;
 }
 
 
+/*
+ * twin_text_draw() --Draw the text, a line per row, clipped.
+ */
+static int twin_text_draw(Twindow * twin, TwinEvent UNUSED(event),
+                          void *UNUSED(arg))
+{
+    TwidgetText *widget = (TwidgetText *) twin;
+    const char *text = (widget->text != NULL) ? widget->text : "";
+    TwinCoordinate cursor = twin->cursor;
+    TwinCell cell = twin->style;
+
+    for (int r = 0; r < twin->geometry.size.row; ++r)
+    {
+        size_t len = strcspn(text, "\n");
+
+        twin_cursor(twin, r, 0);
+        twin_putn(twin, text, len);    /* (clips columns) */
+        text += (text[len] == '\n') ? len + 1 : len;
+        cell.ch = ' ';
+        for (int c = twin->cursor.column; c < twin->geometry.size.column;
+             ++c)
+        {
+            twin_set_cell(twin, r, c, cell);
+        }
+    }
+    twin->cursor = cursor;
+    return 1;
+}
+
+
 TwidgetText *init_twidget_text(TwidgetText * widget, const char *name,
                                Twindow * parent, TwinGeometry * geometry,
                                const char *text)
@@ -44,7 +346,1258 @@ TwidgetText *init_twidget_text(TwidgetText * widget, const char *name,
                                           geometry, twin_text_control);
     if (widget != NULL)
     {
+        widget->widget.draw = twin_text_draw;
         widget->text = text;
+        twidget_invalidate(&widget->widget);
     }
     return widget;
 }
+
+
+/*
+ * metric_scale() --Scale a value into the range [0, n_levels).
+ */
+static int metric_scale(TwidgetMetric * metric, long value, int n_levels)
+{
+    if (metric->max <= metric->min || value <= metric->min)
+    {
+        return 0;
+    }
+    if (value >= metric->max)
+    {
+        return n_levels - 1;
+    }
+    return (int) ((double) (value - metric->min) * n_levels
+                  / (double) (metric->max - metric->min + 1));
+}
+
+
+/*
+ * metric_sample() --Get the nth most recent sample (0: the latest).
+ */
+static long metric_sample(TwidgetMetric * metric, int n)
+{
+    int i = metric->head - 1 - n;
+
+    if (i < 0)
+    {
+        i += metric->n_sample;
+    }
+    return metric->sample[i];
+}
+
+
+/*
+ * metric_shift() --Scroll a plot left by the samples added since drawn.
+ *
+ * Returns: (int)
+ * The number of columns (at the right) to draw: all of them, if the
+ * plot hasn't been drawn, or is redrawn without a new sample.
+ *
+ * Remarks:
+ * The style and glyph planes are moved directly, and damaged once.
+ */
+static int metric_shift(TwidgetMetric * metric)
+{
+    Twindow *twin = &metric->widget.window;
+    int n_columns = twin->geometry.size.column;
+    int shift = metric->shift;
+    TwinRegion all = {
+        {0, 0}, {twin->geometry.size.row - 1, n_columns - 1}
+    };
+
+    metric->shift = 0;
+    if (shift <= 0 || shift >= n_columns || twin->canvas != NULL)
+    {
+        return n_columns;              /* draw everything */
+    }
+    for (int r = 0; r < twin->geometry.size.row; ++r)
+    {
+        int offset = twin_cell(twin->geometry, r, 0);
+
+        memmove(&twin->styles[offset], &twin->styles[offset + shift],
+                (size_t) (n_columns - shift) * sizeof(TwinStyle));
+        memmove(&twin->glyphs[offset], &twin->glyphs[offset + shift],
+                (size_t) (n_columns - shift));
+    }
+    twin->generation += 1;
+    twin_damage(twin, all);
+    return shift;
+}
+
+
+/*
+ * spark_draw() --Draw the history as a scan-line plot, newest at right.
+ *
+ * Remarks:
+ * Each row has five scan lines, so the plot has 5 x rows levels.
+ * The plot is scrolled, so only the new samples' columns are drawn.
+ */
+static int spark_draw(Twindow * twin, TwinEvent UNUSED(event),
+                      void *UNUSED(arg))
+{
+    static const uint8_t scan[] = {
+        TermGraph_scan0, TermGraph_scan1, TermGraph_scan2,
+        TermGraph_scan3, TermGraph_scan4
+    };
+    TwidgetMetric *metric = (TwidgetMetric *) twin;
+    int n_rows = twin->geometry.size.row;
+    int n_columns = twin->geometry.size.column;
+    int n_new = metric_shift(metric);
+    TwinCell line = twin->style;
+    TwinStyle blank = twin_style_intern(twin->style);
+    TwinStyle alt;
+
+    line.attr |= TwinAlt;
+    alt = twin_style_intern(line);
+    for (int i = 0; i < n_new; ++i)
+    {
+        int c = n_columns - 1 - i;
+        int level = -1;
+
+        if (i < metric->count)
+        {
+            level = metric_scale(metric, metric_sample(metric, i),
+                                 5 * n_rows);
+        }
+        for (int r = 0; r < n_rows; ++r)
+        {
+            int row_level = level - 5 * (n_rows - 1 - r);
+
+            if (level >= 0 && row_level >= 0 && row_level < 5)
+            {
+                twin_set_glyph(twin, r, c, alt, scan[row_level]);
+            }
+            else
+            {
+                twin_set_glyph(twin, r, c, blank, ' ');
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * bar_draw() --Draw the latest sample as a horizontal bar.
+ *
+ * Remarks:
+ * Only the cells between the old and new lengths are drawn.
+ */
+static int bar_draw(Twindow * twin, TwinEvent UNUSED(event),
+                    void *UNUSED(arg))
+{
+    TwidgetMetric *metric = (TwidgetMetric *) twin;
+    int n_columns = twin->geometry.size.column;
+    int length = metric_scale(metric, metric_sample(metric, 0),
+                              n_columns + 1);
+    int start = metric->level;
+    int end = length;
+    TwinCell cell = twin->style;
+
+    if (length > metric->level)
+    {                                  /* grow */
+        cell.attr |= TwinAlt;
+        cell.ch = TermGraphChecker;
+    }
+    else
+    {                                  /* shrink */
+        cell.ch = ' ';
+        start = length;
+        end = metric->level;
+    }
+    for (int c = start; c < end; ++c)
+    {
+        for (int r = 0; r < twin->geometry.size.row; ++r)
+        {
+            twin_set_cell(twin, r, c, cell);
+        }
+    }
+    metric->level = length;
+    return 1;
+}
+
+
+/*
+ * gauge_draw() --Draw the latest sample as a marker on a scale.
+ *
+ * Remarks:
+ * The scale is drawn once (see init_twidget_gauge()); only the old
+ * and new marker cells are drawn here.
+ */
+static int gauge_draw(Twindow * twin, TwinEvent UNUSED(event),
+                      void *UNUSED(arg))
+{
+    TwidgetMetric *metric = (TwidgetMetric *) twin;
+    int n_columns = twin->geometry.size.column;
+    int position = metric_scale(metric, metric_sample(metric, 0), n_columns);
+    TwinCell cell = twin->style;
+
+    cell.attr |= TwinAlt;
+    if (position != metric->level)
+    {                                  /* restore the scale, as twin_hline() */
+        cell.ch = (metric->level == 0) ? 0x02
+            : (metric->level == n_columns - 1) ? 0x08 : 0x0a;
+        twin_set_cell(twin, 0, metric->level, cell);
+    }
+    cell.ch = TermGraphDiamond;
+    twin_set_cell(twin, 0, position, cell);
+    metric->level = position;
+    return 1;
+}
+
+
+/*
+ * heat_colour() --Map a level in [0, 255] to a blue-red gradient.
+ */
+static TwinColour heat_colour(int level)
+{
+    return TWIN_RGB(level, level < 128 ? 2 * level : 2 * (255 - level),
+                    255 - level);
+}
+
+
+/*
+ * heat_draw() --Draw the history as background colours, newest at right.
+ *
+ * Remarks:
+ * Like spark_draw(), only the new samples' columns are drawn.
+ */
+static int heat_draw(Twindow * twin, TwinEvent UNUSED(event),
+                     void *UNUSED(arg))
+{
+    TwidgetMetric *metric = (TwidgetMetric *) twin;
+    int n_columns = twin->geometry.size.column;
+    int n_new = metric_shift(metric);
+    TwinCell cell = twin->style;
+
+    for (int i = 0; i < n_new; ++i)
+    {
+        TwinStyle style;
+
+        cell.bg = twin->style.bg;
+        if (i < metric->count)
+        {
+            cell.bg = heat_colour(metric_scale(metric,
+                                               metric_sample(metric, i),
+                                               256));
+        }
+        style = twin_style_intern(cell);
+        for (int r = 0; r < twin->geometry.size.row; ++r)
+        {
+            twin_set_glyph(twin, r, n_columns - 1 - i, style, ' ');
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * init_twidget_metric() --Common initialisation for metric widgets.
+ */
+static TwidgetMetric *init_twidget_metric(TwidgetMetric * metric,
+                                          const char *name, Twindow * parent,
+                                          TwinGeometry * geometry,
+                                          long min, long max, TwinProc draw)
+{
+    int n_sample = (geometry->size.column > 0) ? geometry->size.column : 1;
+    long *sample = malloc((size_t) n_sample * sizeof(long));
+
+    if (sample == NULL)
+    {
+        return NULL;                   /* failure: no memory */
+    }
+    if (init_twidget((Twidget *) metric, name, parent, geometry,
+                     NULL) == NULL)
+    {
+        free(sample);
+        return NULL;
+    }
+    metric->widget.draw = draw;
+    metric->min = min;
+    metric->max = max;
+    metric->sample = sample;
+    metric->n_sample = n_sample;
+    metric->head = 0;
+    metric->count = 0;
+    metric->level = 0;
+    metric->shift = -1;
+    return metric;
+}
+
+
+TwidgetMetric *init_twidget_spark(TwidgetMetric * metric, const char *name,
+                                  Twindow * parent, TwinGeometry * geometry,
+                                  long min, long max)
+{
+    return init_twidget_metric(metric, name, parent, geometry,
+                               min, max, spark_draw);
+}
+
+
+TwidgetMetric *init_twidget_bar(TwidgetMetric * metric, const char *name,
+                                Twindow * parent, TwinGeometry * geometry,
+                                long min, long max)
+{
+    return init_twidget_metric(metric, name, parent, geometry,
+                               min, max, bar_draw);
+}
+
+
+TwidgetMetric *init_twidget_gauge(TwidgetMetric * metric, const char *name,
+                                  Twindow * parent, TwinGeometry * geometry,
+                                  long min, long max)
+{
+    metric = init_twidget_metric(metric, name, parent, geometry,
+                                 min, max, gauge_draw);
+    if (metric != NULL)
+    {
+        Twindow *twin = &metric->widget.window;
+
+        twin_hline(twin, 0, 0, twin->geometry.size.column);
+    }
+    return metric;
+}
+
+
+TwidgetMetric *init_twidget_heat(TwidgetMetric * metric, const char *name,
+                                 Twindow * parent, TwinGeometry * geometry,
+                                 long min, long max)
+{
+    return init_twidget_metric(metric, name, parent, geometry,
+                               min, max, heat_draw);
+}
+
+
+/*
+ * twidget_release() --Detach a widget, and release its frame.
+ *
+ * Remarks:
+ * The widget's queued events and running timers are cancelled, and
+ * it's removed from its parent, so nothing refers to it afterwards.
+ */
+static void twidget_release(Twidget * widget)
+{
+    Twindow *twin = &widget->window;
+
+    twidget_queue_cancel(widget);
+    while (widget->timer != NULL)
+    {
+        twin_timer_cancel(widget->timer->wheel, widget->timer);
+    }
+    if (twin->parent != NULL)
+    {
+        twin_remove_child(twin->parent, twin);
+    }
+    free(twin->frame);
+    free_twin_under(twin);
+    twin->frame = NULL;
+    twin->styles = NULL;
+    twin->glyphs = NULL;
+}
+
+
+/*
+ * free_twidget_metric() --Release a metric widget's buffers.
+ *
+ * Remarks:
+ * The widget itself is owned by the caller.
+ */
+void free_twidget_metric(TwidgetMetric * metric)
+{
+    free(metric->sample);
+    twidget_release(&metric->widget);
+    metric->sample = NULL;
+}
+
+
+/*
+ * twidget_metric_add() --Add a sample to a metric widget.
+ *
+ * Remarks:
+ * This is O(1): the widget is drawn later, by twidget_draw().
+ */
+void twidget_metric_add(TwidgetMetric * metric, long value)
+{
+    metric->sample[metric->head] = value;
+    metric->head = (metric->head + 1) % metric->n_sample;
+    if (metric->count < metric->n_sample)
+    {
+        ++metric->count;
+    }
+    if (metric->shift >= 0 && metric->shift < metric->n_sample)
+    {
+        ++metric->shift;
+    }
+    twidget_invalidate(&metric->widget);
+}
+
+
+/*
+ * log_line() --Get the nth most recent line (0: the latest).
+ */
+static const char *log_line(TwidgetLog * log, int n)
+{
+    int i = log->head - 1 - n;
+
+    if (i < 0)
+    {
+        i += log->n_line;
+    }
+    return &log->line[i * (log->widget.window.geometry.size.column + 1)];
+}
+
+
+/*
+ * log_draw_row() --Draw a line of text into a (blank) row.
+ */
+static void log_draw_row(Twindow * twin, int row, const char *text)
+{
+    twin_cursor(twin, row, 0);
+    twin_puts(twin, text);
+}
+
+
+/*
+ * log_draw() --Scroll the pane, and draw the newly appended lines.
+ */
+static int log_draw(Twindow * twin, TwinEvent UNUSED(event),
+                    void *UNUSED(arg))
+{
+    TwidgetLog *log = (TwidgetLog *) twin;
+    int n_rows = twin->geometry.size.row;
+    int n = (log->pending < n_rows) ? log->pending : n_rows;
+    TwinRegion all = {
+        {0, 0}, {n_rows - 1, twin->geometry.size.column - 1}
+    };
+
+    if (n == 0)
+    {
+        return 1;
+    }
+    twin_scroll(twin, all, n);
+    for (int i = 0; i < n; ++i)
+    {
+        log_draw_row(twin, n_rows - 1 - i, log_line(log, i));
+    }
+    log->pending = 0;
+    return 1;
+}
+
+
+/*
+ * init_twidget_log() --Initialise a log pane widget.
+ *
+ * Parameters:
+ * log      --the widget to initialise
+ * name     --the widget's name
+ * parent   --the window to attach it to
+ * geometry --the widget's position and size
+ * n_line   --the number of lines to keep (at least geometry's rows)
+ */
+TwidgetLog *init_twidget_log(TwidgetLog * log, const char *name,
+                             Twindow * parent, TwinGeometry * geometry,
+                             int n_line)
+{
+    char *line;
+
+    if (n_line < geometry->size.row)
+    {
+        n_line = geometry->size.row;
+    }
+    if (n_line <= 0 || (line = malloc((size_t) n_line
+                                      * (size_t) (geometry->size.column
+                                                  + 1))) == NULL)
+    {
+        return NULL;                   /* failure: no memory */
+    }
+    if (init_twidget((Twidget *) log, name, parent, geometry, NULL) == NULL)
+    {
+        free(line);
+        return NULL;
+    }
+    log->widget.draw = log_draw;
+    log->line = line;
+    log->n_line = n_line;
+    log->head = 0;
+    log->count = 0;
+    log->pending = 0;
+    return log;
+}
+
+
+/*
+ * free_twidget_log() --Release a log pane's buffers.
+ */
+void free_twidget_log(TwidgetLog * log)
+{
+    free(log->line);
+    twidget_release(&log->widget);
+    log->line = NULL;
+}
+
+
+/*
+ * twidget_log_append() --Append a line of text to a log pane.
+ *
+ * Remarks:
+ * The text is truncated at the pane's width, or the first newline.
+ */
+void twidget_log_append(TwidgetLog * log, const char *text)
+{
+    int width = log->widget.window.geometry.size.column;
+    char *line = &log->line[log->head * (width + 1)];
+    int len = 0;
+
+    while (len < width && text[len] != '\0' && text[len] != '\n')
+    {
+        line[len] = text[len];
+        ++len;
+    }
+    line[len] = '\0';
+    log->head = (log->head + 1) % log->n_line;
+    if (log->count < log->n_line)
+    {
+        ++log->count;
+    }
+    ++log->pending;
+    twidget_invalidate(&log->widget);
+}
+
+
+/*
+ * view_index() --Extend the line index to include the nth line.
+ *
+ * Returns: (int)
+ * 1 if the line exists, 0 otherwise.
+ *
+ * Remarks:
+ * The scan for newlines resumes where it last stopped, so each byte
+ * is only scanned once, however the view moves.
+ */
+static int view_index(TwidgetView * view, size_t n)
+{
+    while (n >= view->n_line && view->scanned < view->size)
+    {
+        const char *nl = memchr(view->text + view->scanned, '\n',
+                                view->size - view->scanned);
+
+        if (nl == NULL)
+        {
+            view->scanned = view->size;    /* last line is incomplete */
+            break;
+        }
+        view->scanned = (size_t) (nl - view->text) + 1;
+        if (view->n_line == view->line_alloc)
+        {
+            size_t n_alloc = view->line_alloc * 2;
+            size_t *line = realloc(view->line, n_alloc * sizeof(size_t));
+
+            if (line == NULL)
+            {
+                return 0;              /* failure: no memory */
+            }
+            view->line = line;
+            view->line_alloc = n_alloc;
+        }
+        view->line[view->n_line++] = view->scanned;
+    }
+    return n < view->n_line && (n == 0 || view->line[n] < view->size);
+}
+
+
+/*
+ * view_count() --Count the lines indexed so far.
+ *
+ * Remarks:
+ * A final newline starts an (empty) line that isn't counted until the
+ * file grows.
+ */
+static size_t view_count(TwidgetView * view)
+{
+    if (view->n_line > 1 && view->line[view->n_line - 1] == view->size)
+    {
+        return view->n_line - 1;
+    }
+    return view->n_line;
+}
+
+
+/*
+ * view_line_end() --Get the end of the nth (indexed) line, sans newline.
+ */
+static size_t view_line_end(TwidgetView * view, size_t n)
+{
+    size_t end = view->size;
+
+    view_index(view, n + 1);           /* find the end of line n */
+    if (n + 1 < view->n_line)
+    {
+        end = view->line[n + 1] - 1;   /* skip the newline */
+    }
+    if (end > view->line[n] && view->text[end - 1] == '\r')
+    {
+        end -= 1;
+    }
+    return end;
+}
+
+
+/*
+ * view_draw() --Draw the lines visible in the window.
+ */
+static int view_draw(Twindow * twin, TwinEvent UNUSED(event),
+                     void *UNUSED(arg))
+{
+    TwidgetView *view = (TwidgetView *) twin;
+    int n_columns = twin->geometry.size.column;
+    TwinCell cell = twin->style;
+    uint8_t glyph[TWIN_UTF8_BLOCK];
+
+    for (int r = 0; r < twin->geometry.size.row; ++r)
+    {
+        size_t n = view->top + (size_t) r;
+        size_t start = 0;
+        size_t end = 0;
+        int skip = view->column;       /* columns, not bytes */
+        int c = 0;
+
+        if (view_index(view, n))
+        {
+            start = view->line[n];
+            end = view_line_end(view, n);
+        }
+        while (c < n_columns && start < end)
+        {
+            int max = skip + n_columns - c;
+            int n_glyph;
+            size_t used = twin_utf8_glyphs(view->text + start, end - start,
+                                           glyph, (max < TWIN_UTF8_BLOCK)
+                                           ? max : TWIN_UTF8_BLOCK,
+                                           &n_glyph);
+
+            for (int i = 0; i < n_glyph; ++i)
+            {
+                uint8_t ch = glyph[i];
+
+                if (skip > 0)
+                {
+                    --skip;
+                    continue;
+                }
+                cell.ch = (ch < ' ' || ch == 0x7f) ? ' ' : ch;
+                twin_set_cell(twin, r, c++, cell);
+            }
+            if (used == 0)
+            {
+                break;                 /* a wide character doesn't fit */
+            }
+            start += used;
+        }
+        cell.ch = ' ';
+        for (; c < n_columns; ++c)
+        {
+            twin_set_cell(twin, r, c, cell);
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * init_twidget_view() --Initialise a text view of a buffer.
+ *
+ * Remarks:
+ * The buffer is not copied; it must outlive the view.
+ */
+TwidgetView *init_twidget_view(TwidgetView * view, const char *name,
+                               Twindow * parent, TwinGeometry * geometry,
+                               const char *text, size_t size)
+{
+    size_t *line = malloc(1024 * sizeof(size_t));
+
+    if (line == NULL)
+    {
+        return NULL;                   /* failure: no memory */
+    }
+    if (init_twidget((Twidget *) view, name, parent, geometry, NULL) == NULL)
+    {
+        free(line);
+        return NULL;
+    }
+    view->widget.draw = view_draw;
+    view->text = text;
+    view->size = size;
+    view->fd = -1;
+    view->line = line;
+    view->line[0] = 0;                 /* there's always a first line */
+    view->n_line = 1;
+    view->line_alloc = 1024;
+    view->scanned = 0;
+    view->top = 0;
+    view->column = 0;
+    twidget_invalidate(&view->widget);
+    return view;
+}
+
+
+/*
+ * view_map() --(Re-)map the view's file at its current size.
+ */
+static int view_map(TwidgetView * view)
+{
+    struct stat st;
+    void *text;
+
+    if (fstat(view->fd, &st) < 0)
+    {
+        log_sys(LOG_ERR, "cannot stat view file");
+        return 0;
+    }
+    if ((size_t) st.st_size <= view->size)
+    {
+        return 1;                      /* nothing new */
+    }
+    text = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED,
+                view->fd, 0);
+    if (text == MAP_FAILED)
+    {
+        log_sys(LOG_ERR, "cannot map view file");
+        return 0;
+    }
+    if (view->text != NULL)
+    {
+        munmap((void *) view->text, view->size);
+    }
+    view->text = text;
+    view->size = (size_t) st.st_size;
+    return 1;
+}
+
+
+/*
+ * init_twidget_view_file() --Initialise a text view of a (mapped) file.
+ */
+TwidgetView *init_twidget_view_file(TwidgetView * view, const char *name,
+                                    Twindow * parent, TwinGeometry * geometry,
+                                    const char *path)
+{
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+    {
+        log_sys(LOG_ERR, "cannot open \"%s\"", path);
+        return NULL;
+    }
+    if (init_twidget_view(view, name, parent, geometry, NULL, 0) == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    view->fd = fd;
+    if (!view_map(view))
+    {
+        free_twidget_view(view);
+        return NULL;
+    }
+    return view;
+}
+
+
+/*
+ * free_twidget_view() --Release a text view's index, mapping and file.
+ */
+void free_twidget_view(TwidgetView * view)
+{
+    if (view->fd >= 0)
+    {
+        if (view->text != NULL)
+        {
+            munmap((void *) view->text, view->size);
+        }
+        close(view->fd);
+    }
+    free(view->line);
+    twidget_release(&view->widget);
+    view->text = NULL;
+    view->fd = -1;
+    view->line = NULL;
+}
+
+
+/*
+ * twidget_view_refresh() --Catch up with a file that has grown.
+ *
+ * Returns: (int)
+ * 1 if there's new text, 0 otherwise.
+ *
+ * Remarks:
+ * The index isn't rescanned; it will be extended as needed.
+ */
+int twidget_view_refresh(TwidgetView * view)
+{
+    size_t size = view->size;
+
+    if (view->fd < 0 || !view_map(view) || view->size == size)
+    {
+        return 0;
+    }
+    twidget_invalidate(&view->widget);
+    return 1;
+}
+
+
+/*
+ * twidget_view_goto() --Move the view to a line and column.
+ *
+ * Returns: (size_t)
+ * The new top line, which may be less than line, if the text is short.
+ */
+size_t twidget_view_goto(TwidgetView * view, size_t line, int column)
+{
+    if (!view_index(view, line))
+    {
+        line = view_count(view) - 1;
+    }
+    if (line != view->top || column != view->column)
+    {
+        view->top = line;
+        view->column = (column < 0) ? 0 : column;
+        twidget_invalidate(&view->widget);
+    }
+    return view->top;
+}
+
+
+/*
+ * twidget_view_scroll() --Move the view by some lines.
+ */
+size_t twidget_view_scroll(TwidgetView * view, long n)
+{
+    size_t line = view->top;
+
+    if (n < 0 && (size_t) -n > line)
+    {
+        line = 0;
+    }
+    else
+    {
+        line += (size_t) n;
+    }
+    return twidget_view_goto(view, line, view->column);
+}
+
+
+/*
+ * twidget_view_tail() --Move the view to the end of the text.
+ *
+ * Remarks:
+ * This indexes the whole text; it's a fast memchr() scan, but it is
+ * proportional to the unscanned size.
+ */
+size_t twidget_view_tail(TwidgetView * view)
+{
+    size_t n_rows = (size_t) view->widget.window.geometry.size.row;
+    size_t n_line;
+
+    view_index(view, (size_t) -1);
+    n_line = view_count(view);
+    return twidget_view_goto(view, (n_line > n_rows) ? n_line - n_rows : 0,
+                             view->column);
+}
+
+
+/*
+ * table_field() --Render a field's text into a span of cells.
+ */
+static int table_field(TwinCell * cell, int n_cell, TwinCell style,
+                       const char *text, int len, int width)
+{
+    int n = abs(width);
+    uint8_t glyph[TWIN_UTF8_BLOCK];
+    int n_glyph;
+    int pad;
+    int c = 0;
+
+    twin_utf8_glyphs(text, (size_t) len, glyph,
+                     (n < TWIN_UTF8_BLOCK) ? n : TWIN_UTF8_BLOCK, &n_glyph);
+    pad = n - n_glyph;
+    style.ch = ' ';
+    for (; width > 0 && pad > 0 && c < n_cell; --pad)
+    {                                  /* right-align: pad on the left */
+        cell[c++] = style;
+    }
+    for (int i = 0; i < n_glyph && c < n_cell; ++i)
+    {
+        style.ch = glyph[i];
+        cell[c++] = style;
+    }
+    style.ch = ' ';
+    for (; pad > 0 && c < n_cell; --pad)
+    {                                  /* left-align: pad on the right */
+        cell[c++] = style;
+    }
+    if (c < n_cell)
+    {                                  /* column separator */
+        cell[c++] = style;
+    }
+    return c;
+}
+
+
+/*
+ * table_render() --Render a row (or the titles) into cells.
+ *
+ * Parameters:
+ * table    --the table
+ * cell     --the cells to render into (the window's width)
+ * row      --the row to render, or (size_t) -1 for the titles
+ */
+static void table_render(TwidgetTable * table, TwinCell * cell, size_t row)
+{
+    Twindow *twin = &table->widget.window;
+    int n_columns = twin->geometry.size.column;
+    TwinCell style = twin->style;
+    int c = 0;
+
+    if (row == (size_t) -1)
+    {
+        style.attr |= TwinBold;
+    }
+    for (int j = 0; j < table->n_column && c < n_columns; ++j)
+    {
+        const TwidgetTableColumn *column = &table->column[j];
+        int n = abs(column->width);
+        int len = 0;
+
+        if (j >= table->n_fixed_column && j < table->n_fixed_column
+            + table->left)
+        {
+            continue;                  /* scrolled off to the left */
+        }
+        char text[4 * n + 1];          /* (UTF-8: up to 4 bytes a column) */
+
+        if (row == (size_t) -1)
+        {
+            const char *title = (column->title != NULL) ? column->title : "";
+
+            len = (int) strnlen(title, (size_t) 4 * n);
+            memcpy(text, title, (size_t) len);
+        }
+        else if (column->fetch != NULL)
+        {
+            len = column->fetch(table->data, row, text, 4 * n + 1);
+            len = (len < 0) ? 0 : (len > 4 * n) ? 4 * n : len;
+        }
+        c += table_field(&cell[c], n_columns - c, style, text, len,
+                         column->width);
+    }
+    style = twin->style;
+    style.ch = ' ';
+    for (; c < n_columns; ++c)
+    {
+        cell[c] = style;
+    }
+}
+
+
+/*
+ * table_row() --Get a rendered row, from the cache if possible.
+ *
+ * Remarks:
+ * The cache is 2-way set-associative on the row id, with (at least)
+ * twice as many sets as there are rows in the window, so consecutive
+ * ids never evict each other, and the fixed rows survive scrolling.
+ */
+static TwinCell *table_row(TwidgetTable * table, size_t row)
+{
+    uint64_t id = row;
+    uint64_t version = 0;
+
+    if (table->key != NULL)
+    {
+        table->key(table->data, row, &id, &version);
+    }
+
+    TwidgetTableRow *set = &table->cache[2 * (id & (uint64_t)
+                                              (table->n_cache / 2 - 1))];
+    TwidgetTableRow *entry = &set[0];
+
+    if (set[1].valid && set[1].id == id)
+    {
+        entry = &set[1];
+    }
+    else if (!(set[0].valid && set[0].id == id)
+             && set[1].used < set[0].used)
+    {
+        entry = &set[1];               /* miss: replace the LRU way */
+    }
+    if (!entry->valid || entry->id != id || entry->version != version)
+    {
+        table_render(table, entry->cell, row);
+        entry->id = id;
+        entry->version = version;
+        entry->valid = 1;
+    }
+    entry->used = table->serial;
+    return entry->cell;
+}
+
+
+/*
+ * table_draw() --Draw the titles, fixed rows and visible rows.
+ *
+ * Remarks:
+ * If the table has scrolled by less than a page, the rows still shown
+ * are moved with twin_scroll(), so the terminal scrolls them too.
+ * Re-setting their (unchanged) cells is then a no-op, and only the
+ * exposed rows (and any that changed) are sent.
+ */
+static int table_draw(Twindow * twin, TwinEvent UNUSED(event),
+                      void *UNUSED(arg))
+{
+    TwidgetTable *table = (TwidgetTable *) twin;
+    int n_rows = twin->geometry.size.row;
+    int n_columns = twin->geometry.size.column;
+    size_t n_data = table->count(table->data);
+    size_t row = 0;
+    int r = 0;
+    TwinCell blank = twin->style;
+    TwinCell title[n_columns];
+
+    blank.ch = ' ';
+    ++table->serial;
+    for (int j = 0; j < table->n_column; ++j)
+    {
+        if (table->column[j].title != NULL)
+        {                              /* there's a title row */
+            table_render(table, title, (size_t) -1);
+            for (int c = 0; c < n_columns; ++c)
+            {
+                twin_set_cell(twin, r, c, title[c]);
+            }
+            ++r;
+            break;
+        }
+    }
+    if (table->drawn_top != (size_t) -1 && table->drawn_top != table->top)
+    {                                  /* move the rows still shown */
+        TwinRegion region = {
+            {r + table->n_fixed_row, 0}, {n_rows - 1, n_columns - 1}
+        };
+        long n = (long) (table->top - table->drawn_top);
+
+        if (labs(n) <= region.max.row - region.min.row)
+        {
+            twin_scroll(twin, region, (int) n);
+        }
+    }
+    table->drawn_top = table->top;
+    for (; r < n_rows; ++r, ++row)
+    {
+        if (row == (size_t) table->n_fixed_row && table->top > row)
+        {
+            row = table->top;          /* skip to the scrolling rows */
+        }
+        if (row >= n_data)
+        {
+            for (int c = 0; c < n_columns; ++c)
+            {
+                twin_set_cell(twin, r, c, blank);
+            }
+            continue;
+        }
+
+        TwinCell *cell = table_row(table, row);
+
+        for (int c = 0; c < n_columns; ++c)
+        {
+            twin_set_cell(twin, r, c, cell[c]);
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * init_twidget_table() --Initialise a virtual table widget.
+ *
+ * Parameters:
+ * table    --the widget to initialise
+ * name     --the widget's name
+ * parent   --the window to attach it to
+ * geometry --the widget's position and size
+ * column   --the column descriptions (not copied)
+ * n_column --the number of columns
+ * data     --the data source, passed to the callbacks
+ * count    --returns the number of rows
+ * key      --returns a row's id and version (may be NULL)
+ */
+TwidgetTable *init_twidget_table(TwidgetTable * table, const char *name,
+                                 Twindow * parent, TwinGeometry * geometry,
+                                 const TwidgetTableColumn * column,
+                                 int n_column, void *data,
+                                 TwidgetTableCountProc count,
+                                 TwidgetTableKeyProc key)
+{
+    int n_cache = 2;                   /* at least one set */
+    TwidgetTableRow *cache;
+    TwinCell *cell;
+
+    while (n_cache < 4 * geometry->size.row)
+    {                                  /* 2 ways x 2 x rows */
+        n_cache *= 2;
+    }
+    cache = calloc((size_t) n_cache, sizeof(TwidgetTableRow));
+    cell = malloc((size_t) n_cache * (size_t) geometry->size.column
+                  * sizeof(TwinCell));
+    if (cache == NULL || cell == NULL
+        || init_twidget((Twidget *) table, name, parent, geometry,
+                        NULL) == NULL)
+    {
+        free(cache);
+        free(cell);
+        return NULL;                   /* failure: no memory */
+    }
+    for (int i = 0; i < n_cache; ++i)
+    {
+        cache[i].cell = &cell[i * geometry->size.column];
+    }
+    table->widget.draw = table_draw;
+    table->column = column;
+    table->n_column = n_column;
+    table->data = data;
+    table->count = count;
+    table->key = key;
+    table->n_fixed_row = 0;
+    table->n_fixed_column = 0;
+    table->top = 0;
+    table->left = 0;
+    table->drawn_top = (size_t) -1;
+    table->cache = cache;
+    table->n_cache = n_cache;
+    table->serial = 0;
+    twidget_invalidate(&table->widget);
+    return table;
+}
+
+
+/*
+ * free_twidget_table() --Release a table's cache and frame.
+ */
+void free_twidget_table(TwidgetTable * table)
+{
+    if (table->cache != NULL)
+    {
+        free(table->cache[0].cell);    /* one allocation for all rows */
+        free(table->cache);
+    }
+    twidget_release(&table->widget);
+    table->cache = NULL;
+}
+
+
+/*
+ * twidget_table_invalidate() --Discard a table's rendered rows.
+ *
+ * Remarks:
+ * This is only needed if the data changes without changing the
+ * versions returned by the key proc (or there is no key proc).
+ */
+void twidget_table_invalidate(TwidgetTable * table)
+{
+    for (int i = 0; i < table->n_cache; ++i)
+    {
+        table->cache[i].valid = 0;
+    }
+    twidget_invalidate(&table->widget);
+}
+
+
+/*
+ * twidget_table_fix() --Pin some rows and columns of a table.
+ */
+void twidget_table_fix(TwidgetTable * table, int n_row, int n_column)
+{
+    table->n_fixed_row = (n_row < 0) ? 0 : n_row;
+    table->n_fixed_column = (n_column < 0) ? 0 : n_column;
+    if (table->top < (size_t) table->n_fixed_row)
+    {
+        table->top = (size_t) table->n_fixed_row;
+    }
+    twidget_table_invalidate(table);
+}
+
+
+/*
+ * twidget_table_goto() --Move a table to a row and column.
+ *
+ * Parameters:
+ * table    --the table
+ * row      --the first scrolling row to show
+ * column   --the number of scrolling columns to skip
+ *
+ * Remarks:
+ * Moving between columns changes every rendered row, so it discards
+ * the cache; moving between rows doesn't.
+ */
+size_t twidget_table_goto(TwidgetTable * table, size_t row, int column)
+{
+    size_t n_data = table->count(table->data);
+
+    if (row >= n_data)
+    {
+        row = (n_data > 0) ? n_data - 1 : 0;
+    }
+    if (row < (size_t) table->n_fixed_row)
+    {
+        row = (size_t) table->n_fixed_row;
+    }
+    if (column < 0)
+    {
+        column = 0;
+    }
+    if (column != table->left)
+    {
+        table->left = column;
+        twidget_table_invalidate(table);
+    }
+    if (row != table->top)
+    {
+        table->top = row;
+        twidget_invalidate(&table->widget);
+    }
+    return table->top;
+}
+
+
+/*
+ * twidget_table_scroll() --Move a table by some rows.
+ */
+size_t twidget_table_scroll(TwidgetTable * table, long n)
+{
+    size_t row = table->top;
+
+    if (n < 0 && (size_t) -n > row)
+    {
+        row = 0;
+    }
+    else
+    {
+        row += (size_t) n;
+    }
+    return twidget_table_goto(table, row, table->left);
+}
+
+
+/*
+ * twidget_table_refresh() --Note that a table's data has changed.
+ *
+ * Remarks:
+ * The next draw re-checks the visible rows' ids and versions, and
+ * only fetches the rows that have changed.
+ */
+void twidget_table_refresh(TwidgetTable * table)
+{
+    twidget_invalidate(&table->widget);
+}
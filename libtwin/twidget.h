@@ -8,6 +8,7 @@
 #ifndef TWIDGET_H
 #define TWIDGET_H
 
+#include <stddef.h>
 #include <twin.h>
 
 #ifdef __cplusplus
@@ -15,6 +16,10 @@ extern "C"
 {
 #endif                                 /* C++ */
     typedef struct Twidget_t Twidget;
+    typedef struct TwidgetQueue_t TwidgetQueue;
+
+#define TWIDGET_QUEUE_SIZE 1024
+#define TWIDGET_N_COALESCE (twin_delete + 1)   /* events that coalesce */
 
     struct Twidget_t
     {
@@ -22,6 +27,35 @@ extern "C"
         const char *name;
         TwinProc control;       /* update the model based on an event */
         TwinProc draw;                  /* render the model into the window */
+        TwidgetQueue *queue;           /* event queue, if attached */
+        Twidget *dirty;                /* next on the queue's dirty list */
+        unsigned int pending;          /* queued events (bits), and dirty */
+        int queued[TWIDGET_N_COALESCE];    /* queue slot, if pending */
+        struct TwinTimer_t *timer;     /* running timers that tick it */
+    };
+
+    /*
+     * TwidgetQueue: --Events for widgets, and the widgets to redraw.
+     *
+     * Remarks:
+     * Events up to twin_delete are coalesced: a widget has at most one
+     * of each queued, with the latest arg.  Control procs return
+     * non-zero if the model changed, which puts the widget on the
+     * dirty list; twidget_queue_draw() runs only those draw procs.
+     */
+    typedef struct TwidgetEvent_t
+    {
+        Twidget *widget;               /* NULL: cancelled */
+        TwinEvent event;
+        void *arg;
+    } TwidgetEvent;
+
+    struct TwidgetQueue_t
+    {
+        TwidgetEvent event[TWIDGET_QUEUE_SIZE];  /* ring buffer */
+        int head;                      /* index of the next event */
+        int count;                     /* number of events */
+        Twidget *dirty;                /* widgets to redraw */
     };
 
     typedef struct TwidgetText_t
@@ -30,12 +64,181 @@ extern "C"
         const char *text;
     } TwidgetText;
 
+    /*
+     * TwidgetMetric: --A widget that displays a series of samples.
+     *
+     * Remarks:
+     * The samples are kept in a fixed-size ring buffer; adding one
+     * is O(1), and just invalidates the widget.  Drawing only
+     * touches the cells that can change (e.g. a bar draws the delta
+     * between its old and new lengths; a sparkline scrolls, and draws
+     * just its new columns).
+     */
+    typedef struct TwidgetMetric_t
+    {
+        Twidget widget;
+        long min, max;                 /* range of the displayed values */
+        long *sample;                  /* ring buffer of samples */
+        int n_sample;                  /* capacity of sample */
+        int head;                      /* index of the next sample */
+        int count;                     /* number of samples */
+        int level;                     /* last drawn level (bar, gauge) */
+        int shift;                     /* samples since drawn, or -1: all */
+    } TwidgetMetric;
+
+    /*
+     * TwidgetLog: --A pane that tails lines of text.
+     *
+     * Remarks:
+     * Lines are kept in a ring buffer, truncated to the pane's width.
+     * Drawing scrolls the pane by the number of lines appended since
+     * the last draw (see twin_scroll()), and draws just those lines.
+     */
+    typedef struct TwidgetLog_t
+    {
+        Twidget widget;
+        char *line;                    /* ring buffer: n_line x (width+1) */
+        int n_line;                    /* capacity of line */
+        int head;                      /* index of the next line */
+        int count;                     /* number of lines */
+        int pending;                   /* lines appended since last draw */
+    } TwidgetLog;
+
+    /*
+     * TwidgetView: --A scrollable view of a (large) text buffer, or file.
+     *
+     * Remarks:
+     * Files are mmap()ed.  The line index (the offset of each line's
+     * start) is built lazily, only as far as the view needs, and is
+     * extended, not rebuilt, when the file grows.  Only the rows in
+     * the window are drawn.
+     */
+    typedef struct TwidgetView_t
+    {
+        Twidget widget;
+        const char *text;              /* the buffer, or mapped file */
+        size_t size;                   /* bytes in text */
+        int fd;                        /* the mapped file, or -1 */
+        size_t *line;                  /* index: offset of each line start */
+        size_t n_line;                 /* lines indexed so far */
+        size_t line_alloc;             /* capacity of line */
+        size_t scanned;                /* bytes scanned for newlines */
+        size_t top;                    /* first line in the window */
+        int column;                    /* first column in the window */
+    } TwidgetView;
+
+    /*
+     * TwidgetTable: --A virtual table, whose rows are fetched on demand.
+     *
+     * Remarks:
+     * The data source is a set of callbacks: the row count, a row's
+     * id and version, and a fetch proc per column.  Only the visible
+     * rows and columns are fetched, and rendered rows are cached by id
+     * and version, so scrolling reuses rows already rendered.
+     */
+    typedef size_t (*TwidgetTableCountProc)(void *data);
+    typedef void (*TwidgetTableKeyProc)(void *data, size_t row,
+                                        uint64_t * id, uint64_t * version);
+    typedef int (*TwidgetTableCellProc)(void *data, size_t row,
+                                        char *text, int size);
+
+    typedef struct TwidgetTableColumn_t
+    {
+        const char *title;
+        int width;                     /* +ve: right-aligned, -ve: left */
+        TwidgetTableCellProc fetch;    /* format a cell into text */
+    } TwidgetTableColumn;
+
+    typedef struct TwidgetTableRow_t
+    {
+        uint64_t id, version;
+        int valid;
+        unsigned long used;            /* draw serial, for LRU */
+        TwinCell *cell;                /* the rendered row */
+    } TwidgetTableRow;
+
+    typedef struct TwidgetTable_t
+    {
+        Twidget widget;
+        const TwidgetTableColumn *column;
+        int n_column;
+        void *data;                    /* passed to the callbacks */
+        TwidgetTableCountProc count;
+        TwidgetTableKeyProc key;       /* NULL: id is row, version is 0 */
+        int n_fixed_row;               /* rows pinned below the titles */
+        int n_fixed_column;            /* columns pinned at the left */
+        size_t top;                    /* first scrolling row shown */
+        int left;                      /* first scrolling column shown */
+        size_t drawn_top;              /* top, when last drawn (or -1) */
+        TwidgetTableRow *cache;        /* rendered rows, by id */
+        int n_cache;                   /* capacity of cache (2^n) */
+        unsigned long serial;          /* number of draws */
+    } TwidgetTable;
+
     Twidget *init_twidget(Twidget * widget, const char *name,
                           Twindow * parent, TwinGeometry * geometry,
                           TwinProc control);
     TwidgetText *init_twidget_text(TwidgetText * widget, const char *name,
                                    Twindow * parent, TwinGeometry * geometry,
                                    const char *text);
+
+    TwidgetMetric *init_twidget_spark(TwidgetMetric * metric,
+                                      const char *name, Twindow * parent,
+                                      TwinGeometry * geometry,
+                                      long min, long max);
+    TwidgetMetric *init_twidget_bar(TwidgetMetric * metric,
+                                    const char *name, Twindow * parent,
+                                    TwinGeometry * geometry,
+                                    long min, long max);
+    TwidgetMetric *init_twidget_gauge(TwidgetMetric * metric,
+                                      const char *name, Twindow * parent,
+                                      TwinGeometry * geometry,
+                                      long min, long max);
+    TwidgetMetric *init_twidget_heat(TwidgetMetric * metric,
+                                     const char *name, Twindow * parent,
+                                     TwinGeometry * geometry,
+                                     long min, long max);
+    void free_twidget_metric(TwidgetMetric * metric);
+    void twidget_metric_add(TwidgetMetric * metric, long value);
+    TwidgetLog *init_twidget_log(TwidgetLog * log, const char *name,
+                                 Twindow * parent, TwinGeometry * geometry,
+                                 int n_line);
+    void free_twidget_log(TwidgetLog * log);
+    void twidget_log_append(TwidgetLog * log, const char *text);
+    TwidgetView *init_twidget_view(TwidgetView * view, const char *name,
+                                   Twindow * parent, TwinGeometry * geometry,
+                                   const char *text, size_t size);
+    TwidgetView *init_twidget_view_file(TwidgetView * view,
+                                        const char *name, Twindow * parent,
+                                        TwinGeometry * geometry,
+                                        const char *path);
+    void free_twidget_view(TwidgetView * view);
+    int twidget_view_refresh(TwidgetView * view);
+    size_t twidget_view_goto(TwidgetView * view, size_t line, int column);
+    size_t twidget_view_scroll(TwidgetView * view, long n);
+    size_t twidget_view_tail(TwidgetView * view);
+    TwidgetTable *init_twidget_table(TwidgetTable * table, const char *name,
+                                     Twindow * parent,
+                                     TwinGeometry * geometry,
+                                     const TwidgetTableColumn * column,
+                                     int n_column, void *data,
+                                     TwidgetTableCountProc count,
+                                     TwidgetTableKeyProc key);
+    void free_twidget_table(TwidgetTable * table);
+    void twidget_table_fix(TwidgetTable * table, int n_row, int n_column);
+    size_t twidget_table_goto(TwidgetTable * table, size_t row, int column);
+    size_t twidget_table_scroll(TwidgetTable * table, long n);
+    void twidget_table_refresh(TwidgetTable * table);
+    void twidget_table_invalidate(TwidgetTable * table);
+    int twidget_draw(Twidget * widget);
+    void twidget_invalidate(Twidget * widget);
+
+    TwidgetQueue *init_twidget_queue(TwidgetQueue * queue);
+    void twidget_queue_attach(TwidgetQueue * queue, Twidget * widget);
+    void twidget_queue_cancel(Twidget * widget);
+    int twidget_post(Twidget * widget, TwinEvent event, void *arg);
+    int twidget_queue_dispatch(TwidgetQueue * queue);
+    int twidget_queue_draw(TwidgetQueue * queue);
 #ifdef __cplusplus
 }
 #endif                                 /* C++ */
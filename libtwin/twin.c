@@ -5,10 +5,19 @@
  *
  * Remarks:
  */
+#include <stdarg.h>
+#include <stdio.h>
+#include <time.h>
 #include <apex.h>
 #include <apex/log.h>
 #include <apex/estring.h>
 #include "twin.h"
+#include "twcanvas.h"
+#include "twtrace.h"
+#include "twutf8.h"
+#include "xterminator.h"
+
+#define STYLE_RGB_MAX (TWIN_STYLE_MAX - 4096)   /* ids RGB styles may use */
 
 extern inline int twin_cell(TwinGeometry geometry, int row, int column);
 
@@ -18,9 +27,394 @@ static inline int twin_cmp_style(TwinCell a, TwinCell b)
 }
 
 static TwinCell blank = {
-    TWIN_DEFAULT_COLOUR, TWIN_DEFAULT_COLOUR, TwinNormal, ' '
+    TWIN_DEFAULT_COLOUR, TWIN_DEFAULT_COLOUR, TwinNormal, ' ', 0
 };
 
+/*
+ * TwinUnder: --What's beneath a transparent window, where it's composed.
+ *
+ * Remarks:
+ * The cells are in the window's coordinates.  It's on dst's list of
+ * overlays, so that drawing on dst can update it (see
+ * twin_under_drawn()).
+ */
+typedef struct TwinUnder_t
+{
+    Twindow *dst;                      /* the window composed onto... */
+    TwinCoordinate at;                 /* ...and where */
+    int rows, columns;
+    TwinStyle *styles;                 /* the cells beneath */
+    uint8_t *glyphs;
+    struct TwinUnder_t *next;          /* dst's next overlay */
+} TwinUnder;
+
+static int composing;                  /* >0: writes aren't beneath overlays */
+static TwinRegion *pass_region;        /* dst regions composed, this pass */
+static int n_pass_region, pass_region_alloc;
+
+static TwinCell *style_table;          /* interned styles, by id */
+static uint32_t *style_index;          /* hash of styles: id + 1, or 0 */
+static uint32_t n_style, style_alloc;  /* (index has 2 * style_alloc slots) */
+
+
+static inline uint32_t style_hash(TwinCell style)
+{
+    return ((style.fg * 31u + style.bg) * 31u + style.attr) * 2654435761u;
+}
+
+
+/*
+ * style_grow() --Double the style table, and rebuild its index.
+ */
+static int style_grow(void)
+{
+    uint32_t n_alloc = (style_alloc == 0) ? 256 : 2 * style_alloc;
+    TwinCell *table = realloc(style_table, n_alloc * sizeof(*table));
+    uint32_t *index = calloc(2 * (size_t) n_alloc, sizeof(*index));
+
+    if (table == NULL || index == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        free(index);
+        style_table = (table != NULL) ? table : style_table;
+        return 0;
+    }
+    style_table = table;
+    style_alloc = n_alloc;
+    free(style_index);
+    style_index = index;
+    for (uint32_t id = 0; id < n_style; ++id)
+    {
+        uint32_t slot = style_hash(style_table[id]) & (2 * n_alloc - 1);
+
+        while (style_index[slot] != 0)
+        {
+            slot = (slot + 1) & (2 * n_alloc - 1);
+        }
+        style_index[slot] = id + 1;
+    }
+    return 1;
+}
+
+
+/*
+ * twin_style_intern() --Get the id of a style (fg, bg, attr).
+ *
+ * Returns: (TwinStyle)
+ * The style's id; if the table is full, the blank style's id.
+ *
+ * Remarks:
+ * Styles are never removed, so an id is valid for the life of the
+ * process.  The last style looked up is cached, since callers tend
+ * to intern the same style for a run of cells.  The table isn't
+ * thread-safe: like windows, it belongs to the render thread.
+ *
+ * RGB colours are what fill the table (e.g. gradients), so the last
+ * ids are kept for palette colours: once the rest are used, a new
+ * RGB style is reduced to the nearest xterm-256 style instead.  Only
+ * when that's full too is the blank style returned.
+ */
+TwinStyle twin_style_intern(TwinCell style)
+{
+    static TwinCell last_style;
+    static TwinStyle last_id;
+    uint32_t mask, slot;
+
+    if (n_style > 0 && twin_cmp_style(style, last_style) == 0)
+    {
+        return last_id;
+    }
+    if (n_style == 0)
+    {                                  /* first use: id 0 is blank */
+        if (!style_grow())
+        {
+            return TWIN_STYLE_BLANK;
+        }
+        style_table[0] = blank;
+        style_index[style_hash(blank) & (2 * style_alloc - 1)] = 1;
+        n_style = 1;
+    }
+    mask = 2 * style_alloc - 1;
+    for (slot = style_hash(style) & mask; style_index[slot] != 0;
+         slot = (slot + 1) & mask)
+    {
+        uint32_t id = style_index[slot] - 1;
+
+        if (twin_cmp_style(style_table[id], style) == 0)
+        {
+            last_style = style;
+            return last_id = (TwinStyle) id;
+        }
+    }
+    if (n_style >= STYLE_RGB_MAX
+        && (TWIN_IS_RGB(style.fg) || TWIN_IS_RGB(style.bg)))
+    {                                  /* use the nearest palette style */
+        TwinCell palette = style;
+        TwinStyle id;
+
+        palette.fg = xterm_colour_256(style.fg);
+        palette.bg = xterm_colour_256(style.bg);
+        id = twin_style_intern(palette);
+        last_style = style;
+        return last_id = id;
+    }
+    if (n_style == TWIN_STYLE_MAX)
+    {
+        err("%s(): style table is full", __func__);
+        return TWIN_STYLE_BLANK;
+    }
+    if (n_style == style_alloc)
+    {                                  /* grow, and find the new slot */
+        if (!style_grow())
+        {
+            return TWIN_STYLE_BLANK;
+        }
+        mask = 2 * style_alloc - 1;
+        for (slot = style_hash(style) & mask; style_index[slot] != 0;
+             slot = (slot + 1) & mask)
+        {
+            continue;
+        }
+    }
+    style.ch = ' ';
+    style.spare = 0;
+    style_table[n_style] = style;
+    style_index[slot] = n_style + 1;
+    last_style = style;
+    last_id = (TwinStyle) n_style++;
+    return last_id;
+}
+
+
+/*
+ * twin_style_cell() --Get the style (fg, bg, attr) of a style id.
+ *
+ * Returns: (TwinCell)
+ * The style, as a blank cell.
+ */
+TwinCell twin_style_cell(TwinStyle style)
+{
+    return (style < n_style) ? style_table[style] : blank;
+}
+
+
+/*
+ * twin_frame() --Make sure a window's cells can be read and written.
+ *
+ * Returns: (int)
+ * 1: they can (it has a frame, or is a canvas); 0: there's no frame.
+ *
+ * Remarks:
+ * A frame that's been compacted (e.g. the terminal's root, see
+ * xterm_compact()) is refilled by the window's wake proc the first
+ * time it's touched.  Its cells don't change, so a const window can
+ * be woken too.
+ */
+static inline int twin_frame(const Twindow * twin)
+{
+    if (twin->frame != NULL || twin->canvas != NULL)
+    {
+        return 1;
+    }
+    return twin->wake != NULL && twin->wake((Twindow *) twin);
+}
+
+
+/*
+ * twin_peek() --Get a cell's style id and glyph, from frame or tiles.
+ */
+static inline void twin_peek(const Twindow * twin, int row, int col,
+                             TwinStyle * style, uint8_t * glyph)
+{
+    if (twin->canvas != NULL)
+    {
+        TwinTile *tile = twin_canvas_tile(twin->canvas, row, col, 0);
+
+        *style = (tile != NULL)
+            ? tile->styles[twin_tile_cell(row, col)] : TWIN_STYLE_BLANK;
+        *glyph = (tile != NULL) ? tile->glyphs[twin_tile_cell(row, col)] : ' ';
+        return;
+    }
+    if (!twin_frame(twin))
+    {
+        *style = TWIN_STYLE_BLANK;     /* (no frame: blank) */
+        *glyph = ' ';
+        return;
+    }
+    *style = twin->styles[twin_cell(twin->geometry, row, col)];
+    *glyph = twin->glyphs[twin_cell(twin->geometry, row, col)];
+}
+
+
+/*
+ * twin_under_drawn() --Note a cell drawn on a window, under its overlays.
+ *
+ * Remarks:
+ * Drawing on a window (rather than composing onto it) is beneath any
+ * transparent window composed onto it, even where it's hidden, so
+ * it's copied to each overlay's cells, to show when it's uncovered.
+ */
+static void twin_under_drawn(const Twindow * twin, int row, int col,
+                             TwinStyle style, uint8_t glyph)
+{
+    for (TwinUnder * under = twin->overlays; under != NULL;
+         under = under->next)
+    {
+        int r = row - under->at.row;
+        int c = col - under->at.column;
+
+        if (r >= 0 && r < under->rows && c >= 0 && c < under->columns)
+        {
+            under->styles[r * under->columns + c] = style;
+            under->glyphs[r * under->columns + c] = glyph;
+        }
+    }
+}
+
+
+/*
+ * twin_under_copy() --Copy a region of dst to the cells beneath a window.
+ */
+static void twin_under_copy(const Twindow * dst, TwinUnder * under,
+                            TwinRegion region)
+{
+    int min_row = (region.min.row > under->at.row)
+        ? region.min.row : under->at.row;
+    int max_row = (region.max.row < under->at.row + under->rows - 1)
+        ? region.max.row : under->at.row + under->rows - 1;
+    int min = (region.min.column > under->at.column)
+        ? region.min.column : under->at.column;
+    int max = (region.max.column < under->at.column + under->columns - 1)
+        ? region.max.column : under->at.column + under->columns - 1;
+
+    min_row = (min_row < 0) ? 0 : min_row;
+    min = (min < 0) ? 0 : min;
+    max_row = (max_row >= dst->geometry.size.row)
+        ? dst->geometry.size.row - 1 : max_row;
+    max = (max >= dst->geometry.size.column)
+        ? dst->geometry.size.column - 1 : max;
+    for (int r = min_row; r <= max_row; ++r)
+    {
+        for (int c = min; c <= max; ++c)
+        {
+            int i = (r - under->at.row) * under->columns
+                + c - under->at.column;
+
+            twin_peek(dst, r, c, &under->styles[i], &under->glyphs[i]);
+        }
+    }
+}
+
+
+/*
+ * twin_get_cell() --Get a cell of a window, as a TwinCell.
+ */
+TwinCell twin_get_cell(const Twindow * twin, int row, int col)
+{
+    TwinStyle style;
+    uint8_t glyph;
+    TwinCell cell;
+
+    twin_peek(twin, row, col, &style, &glyph);
+    cell = twin_style_cell(style);
+    cell.ch = glyph;
+    return cell;
+}
+
+
+/*
+ * twin_set_glyph() --Set a cell by style id and glyph, updating damage.
+ *
+ * Returns: (int)
+ * 1 if the cell is within the window, 0 if not.
+ *
+ * Remarks:
+ * This is twin_set_cell() for callers that draw many cells in a few
+ * styles: they intern each style once.
+ */
+int twin_set_glyph(Twindow * twin, int row, int col,
+                   TwinStyle style, uint8_t glyph)
+{
+    if (row < 0 || row >= twin->geometry.size.row
+        || col < 0 || col >= twin->geometry.size.column)
+    {
+        return 0;                      /* failure: bounds check */
+    }
+    if (!twin_frame(twin))
+    {
+        return 0;                      /* failure: no frame */
+    }
+    if (twin->overlays != NULL && !composing)
+    {
+        twin_under_drawn(twin, row, col, style, glyph);
+    }
+
+    TwinStyle *cell_style;
+    uint8_t *cell_glyph;
+
+    if (twin->canvas != NULL)
+    {                                  /* canvas: tile, allocated on write */
+        TwinTile *tile = twin_canvas_tile(twin->canvas, row, col,
+                                          glyph != ' '
+                                          || style != TWIN_STYLE_BLANK);
+
+        if (tile == NULL)
+        {
+            return 1;                  /* (blank on blank: no change) */
+        }
+        cell_style = &tile->styles[twin_tile_cell(row, col)];
+        cell_glyph = &tile->glyphs[twin_tile_cell(row, col)];
+    }
+    else
+    {
+        cell_style = &twin->styles[twin_cell(twin->geometry, row, col)];
+        cell_glyph = &twin->glyphs[twin_cell(twin->geometry, row, col)];
+    }
+
+    if (*cell_glyph != glyph || *cell_style != style)
+    {                                  /* update damage */
+        *cell_glyph = glyph;
+        *cell_style = style;
+        twin->generation += 1;         /* (see twin_list_run()) */
+        TWIN_TRACE(TwinTraceDamage);
+        twin->state |= TwinRegiond;
+        if (twin->state & TwinBatch)
+        {                              /* ...later, all at once */
+            return 1;
+        }
+        if (row < twin->damage.min.row)
+        {
+            twin->damage.min.row = row;
+        }
+        if (col < twin->damage.min.column)
+        {
+            twin->damage.min.column = col;
+        }
+        if (row > twin->damage.max.row)
+        {
+            twin->damage.max.row = row;
+        }
+        if (col > twin->damage.max.column)
+        {
+            twin->damage.max.column = col;
+        }
+    }
+    return 1;                          /* success */
+}
+
+
+/*
+ * twin_clock() --Get the monotonic time, in ms.
+ */
+uint64_t twin_clock(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000 + (uint64_t) now.tv_nsec / 1000000;
+}
+
+
 Twindow *twin_alloc(void)
 {
     return malloc(sizeof(Twindow));
@@ -29,7 +423,7 @@ Twindow *twin_alloc(void)
 
 Twindow *twin_init(Twindow * twin, Twindow * parent,
                    int row, int column, int height, int width,
-                   TwinCell * frame)
+                   void *frame)
 {
     memset(twin, 0, sizeof(*twin));    /* nulls linkage pointers */
     twin->parent = parent;
@@ -38,6 +432,11 @@ Twindow *twin_init(Twindow * twin, Twindow * parent,
     twin->geometry.size.row = height;
     twin->geometry.size.column = width;
     twin->frame = frame;
+    if (frame != NULL)
+    {                                  /* (else: see init_twin_canvas()) */
+        twin->styles = frame;
+        twin->glyphs = (uint8_t *) (twin->styles + (size_t) height * width);
+    }
     twin->style = blank;
     twin_reset(twin);                  /* not damaged */
     twin_clear(twin);                  /* all spaces */
@@ -47,6 +446,8 @@ Twindow *twin_init(Twindow * twin, Twindow * parent,
 
 void free_twin(Twindow * twin)
 {
+    free_twin_canvas(twin);
+    free_twin_under(twin);
     if (twin->frame)
     {
         free(twin->frame);
@@ -61,7 +462,65 @@ void twin_reset(Twindow * twin)
     twin->damage.min.column = twin->geometry.size.column;
     twin->damage.max.row = 0;
     twin->damage.max.column = 0;
-    twin->state &= ~TwinRegiond;
+    twin->state &= ~(TwinRegiond | TwinScrolled);
+}
+
+
+/*
+ * twin_damage() --Add a region to a window's damage.
+ *
+ * Remarks:
+ * The region must be within the window.
+ */
+Twindow *twin_damage(Twindow * twin, TwinRegion region)
+{
+    if (region.min.row < twin->damage.min.row)
+    {
+        twin->damage.min.row = region.min.row;
+    }
+    if (region.min.column < twin->damage.min.column)
+    {
+        twin->damage.min.column = region.min.column;
+    }
+    if (region.max.row > twin->damage.max.row)
+    {
+        twin->damage.max.row = region.max.row;
+    }
+    if (region.max.column > twin->damage.max.column)
+    {
+        twin->damage.max.column = region.max.column;
+    }
+    TWIN_TRACE(TwinTraceDamage);
+    twin->state |= TwinRegiond;
+    return twin;
+}
+
+
+/*
+ * twin_scroll_pending() --Record a scroll, for xterm_sync() to replay.
+ *
+ * Remarks:
+ * Scrolls of the same region accumulate; if a different region is
+ * scrolled, nothing is recorded.  This is safe because a scroll
+ * damages its whole region, so the diff will repaint it anyway.
+ */
+static void twin_scroll_pending(Twindow * twin, TwinRegion region, int n)
+{
+    if (!(twin->state & TwinScrolled))
+    {
+        twin->scroll.region = region;
+        twin->scroll.n = n;
+        twin->state |= TwinScrolled;
+    }
+    else if (memcmp(&twin->scroll.region, &region, sizeof(region)) == 0
+             && twin->scroll.n != 0)
+    {
+        twin->scroll.n += n;
+    }
+    else
+    {
+        twin->scroll.n = 0;            /* conflict: repaint instead */
+    }
 }
 
 
@@ -75,55 +534,61 @@ Twindow *twin_cursor(Twindow * twin, int row, int column)
 
 int twin_set_cell(Twindow * twin, int row, int col, TwinCell cell)
 {
-    if (row < 0 || row > twin->geometry.size.row
-        || col < 0 || col > twin->geometry.size.column)
-    {
-        return 0;                      /* failure: bounds check */
-    }
+    return twin_set_glyph(twin, row, col, twin_style_intern(cell), cell.ch);
+}
 
-    int offset = twin_cell(twin->geometry, row, col);
 
-    if (memcmp(&cell, &twin->frame[offset], sizeof(TwinCell)) != 0)
-    {                                  /* update damage */
-        if (row < twin->damage.min.row)
-        {
-            twin->damage.min.row = row;
-        }
-        if (col < twin->damage.min.column)
+/*
+ * twin_putn() --Write some UTF-8 text at the cursor.
+ *
+ * Parameters:
+ * twin     --the window to write to
+ * text     --the text (not necessarily NUL-terminated)
+ * size     --its length in bytes
+ *
+ * Remarks:
+ * The text is decoded a block at a time (see twutf8.h): ASCII runs
+ * are copied through, and other characters cover the columns they
+ * would on a UTF-8 terminal.  Text past the window's edge is clipped.
+ */
+Twindow *twin_putn(Twindow * twin, const char *text, size_t size)
+{
+    TwinStyle style = twin_style_intern(twin->style);
+    uint8_t glyph[TWIN_UTF8_BLOCK];
+
+    while (size > 0)
+    {
+        int col = twin->cursor.column;
+        int n_columns = twin->geometry.size.column - col;
+        int n_glyph;
+        size_t used;
+
+        if (n_columns <= 0)
         {
-            twin->damage.min.column = col;
+            break;                     /* overflow */
         }
-        if (row > twin->damage.max.row)
+        used = twin_utf8_glyphs(text, size, glyph,
+                                (n_columns < TWIN_UTF8_BLOCK)
+                                ? n_columns : TWIN_UTF8_BLOCK, &n_glyph);
+        for (int i = 0; i < n_glyph; ++i)
         {
-            twin->damage.max.row = row;
+            twin_set_glyph(twin, twin->cursor.row, col + i, style, glyph[i]);
         }
-        if (col > twin->damage.max.column)
+        twin->cursor.column = col + n_glyph;
+        if (used == 0)
         {
-            twin->damage.max.column = col;
+            break;                     /* a wide character doesn't fit */
         }
-        twin->state |= TwinRegiond;
-        twin->frame[offset] = cell;
+        text += used;
+        size -= used;
     }
-    return 1;                          /* success */
+    return twin;
 }
 
 
 Twindow *twin_puts(Twindow * twin, const char *text)
 {
-    int col;
-    TwinCell cell = twin->style;
-
-    for (col = twin->cursor.column; *text != '\0'; ++text, ++col)
-    {
-        if (col >= twin->geometry.size.column)
-        {
-            break;                     /* overflow */
-        }
-        cell.ch = (uint8_t) * text;
-        twin_set_cell(twin, twin->cursor.row, col, cell);
-    }
-    twin->cursor.column = col;
-    return twin;
+    return twin_putn(twin, text, strlen(text));
 }
 
 Twindow *twin_hline(Twindow * twin, int row, int column, int size)
@@ -140,17 +605,19 @@ Twindow *twin_hline(Twindow * twin, int row, int column, int size)
         start = column + size + 1;     /* -ve! */
         end = column + 1;
     }
-    if (row + size < 0 || row >= twin->geometry.size.row)
+    if (row < 0 || row >= twin->geometry.size.row)
     {                                  /* out of range */
         return twin;
     }
 
+    TwinCell line_style = twin->style;
+
+    line_style.attr |= TwinAlt;
+    TwinStyle style = twin_style_intern(line_style);
+
     for (c = start; c < end; ++c)
     {
-        int offset = twin_cell(twin->geometry, row, c);
-        TwinCell cell = twin->frame[offset];
         char ch = '\0';
-        TwinCell new_cell = twin->style;
 
         if (c < 0)
         {
@@ -160,7 +627,11 @@ Twindow *twin_hline(Twindow * twin, int row, int column, int size)
         {
             break;                     /* overflow */
         }
-        new_cell.attr |= TwinAlt;
+
+        TwinStyle cell_style;
+        uint8_t glyph;
+
+        twin_peek(twin, row, c, &cell_style, &glyph);
         if (c == column)
         {                              /* true start */
             ch = line_frag[0];         /* " -" */
@@ -174,16 +645,15 @@ Twindow *twin_hline(Twindow * twin, int row, int column, int size)
             ch = line_frag[1];         /* "--" */
         }
 
-        if ((cell.attr & TwinAlt) && (cell.ch < 16)
-            && twin_cmp_style(cell, new_cell) == 0)
-        {
-            new_cell.ch = (uint8_t) (cell.ch | ch); /* merge line graphics */
+        if (cell_style == style && glyph < 16)
+        {                              /* (same style implies TwinAlt) */
+            glyph |= (uint8_t) ch;     /* merge line graphics */
         }
         else
         {
-            new_cell.ch = (uint8_t) ch; /* replace with line graphic */
+            glyph = (uint8_t) ch;      /* replace with line graphic */
         }
-        twin_set_cell(twin, row, c, new_cell);
+        twin_set_glyph(twin, row, c, style, glyph);
     }
     return twin;
 }
@@ -204,17 +674,19 @@ Twindow *twin_vline(Twindow * twin, int row, int column, int size)
         end = row + 1;
     }
 
-    if (column + size < 0 || column >= twin->geometry.size.column)
+    if (column < 0 || column >= twin->geometry.size.column)
     {                                  /* out of range */
         return twin;
     }
 
+    TwinCell line_style = twin->style;
+
+    line_style.attr |= TwinAlt;
+    TwinStyle style = twin_style_intern(line_style);
+
     for (r = start; r < end; ++r)
     {
-        int offset = twin_cell(twin->geometry, r, column);
-        TwinCell cell = twin->frame[offset];
         char ch = '\0';
-        TwinCell new_cell = twin->style;
 
         if (r < 0)
         {
@@ -224,7 +696,11 @@ Twindow *twin_vline(Twindow * twin, int row, int column, int size)
         {
             break;                     /* overflow */
         }
-        new_cell.attr |= TwinAlt;
+
+        TwinStyle cell_style;
+        uint8_t glyph;
+
+        twin_peek(twin, r, column, &cell_style, &glyph);
         if (r == row)
         {                              /* true start */
             ch = line_frag[0];
@@ -238,19 +714,16 @@ Twindow *twin_vline(Twindow * twin, int row, int column, int size)
             ch = line_frag[1];
         }
 
-        if ((cell.attr & TwinAlt) && (cell.ch < 16)
-            && twin_cmp_style(cell, new_cell) == 0)
-        {
-            new_cell.ch = (uint8_t) (cell.ch | ch); /* merge line graphics */
+        debug("%s(@%d): 0x%hhx+0x%hhx", __func__, r, glyph, ch);
+        if (cell_style == style && glyph < 16)
+        {                              /* (same style implies TwinAlt) */
+            glyph |= (uint8_t) ch;     /* merge line graphics */
         }
         else
         {
-            new_cell.ch = (uint8_t) ch; /* replace with line graphic */
+            glyph = (uint8_t) ch;      /* replace with line graphic */
         }
-        debug("%s(@%d): 0x%hhx+0x%hhx -> 0x%hhx",
-              __func__, r, cell.ch, ch, new_cell.ch);
-
-        twin_set_cell(twin, r, column, new_cell);
+        twin_set_glyph(twin, r, column, style, glyph);
     }
     return twin;
 }
@@ -266,42 +739,1018 @@ Twindow *twin_box(Twindow * tw, int row, int column,
 }
 
 
-Twindow *twin_printf(Twindow * twin, const char *format, ...)
-{
-    /* char text[twin->geometry.size.column]; */
-
-    err("%s(): not implemented", __func__);
-    return NULL;
+/*
+ * twin_printf() --Print formatted text at the cursor.
+ *
+ * Remarks:
+ * The text is formatted into a stack buffer sized to the remainder
+ * of the cursor's row (at up to 4 bytes a column, for UTF-8), so it's
+ * clipped by construction, and there's no heap allocation.  The
+ * numeric fast paths (twin_put_int() etc.) avoid vsnprintf()
+ * altogether.
+ */
+Twindow *twin_printf(Twindow * twin, const char *format, ...)
+{
+    int n_columns = twin->geometry.size.column - twin->cursor.column;
+
+    if (n_columns <= 0)
+    {
+        return twin;                   /* nothing visible */
+    }
+
+    char text[4 * n_columns + 1];
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len < 0)
+    {
+        return twin;
+    }
+    len = (len < (int) sizeof(text)) ? len : (int) sizeof(text) - 1;
+    return twin_putn(twin, text, twin_utf8_truncate(text, (size_t) len));
+}
+
+
+/*
+ * twin_put_field() --Write some text in a field at the cursor.
+ *
+ * Parameters:
+ * twin     --the window to write to
+ * text     --the text (not necessarily NUL-terminated)
+ * len      --the length of text
+ * width    --field width: +ve: right-aligned, -ve: left-aligned
+ *
+ * Remarks:
+ * Like printf(), the width is a minimum; the field is clipped by
+ * the window's edges, not by the width.
+ */
+static Twindow *twin_put_field(Twindow * twin, const char *text, int len,
+                               int width)
+{
+    int row = twin->cursor.row;
+    int col = twin->cursor.column;
+    int pad = abs(width) - len;
+    TwinStyle style = twin_style_intern(twin->style);
+
+    for (; width > 0 && pad > 0; --pad, ++col)
+    {                                  /* right-align: pad on the left */
+        twin_set_glyph(twin, row, col, style, ' ');
+    }
+    for (int i = 0; i < len && col < twin->geometry.size.column; ++i, ++col)
+    {
+        twin_set_glyph(twin, row, col, style, (uint8_t) text[i]);
+    }
+    for (; pad > 0 && col < twin->geometry.size.column; --pad, ++col)
+    {                                  /* left-align: pad on the right */
+        twin_set_glyph(twin, row, col, style, ' ');
+    }
+    twin->cursor.column = col;
+    return twin;
+}
+
+
+/*
+ * twin_fmt_ulong() --Format digits backwards, ending at end.
+ *
+ * Returns: (char *)
+ * The start of the formatted digits.
+ */
+static char *twin_fmt_ulong(char *end, unsigned long value, int min_digits)
+{
+    static const char digit_pair[] =
+        "00010203040506070809101112131415161718192021222324252627282930313233"
+        "34353637383940414243444546474849505152535455565758596061626364656667"
+        "6869707172737475767778798081828384858687888990919293949596979899";
+    char *str = end;
+
+    while (value >= 100)
+    {                                  /* two digits at a time */
+        const char *pair = &digit_pair[(value % 100) * 2];
+
+        value /= 100;
+        *--str = pair[1];
+        *--str = pair[0];
+    }
+    if (value >= 10)
+    {
+        *--str = digit_pair[value * 2 + 1];
+        *--str = digit_pair[value * 2];
+    }
+    else
+    {
+        *--str = (char) ('0' + value);
+    }
+    while (end - str < min_digits)
+    {
+        *--str = '0';
+    }
+    return str;
+}
+
+
+static unsigned long twin_abs(long value)
+{
+    return (value < 0) ? -(unsigned long) value : (unsigned long) value;
+}
+
+
+/*
+ * twin_put_int() --Print an integer at the cursor.
+ *
+ * Parameters:
+ * twin     --the window to write to
+ * value    --the value to print
+ * width    --field width: +ve: right-aligned, -ve: left-aligned
+ */
+Twindow *twin_put_int(Twindow * twin, long value, int width)
+{
+    char text[24];
+    char *end = text + sizeof(text);
+    char *str = twin_fmt_ulong(end, twin_abs(value), 1);
+
+    if (value < 0)
+    {
+        *--str = '-';
+    }
+    return twin_put_field(twin, str, (int) (end - str), width);
 }
 
+
+/*
+ * twin_put_fixed() --Print a fixed-point number at the cursor.
+ *
+ * Parameters:
+ * twin     --the window to write to
+ * value    --the value, scaled by 10^places (e.g. 12345, 2 -> "123.45")
+ * places   --the number of decimal places
+ * width    --field width: +ve: right-aligned, -ve: left-aligned
+ */
+Twindow *twin_put_fixed(Twindow * twin, long value, int places, int width)
+{
+    char text[48];
+    char *end = text + sizeof(text);
+    char *str = end;
+    unsigned long abs_value = twin_abs(value);
+
+    if (places <= 0 || places > 18)
+    {
+        return twin_put_int(twin, value, width);
+    }
+    unsigned long scale = 1;
+
+    for (int i = 0; i < places; ++i)
+    {
+        scale *= 10;
+    }
+    str = twin_fmt_ulong(str, abs_value % scale, places);
+    *--str = '.';
+    str = twin_fmt_ulong(str, abs_value / scale, 1);
+    if (value < 0)
+    {
+        *--str = '-';
+    }
+    return twin_put_field(twin, str, (int) (end - str), width);
+}
+
+
+/*
+ * twin_put_si() --Print a number with an SI suffix at the cursor.
+ *
+ * Parameters:
+ * twin     --the window to write to
+ * value    --the value to print
+ * width    --field width: +ve: right-aligned, -ve: left-aligned
+ *
+ * Remarks:
+ * Values are shown with three significant digits, truncated rather
+ * than rounded (so the field never grows), e.g. "999", "1.23k",
+ * "45.6M", "789G".
+ */
+Twindow *twin_put_si(Twindow * twin, long value, int width)
+{
+    static const char suffix[] = "kMGTPE";
+    char text[24];
+    char *end = text + sizeof(text);
+    char *str = end;
+    unsigned long abs_value = twin_abs(value);
+    unsigned long unit = 1;
+    int exponent = -1;
+
+    while (abs_value / unit >= 1000)
+    {
+        unit *= 1000;
+        ++exponent;
+    }
+    if (exponent < 0)
+    {                                  /* small values print as-is */
+        return twin_put_int(twin, value, width);
+    }
+    unsigned long whole = abs_value / unit;
+    unsigned long part = abs_value % unit;
+
+    *--str = suffix[exponent];
+    if (whole < 10)
+    {
+        str = twin_fmt_ulong(str, part / (unit / 100), 2);
+        *--str = '.';
+    }
+    else if (whole < 100)
+    {
+        str = twin_fmt_ulong(str, part / (unit / 10), 1);
+        *--str = '.';
+    }
+    str = twin_fmt_ulong(str, whole, 1);
+    if (value < 0)
+    {
+        *--str = '-';
+    }
+    return twin_put_field(twin, str, (int) (end - str), width);
+}
+
+
 Twindow *twin_clear(Twindow * twin)
 {
-    TwinCell *cell = twin->frame;
+    size_t n = (size_t) twin->geometry.size.row * twin->geometry.size.column;
 
-    for (int i = 0;
-         i < twin->geometry.size.row * twin->geometry.size.column; ++i)
+    if (twin->canvas != NULL)
     {
-        *cell++ = blank;
+        twin_canvas_clear(twin->canvas);
     }
+    else if (twin_frame(twin))
+    {
+        memset(twin->styles, 0, n * sizeof(TwinStyle));   /* TWIN_STYLE_BLANK */
+        memset(twin->glyphs, ' ', n);
+    }
+    for (TwinUnder * under = twin->overlays; under != NULL;
+         under = under->next)
+    {
+        TwinRegion all = {
+            {0, 0}, {twin->geometry.size.row - 1,
+                     twin->geometry.size.column - 1}
+        };
+
+        twin_under_copy(twin, under, all);
+    }
+    twin->generation += 1;
     return twin;
 }
 
-Twindow *twin_compose(Twindow * dst, Twindow * src, TwinCoordinate offset)
+/*
+ * twin_under_scroll() --Scroll the cells beneath a window's overlays.
+ *
+ * Remarks:
+ * This is called before the window's own cells are scrolled.  Where a
+ * cell comes from beneath the overlay, that's what's beneath it now;
+ * otherwise it's the window's cell (which is the same thing, unless
+ * another window's been composed over it).
+ */
+static void twin_under_scroll(const Twindow * twin, TwinRegion region,
+                              int n, TwinStyle fill)
+{
+    int n_rows = region.max.row - region.min.row + 1;
+
+    for (TwinUnder * under = twin->overlays; under != NULL;
+         under = under->next)
+    {
+        for (int i = 0; i < n_rows; ++i)
+        {
+            int r = (n > 0) ? region.min.row + i : region.max.row - i;
+            int from = r + n;
+            int row = r - under->at.row;
+
+            if (row < 0 || row >= under->rows)
+            {
+                continue;
+            }
+            for (int c = region.min.column; c <= region.max.column; ++c)
+            {
+                int column = c - under->at.column;
+                int cell = row * under->columns + column;
+
+                if (column < 0 || column >= under->columns)
+                {
+                    continue;
+                }
+                if (from < region.min.row || from > region.max.row)
+                {
+                    under->styles[cell] = fill;
+                    under->glyphs[cell] = ' ';
+                }
+                else if (from >= under->at.row
+                         && from < under->at.row + under->rows)
+                {
+                    int from_cell = (from - under->at.row) * under->columns
+                        + column;
+
+                    under->styles[cell] = under->styles[from_cell];
+                    under->glyphs[cell] = under->glyphs[from_cell];
+                }
+                else
+                {
+                    twin_peek(twin, from, c, &under->styles[cell],
+                              &under->glyphs[cell]);
+                }
+            }
+        }
+    }
+}
+
+
+/*
+ * twin_canvas_scroll() --Scroll a (clipped) region of a canvas.
+ *
+ * Remarks:
+ * Tiles don't have contiguous rows, so the cells are moved one at a
+ * time.  The scroll isn't recorded: it's in canvas coordinates, and
+ * twin_compose() only copies the viewport.
+ */
+static Twindow *twin_canvas_scroll(Twindow * twin, TwinRegion region, int n,
+                                   TwinStyle fill)
+{
+    int n_rows = region.max.row - region.min.row + 1;
+
+    for (int i = 0; i < n_rows; ++i)
+    {
+        int r = (n > 0) ? region.min.row + i : region.max.row - i;
+        int from = r + n;
+
+        for (int c = region.min.column; c <= region.max.column; ++c)
+        {
+            TwinStyle style = fill;
+            uint8_t glyph = ' ';
+
+            if (from >= region.min.row && from <= region.max.row)
+            {
+                twin_peek(twin, from, c, &style, &glyph);
+            }
+            twin_set_glyph(twin, r, c, style, glyph);
+        }
+    }
+    twin->generation += 1;
+    return twin_damage(twin, region);
+}
+
+
+/*
+ * twin_scroll() --Scroll a region of a window's rows.
+ *
+ * Parameters:
+ * twin     --the window to scroll
+ * region   --the region to scroll (inclusive, like damage)
+ * n        --number of rows: +ve: scroll up, -ve: scroll down
+ *
+ * Remarks:
+ * The rows are moved in the frame, and the exposed rows are cleared
+ * in the window's style.  The whole region is damaged, but the
+ * scroll is also recorded so that the terminal can be told to scroll
+ * (see xterm_sync()), leaving only the exposed rows to be drawn.
+ */
+Twindow *twin_scroll(Twindow * twin, TwinRegion region, int n)
+{
+    TwinStyle fill = twin_style_intern(twin->style);
+    int width = twin->geometry.size.column;
+
+    region.min.row = (region.min.row < 0) ? 0 : region.min.row;
+    region.min.column = (region.min.column < 0) ? 0 : region.min.column;
+    if (region.max.row >= twin->geometry.size.row)
+    {
+        region.max.row = twin->geometry.size.row - 1;
+    }
+    if (region.max.column >= width)
+    {
+        region.max.column = width - 1;
+    }
+    if (n == 0 || region.min.row > region.max.row
+        || region.min.column > region.max.column)
+    {
+        return twin;                   /* nothing to scroll */
+    }
+
+    if (!twin_frame(twin))
+    {
+        return twin;                   /* no frame */
+    }
+    twin_under_scroll(twin, region, n, fill);
+    if (twin->canvas != NULL)
+    {
+        composing += 1;                /* (overlays are already scrolled) */
+        twin_canvas_scroll(twin, region, n, fill);
+        composing -= 1;
+        return twin;
+    }
+
+    int n_rows = region.max.row - region.min.row + 1;
+    int n_columns = region.max.column - region.min.column + 1;
+    int distance = abs(n);
+    int first_blank = (n > 0) ? region.max.row - distance + 1 : region.min.row;
+
+    if (distance < n_rows)
+    {
+        int src = region.min.row + ((n > 0) ? distance : 0);
+        int dst = region.min.row + ((n > 0) ? 0 : distance);
+
+        if (n_columns == width)
+        {                              /* rows are contiguous */
+            size_t n_cells = (size_t) (n_rows - distance) * (size_t) width;
+            int to = twin_cell(twin->geometry, dst, 0);
+            int from = twin_cell(twin->geometry, src, 0);
+
+            memmove(&twin->styles[to], &twin->styles[from],
+                    n_cells * sizeof(TwinStyle));
+            memmove(&twin->glyphs[to], &twin->glyphs[from], n_cells);
+        }
+        else
+        {
+            for (int i = 0; i < n_rows - distance; ++i)
+            {
+                int r = (n > 0) ? i : n_rows - distance - 1 - i;
+                int to = twin_cell(twin->geometry, dst + r, region.min.column);
+                int from =
+                    twin_cell(twin->geometry, src + r, region.min.column);
+
+                memmove(&twin->styles[to], &twin->styles[from],
+                        (size_t) n_columns * sizeof(TwinStyle));
+                memmove(&twin->glyphs[to], &twin->glyphs[from],
+                        (size_t) n_columns);
+            }
+        }
+    }
+    else
+    {
+        distance = n_rows;
+        first_blank = region.min.row;
+    }
+
+    for (int r = first_blank; r < first_blank + distance; ++r)
+    {
+        int offset = twin_cell(twin->geometry, r, region.min.column);
+
+        for (int c = 0; c < n_columns; ++c)
+        {
+            twin->styles[offset + c] = fill;
+        }
+        memset(&twin->glyphs[offset], ' ', (size_t) n_columns);
+    }
+    if (distance < n_rows)
+    {
+        twin_scroll_pending(twin, region, n);
+    }
+    twin->generation += 1;
+    return twin_damage(twin, region);
+}
+
+
+#define TWIN_BLEND_CHUNK 64            /* cells blended at a time */
+#define TWIN_BLEND_LANES 8             /* ...and in each vector */
+
+typedef uint16_t TwinLanes __attribute__ ((vector_size(16)));
+typedef uint8_t TwinLaneBytes __attribute__ ((vector_size(8)));
+
+/*
+ * twin_blend_lanes() --Blend TWIN_BLEND_LANES cells (see twin_blend_row()).
+ *
+ * Remarks:
+ * Glyphs are widened to 16 bits, so each step is a single 8 x 16 bit
+ * vector of selects (SSE2, NEON); comparisons give all-ones lanes.
+ */
+static inline void twin_blend_lanes(TwinStyle * style, uint8_t * glyph,
+                                    const TwinStyle * src_style,
+                                    const uint8_t * src_glyph,
+                                    const TwinStyle * under_style,
+                                    const uint8_t * under_glyph,
+                                    const uint8_t * show, TwinLanes merge)
+{
+    TwinLaneBytes bytes;
+    TwinLanes s, us, g, ug, visible;
+
+    memcpy(&s, src_style, sizeof(s));
+    memcpy(&us, under_style, sizeof(us));
+    memcpy(&bytes, src_glyph, sizeof(bytes));
+    g = __builtin_convertvector(bytes, TwinLanes);
+    memcpy(&bytes, under_glyph, sizeof(bytes));
+    ug = __builtin_convertvector(bytes, TwinLanes);
+    memcpy(&bytes, show, sizeof(bytes));
+    visible = __builtin_convertvector(bytes, TwinLanes);
+
+    TwinLanes blank = merge & (TwinLanes) (g == ' ')
+        & (TwinLanes) (s == TWIN_STYLE_BLANK);
+    TwinLanes lines = merge & (TwinLanes) (g < 16) & (TwinLanes) (ug < 16)
+        & (TwinLanes) (s == us);
+    TwinLanes opaque = (TwinLanes) (visible != 0) & ~blank;
+
+    g |= lines & ug;                   /* merge line graphics */
+    s = (opaque & s) | (~opaque & us);
+    g = (opaque & g) | (~opaque & ug);
+    memcpy(style, &s, sizeof(s));
+    bytes = __builtin_convertvector(g, TwinLaneBytes);
+    memcpy(glyph, &bytes, sizeof(bytes));
+}
+
+
+/*
+ * twin_blend_row() --Compose a row of cells onto a window.
+ *
+ * Parameters:
+ * dst         --the window composed onto (which has a frame)
+ * row, column --where the cells go, in dst (already clipped)
+ * styles, glyphs --the source cells
+ * under_styles, under_glyphs --the cells beneath them
+ * mask        --per cell, 0: the cell beneath shows through; or NULL
+ * n           --the number of cells
+ * mode        --TwinTransparent: blank cells show through, and line
+ *               graphics merge with those underneath (as twin_hline())
+ *
+ * Remarks:
+ * The cells are blended a chunk at a time, a vector of cells at a
+ * time, then each chunk is written back if it changed, damaging just
+ * the changed columns.
+ */
+static void twin_blend_row(Twindow * dst, int row, int column,
+                           const TwinStyle * styles, const uint8_t * glyphs,
+                           const TwinStyle * under_styles,
+                           const uint8_t * under_glyphs,
+                           const uint8_t * mask, int n, int mode)
+{
+    int offset = twin_cell(dst->geometry, row, column);
+    TwinStyle *dst_styles = dst->styles + offset;
+    uint8_t *dst_glyphs = dst->glyphs + offset;
+    int merge = (mode & TwinTransparent) != 0;
+    TwinLanes merge_lanes = (TwinLanes) { 0 } - (uint16_t) merge;  /* ~0 */
+
+    for (int i = 0; i < n; i += TWIN_BLEND_CHUNK)
+    {
+        int m = (n - i < TWIN_BLEND_CHUNK) ? n - i : TWIN_BLEND_CHUNK;
+        uint8_t show[TWIN_BLEND_CHUNK];
+        TwinStyle style[TWIN_BLEND_CHUNK];
+        uint8_t glyph[TWIN_BLEND_CHUNK];
+        int first = 0;
+        int last = m - 1;
+        int j = 0;
+
+        if (mask != NULL)
+        {
+            memcpy(show, mask + i, (size_t) m);
+        }
+        else
+        {
+            memset(show, 0xff, (size_t) m);
+        }
+        for (; j + TWIN_BLEND_LANES <= m; j += TWIN_BLEND_LANES)
+        {
+            twin_blend_lanes(style + j, glyph + j, styles + i + j,
+                             glyphs + i + j, under_styles + i + j,
+                             under_glyphs + i + j, show + j, merge_lanes);
+        }
+        for (; j < m; ++j)
+        {                              /* (the odd cells, one at a time) */
+            TwinStyle s = styles[i + j];
+            TwinStyle under_s = under_styles[i + j];
+            uint8_t g = glyphs[i + j];
+            uint8_t under_g = under_glyphs[i + j];
+            int blank = merge && g == ' ' && s == TWIN_STYLE_BLANK;
+            int lines = merge && g < 16 && under_g < 16 && s == under_s;
+            int opaque = show[j] != 0 && !blank;
+
+            g = lines ? (uint8_t) (g | under_g) : g;
+            glyph[j] = opaque ? g : under_g;
+            style[j] = opaque ? s : under_s;
+        }
+
+        while (first < m && glyph[first] == dst_glyphs[i + first]
+               && style[first] == dst_styles[i + first])
+        {
+            ++first;
+        }
+        if (first == m)
+        {
+            continue;                  /* no change */
+        }
+        while (glyph[last] == dst_glyphs[i + last]
+               && style[last] == dst_styles[i + last])
+        {
+            --last;
+        }
+        memcpy(dst_glyphs + i + first, glyph + first,
+               (size_t) (last - first + 1));
+        memcpy(dst_styles + i + first, style + first,
+               (size_t) (last - first + 1) * sizeof(TwinStyle));
+        dst->generation += 1;
+        if (dst->state & TwinBatch)
+        {                              /* ...later, all at once */
+            dst->state |= TwinRegiond;
+        }
+        else
+        {
+            TwinRegion changed = {
+                {row, column + i + first}, {row, column + i + last}
+            };
+
+            twin_damage(dst, changed);
+        }
+    }
+}
+
+
+/*
+ * twin_composed_add() --Note a region of dst composed in this pass.
+ *
+ * Remarks:
+ * Windows composed later in the pass are above it, so it's what's
+ * beneath them (see twin_under_composed()).  If there's no memory, the
+ * region isn't noted.
+ */
+static void twin_composed_add(TwinRegion region)
+{
+    if (n_pass_region == pass_region_alloc)
+    {
+        int alloc = pass_region_alloc ? 2 * pass_region_alloc : 16;
+        TwinRegion *more = realloc(pass_region, alloc * sizeof(*more));
+
+        if (more == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            return;
+        }
+        pass_region = more;
+        pass_region_alloc = alloc;
+    }
+    pass_region[n_pass_region++] = region;
+}
+
+
+/*
+ * twin_under_release() --Release a window's own copy of the cells beneath it.
+ */
+static void twin_under_release(Twindow * twin)
+{
+    TwinUnder *under = twin->under;
+
+    if (under == NULL)
+    {
+        return;
+    }
+    if (under->dst != NULL)
+    {                                  /* unlink it from dst's overlays */
+        TwinUnder **link = &under->dst->overlays;
+
+        while (*link != NULL && *link != under)
+        {
+            link = &(*link)->next;
+        }
+        if (*link != NULL)
+        {
+            *link = under->next;
+        }
+    }
+    free(under);
+    twin->under = NULL;
+}
+
+
+/*
+ * twin_under() --Get the cells beneath a transparent window.
+ *
+ * Parameters:
+ * dst         --the window it's composed onto
+ * src         --the transparent window
+ * row, column --src's position in dst
+ *
+ * Returns: (TwinUnder *)
+ * src's copy of the cells beneath it, or NULL (no memory: dst's own
+ * cells are used, as for an opaque window).
+ *
+ * Remarks:
+ * The cells are copied from dst the first time src is composed there
+ * (and again if it's moved, or composed onto another window), before
+ * src is blended over them.  After that, they're kept up to date by
+ * whatever's drawn on dst, or composed onto it beneath src, so what
+ * was under it (its parent, the parent's parent, or an earlier
+ * sibling) shows through when a cell of src becomes transparent, even
+ * if dst is the parent, and src was composed over it.
+ */
+static TwinUnder *twin_under(Twindow * dst, Twindow * src,
+                             int row, int column)
+{
+    int rows = src->geometry.size.row;
+    int columns = src->geometry.size.column;
+    TwinUnder *under = src->under;
+    TwinRegion all = {
+        {row, column}, {row + rows - 1, column + columns - 1}
+    };
+
+    if (under != NULL && under->dst == dst && under->at.row == row
+        && under->at.column == column && under->rows == rows
+        && under->columns == columns)
+    {
+        return under;
+    }
+    twin_under_release(src);
+    under = malloc(sizeof(*under)
+                   + (size_t) rows * (size_t) columns * (sizeof(TwinStyle)
+                                                         + 1));
+    if (under == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return NULL;
+    }
+    under->dst = dst;
+    under->at.row = row;
+    under->at.column = column;
+    under->rows = rows;
+    under->columns = columns;
+    under->styles = (TwinStyle *) (under + 1);
+    under->glyphs = (uint8_t *) (under->styles + (size_t) rows * columns);
+    for (int i = 0; i < rows * columns; ++i)
+    {
+        under->styles[i] = TWIN_STYLE_BLANK;
+        under->glyphs[i] = ' ';
+    }
+    twin_under_copy(dst, under, all);
+    under->next = dst->overlays;
+    dst->overlays = under;
+    src->under = under;
+    return under;
+}
+
+
+/*
+ * twin_under_composed() --Copy what's been composed beneath a window.
+ *
+ * Remarks:
+ * Windows composed earlier in this pass are beneath this one, so
+ * whatever they left in dst is what's under it.
+ */
+static void twin_under_composed(const Twindow * dst, TwinUnder * under)
+{
+    for (int i = 0; i < n_pass_region; ++i)
+    {
+        twin_under_copy(dst, under, pass_region[i]);
+    }
+}
+
+
+/*
+ * free_twin_under() --Release a window's transparency bookkeeping.
+ *
+ * Remarks:
+ * This releases its copy of the cells beneath it, and forgets the
+ * transparent windows composed onto it.  Windows that aren't released
+ * by free_twin() (e.g. ones with a static frame) should call this
+ * when they're done with.
+ */
+void free_twin_under(Twindow * twin)
+{
+    twin_under_release(twin);
+    for (TwinUnder * under = twin->overlays; under != NULL;
+         under = under->next)
+    {
+        under->dst = NULL;             /* (copied again, if composed) */
+    }
+    twin->overlays = NULL;
+}
+
+
+/*
+ * twin_compose_cells() --Compose a window's cells in a region.
+ *
+ * Remarks:
+ * The region is in src coordinates, clipped to dst.  A canvas dst is
+ * written cell by cell; anything else a row at a time.  If src is
+ * transparent (under isn't NULL), it's blended over the cells beneath
+ * it (see twin_under()), rather than over dst's, which may be its own.
+ */
+static void twin_compose_cells(Twindow * dst, const Twindow * src,
+                               TwinUnder * under, TwinRegion region,
+                               int row, int column, int mode)
+{
+    if (!twin_frame(dst) || !twin_frame(src))
+    {
+        return;                        /* no frame */
+    }
+    for (int r = region.min.row; r <= region.max.row; ++r)
+    {
+        int cell = twin_cell(src->geometry, r, region.min.column);
+        int n = region.max.column - region.min.column + 1;
+        const uint8_t *mask = (src->mask != NULL) ? src->mask + cell : NULL;
+
+        if (dst->canvas == NULL)
+        {
+            int offset = twin_cell(dst->geometry, r + row,
+                                   region.min.column + column);
+            const TwinStyle *under_styles = dst->styles + offset;
+            const uint8_t *under_glyphs = dst->glyphs + offset;
+
+            if (under != NULL)
+            {
+                under_styles = under->styles + cell;
+                under_glyphs = under->glyphs + cell;
+            }
+            twin_blend_row(dst, r + row, region.min.column + column,
+                           src->styles + cell, src->glyphs + cell,
+                           under_styles, under_glyphs, mask, n, mode);
+            continue;
+        }
+        for (int c = 0; c < n; ++c)
+        {
+            TwinStyle style = src->styles[cell + c];
+            uint8_t glyph = src->glyphs[cell + c];
+            TwinStyle under_style;
+            uint8_t under_glyph;
+
+            twin_peek(dst, r + row, region.min.column + column + c,
+                      &under_style, &under_glyph);
+            if (under != NULL)
+            {
+                under_style = under->styles[cell + c];
+                under_glyph = under->glyphs[cell + c];
+            }
+            if ((mask != NULL && mask[c] == 0)
+                || ((mode & TwinTransparent) && glyph == ' '
+                    && style == TWIN_STYLE_BLANK))
+            {                          /* shows through */
+                style = under_style;
+                glyph = under_glyph;
+            }
+            else if ((mode & TwinTransparent) && glyph < 16
+                     && under_glyph < 16 && style == under_style)
+            {
+                glyph |= under_glyph;  /* merge line graphics */
+            }
+            twin_set_glyph(dst, r + row, region.min.column + column + c,
+                           style, glyph);
+        }
+    }
+}
+
+
+/*
+ * twin_compose_canvas() --Copy a canvas's viewport to a window.
+ *
+ * Remarks:
+ * If the viewport has moved, all of it is copied, otherwise just the
+ * damage within it.  A vertical pan is passed on as a scroll, so the
+ * terminal only draws the rows that have come into view.  Only the
+ * canvas's cells are read, even if the viewport was set up larger.
+ */
+static void twin_compose_canvas(Twindow * dst, Twindow * src,
+                                TwinCoordinate offset)
+{
+    TwinCanvas *canvas = src->canvas;
+    TwinGeometry view = canvas->viewport;
+    TwinRegion region = {
+        view.position,
+        {view.position.row + view.size.row - 1,
+         view.position.column + view.size.column - 1}
+    };
+    int row = src->geometry.position.row + offset.row - view.position.row;
+    int column =
+        src->geometry.position.column + offset.column - view.position.column;
+    int pan = view.position.row - canvas->composed.row;
+
+    if (memcmp(&view.position, &canvas->composed, sizeof(view.position)) ==
+        0)
+    {                                  /* same view: just the damage */
+        if (!(src->state & TwinRegiond))
+        {
+            return;
+        }
+        region.min.row = (src->damage.min.row > region.min.row)
+            ? src->damage.min.row : region.min.row;
+        region.min.column = (src->damage.min.column > region.min.column)
+            ? src->damage.min.column : region.min.column;
+        region.max.row = (src->damage.max.row < region.max.row)
+            ? src->damage.max.row : region.max.row;
+        region.max.column = (src->damage.max.column < region.max.column)
+            ? src->damage.max.column : region.max.column;
+    }
+    else if (view.position.column == canvas->composed.column
+             && abs(pan) < view.size.row)
+    {                                  /* vertical pan: scroll the view */
+        TwinRegion scroll = {
+            {region.min.row + row, region.min.column + column},
+            {region.max.row + row, region.max.column + column}
+        };
+
+        if (scroll.min.row >= 0 && scroll.min.column >= 0
+            && scroll.max.row < dst->geometry.size.row
+            && scroll.max.column < dst->geometry.size.column)
+        {
+            twin_scroll_pending(dst, scroll, pan);
+            twin_damage(dst, scroll);
+        }
+    }
+    region.min.row = (region.min.row < 0) ? 0 : region.min.row;
+    region.min.column = (region.min.column < 0) ? 0 : region.min.column;
+    region.max.row = (region.max.row >= src->geometry.size.row)
+        ? src->geometry.size.row - 1 : region.max.row;
+    region.max.column = (region.max.column >= src->geometry.size.column)
+        ? src->geometry.size.column - 1 : region.max.column;
+
+    for (int r = region.min.row; r <= region.max.row; ++r)
+    {
+        for (int c = region.min.column; c <= region.max.column;)
+        {                              /* ...a tile's span at a time */
+            TwinTile *tile = twin_canvas_tile(canvas, r, c, 0);
+            int end = c - c % TWIN_TILE_COLUMNS + TWIN_TILE_COLUMNS - 1;
+
+            end = (end > region.max.column) ? region.max.column : end;
+            for (; c <= end; ++c)
+            {
+                int cell = twin_tile_cell(r, c);
+
+                twin_set_glyph(dst, r + row, c + column,
+                               tile ? tile->styles[cell] : TWIN_STYLE_BLANK,
+                               tile ? tile->glyphs[cell] : ' ');
+            }
+        }
+    }
+    if (region.min.row <= region.max.row
+        && region.min.column <= region.max.column)
+    {
+        TwinRegion at = {
+            {region.min.row + row, region.min.column + column},
+            {region.max.row + row, region.max.column + column}
+        };
+
+        twin_composed_add(at);
+    }
+    canvas->composed = view.position;
+}
+
+
+/*
+ * twin_compose_tree() --Compose a window and its children onto dst.
+ */
+static void twin_compose_tree(Twindow * dst, Twindow * src,
+                              TwinCoordinate offset)
 {
-    if ((src->state & TwinRegiond) && src != dst)   /* catch tx->root */
+    if (twin_trace != NULL)
     {
-        for (int r = src->damage.min.row; r <= src->damage.max.row; ++r)
+        twin_trace_compose(1);
+    }
+    if (src->canvas != NULL && src != dst)
+    {
+        twin_compose_canvas(dst, src, offset);
+        twin_reset(src);
+    }
+    else if ((src->state & TwinRegiond) && src != dst) /* catch tx->root */
+    {
+        int mode = (src->mask != NULL) ? TwinTransparent
+            : (src->state & TwinTransparent);
+        int row = src->geometry.position.row + offset.row;
+        int column = src->geometry.position.column + offset.column;
+        TwinRegion region = src->damage;
+
+        if ((src->state & TwinScrolled) && src->scroll.n != 0 && !mode)
+        {                              /* pass the scroll on to dst */
+            TwinRegion region = src->scroll.region;
+            int row = src->geometry.position.row + offset.row;
+            int column = src->geometry.position.column + offset.column;
+
+            region.min.row += row;
+            region.max.row += row;
+            region.min.column += column;
+            region.max.column += column;
+            if (region.min.row >= 0 && region.min.column >= 0
+                && region.max.row < dst->geometry.size.row
+                && region.max.column < dst->geometry.size.column)
+            {                          /* (dst's cells move, as src's) */
+                twin_scroll_pending(dst, region, src->scroll.n);
+                twin_damage(dst, region);
+            }
+        }
+        region.min.row = (region.min.row < -row) ? -row : region.min.row;
+        region.min.column = (region.min.column < -column)
+            ? -column : region.min.column;
+        if (region.max.row >= dst->geometry.size.row - row)
+        {                              /* clip to dst */
+            region.max.row = dst->geometry.size.row - row - 1;
+        }
+        if (region.max.column >= dst->geometry.size.column - column)
+        {
+            region.max.column = dst->geometry.size.column - column - 1;
+        }
+        if (region.min.row <= region.max.row
+            && region.min.column <= region.max.column)
         {
-            for (int c = src->damage.min.column; c <= src->damage.max.column;
-                 ++c)
-            {                          /* overwrite damaged/changed cells */
-                twin_set_cell(dst,
-                              r + src->geometry.position.row + offset.row,
-                              c + src->geometry.position.column +
-                              offset.column,
-                              src->frame[twin_cell(src->geometry, r, c)]);
+            TwinUnder *under = mode ? twin_under(dst, src, row, column)
+                : NULL;
+            TwinRegion at = {
+                {region.min.row + row, region.min.column + column},
+                {region.max.row + row, region.max.column + column}
+            };
+
+            if (under != NULL)
+            {
+                twin_under_composed(dst, under);
             }
+            twin_compose_cells(dst, src, under, region, row, column, mode);
+            twin_composed_add(at);
         }
+        twin_reset(src);               /* damage has been consumed */
     }
     /* adjust offset for children... */
     offset.row += src->geometry.position.row;
@@ -309,11 +1758,122 @@ Twindow *twin_compose(Twindow * dst, Twindow * src, TwinCoordinate offset)
 
     for (Twindow * child = src->child; child != NULL; child = child->sibling)
     {                                  /* recursively compose children */
-        twin_compose(dst, child, offset);
+        twin_compose_tree(dst, child, offset);
+    }
+    if (twin_trace != NULL)
+    {
+        twin_trace_compose(0);
     }
+}
+
+
+Twindow *twin_compose(Twindow * dst, Twindow * src, TwinCoordinate offset)
+{
+    composing += 1;
+    n_pass_region = 0;
+    twin_compose_tree(dst, src, offset);
+    n_pass_region = 0;
+    composing -= 1;
     return dst;
 }
 
+/*
+ * twin_set_mask() --Set (or clear) a window's transparency mask.
+ *
+ * Parameters:
+ * twin     --the window
+ * mask     --a byte per cell (0: show what's underneath), or NULL
+ *
+ * Remarks:
+ * The mask belongs to the caller, and must outlive its use.  A masked
+ * window is composed like a TwinTransparent one: line graphics merge
+ * with those underneath, and it doesn't pass scrolls on to its parent.
+ * The whole window is damaged, so the next compose applies the mask.
+ */
+Twindow *twin_set_mask(Twindow * twin, uint8_t * mask)
+{
+    TwinRegion all = {
+        {0, 0}, {twin->geometry.size.row - 1, twin->geometry.size.column - 1}
+    };
+
+    twin->mask = mask;
+    return twin_damage(twin, all);
+}
+
+
+/*
+ * twin_mask_region() --Make a region of a masked window (non)transparent.
+ */
+Twindow *twin_mask_region(Twindow * twin, TwinRegion region, int opaque)
+{
+    if (twin->mask == NULL)
+    {
+        err("%s(): window has no mask", __func__);
+        return twin;
+    }
+    region.min.row = (region.min.row < 0) ? 0 : region.min.row;
+    region.min.column = (region.min.column < 0) ? 0 : region.min.column;
+    if (region.max.row >= twin->geometry.size.row)
+    {
+        region.max.row = twin->geometry.size.row - 1;
+    }
+    if (region.max.column >= twin->geometry.size.column)
+    {
+        region.max.column = twin->geometry.size.column - 1;
+    }
+    if (region.min.row > region.max.row
+        || region.min.column > region.max.column)
+    {
+        return twin;
+    }
+    for (int r = region.min.row; r <= region.max.row; ++r)
+    {
+        memset(&twin->mask[twin_cell(twin->geometry, r, region.min.column)],
+               opaque ? 0xff : 0,
+               (size_t) (region.max.column - region.min.column + 1));
+    }
+    return twin_damage(twin, region);
+}
+
+
+/*
+ * twin_set_refresh() --Hint how often a window's changes need to be seen.
+ *
+ * Parameters:
+ * twin     --the window (a descendant of the terminal's root)
+ * interval --the minimum time (ms) between flushes; 0: every sync
+ *
+ * Remarks:
+ * xterm_sync() holds a slow window's damage back until its next slot,
+ * so a busy but unimportant pane doesn't cost bytes every frame.  The
+ * hint covers the window's area of the screen, including its children.
+ */
+Twindow *twin_set_refresh(Twindow * twin, int interval)
+{
+    twin->refresh = (interval > 0) ? interval : 0;
+    twin->refresh_due = 0;             /* (the first change goes at once) */
+    return twin;
+}
+
+
+/*
+ * twin_set_priority() --Hint how urgently a window's changes are needed.
+ *
+ * Parameters:
+ * twin     --the window (a descendant of the terminal's root)
+ * priority --+ve: sent before other windows, higher first; -ve: after
+ *
+ * Remarks:
+ * When a frame is cut short by the terminal's byte budget (see
+ * xterm_sync()), the windows that were left go out in the next frame.
+ */
+Twindow *twin_set_priority(Twindow * twin, int priority)
+{
+    twin->priority = priority;
+    return twin;
+}
+
+
 Twindow *twin_add_child(Twindow * parent, Twindow * child)
 {
     if (parent->child == NULL)
@@ -334,8 +1894,49 @@ Twindow *twin_add_child(Twindow * parent, Twindow * child)
     return parent->child;              /* return first child */
 }
 
+/*
+ * twin_remove_child() --Unlink a window from its parent's children.
+ *
+ * Returns: (Twindow *)
+ * The parent's first child (as twin_add_child()), or NULL if none.
+ *
+ * Remarks:
+ * The parent is damaged where the child was, so that the next compose
+ * repaints what the child covered.
+ */
 Twindow *twin_remove_child(Twindow * parent, Twindow * child)
 {
-    err("%s(): not implemented", __func__);
-    return NULL;
+    TwinGeometry g = child->geometry;
+
+    for (Twindow ** link = &parent->child; *link != NULL;
+         link = &(*link)->sibling)
+    {
+        if (*link == child)
+        {
+            TwinRegion region = {
+                {g.position.row, g.position.column},
+                {g.position.row + g.size.row - 1,
+                 g.position.column + g.size.column - 1}
+            };
+
+            *link = child->sibling;
+            child->sibling = NULL;
+            child->parent = NULL;
+            region.min.row = (region.min.row < 0) ? 0 : region.min.row;
+            region.min.column = (region.min.column < 0) ? 0
+                : region.min.column;
+            region.max.row = (region.max.row < parent->geometry.size.row)
+                ? region.max.row : parent->geometry.size.row - 1;
+            region.max.column =
+                (region.max.column < parent->geometry.size.column)
+                ? region.max.column : parent->geometry.size.column - 1;
+            if (region.min.row <= region.max.row
+                && region.min.column <= region.max.column)
+            {
+                twin_damage(parent, region);
+            }
+            break;
+        }
+    }
+    return parent->child;
 }
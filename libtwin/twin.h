@@ -15,6 +15,18 @@ extern "C"
 #endif                                 /* C++ */
 
 #define TWIN_DEFAULT_COLOUR 9
+#define TWIN_RGB_FLAG 0x01000000
+#define TWIN_RGB(r, g, b) (TWIN_RGB_FLAG                          \
+                           | ((uint32_t) ((r) & 0xff) << 16)      \
+                           | ((uint32_t) ((g) & 0xff) << 8)       \
+                           | ((uint32_t) ((b) & 0xff)))
+#define TWIN_IS_RGB(colour) (((colour) & TWIN_RGB_FLAG) != 0)
+#define TWIN_RED(colour) (((colour) >> 16) & 0xff)
+#define TWIN_GREEN(colour) (((colour) >> 8) & 0xff)
+#define TWIN_BLUE(colour) ((colour) & 0xff)
+
+    typedef uint32_t TwinColour;       /* palette index, or TWIN_RGB() */
+
     typedef enum TwinCellAttribute_t
     {
         TwinNormal = 0x00,             /* a value, not a bit */
@@ -31,7 +43,11 @@ extern "C"
     typedef enum TwinState_t
     {
         TwinRegiond = 0x01,
-        TwinVisible = 0x02
+        TwinVisible = 0x02,
+        TwinStale = 0x04,              /* model changed, needs drawing */
+        TwinScrolled = 0x08,
+        TwinBatch = 0x10,              /* caller will damage changed cells */
+        TwinTransparent = 0x20         /* blank cells show what's underneath */
     } TwinState;
 
     typedef enum TwinEvent_t
@@ -47,11 +63,28 @@ extern "C"
 
     typedef struct TwinCell_t
     {                                  /* REVISIT: force alignment for int! */
-        uint8_t fg, bg;                /* colours */
+        TwinColour fg, bg;             /* colours */
         uint8_t attr;                  /* TwinCellAttribute */
         uint8_t ch;                    /* codepoint, or line-graphics bits */
+        uint16_t spare;                /* explicit padding, for memcmp() */
     } TwinCell;
 
+    /*
+     * TwinStyle: --An interned style (fg, bg, attr), as a small integer.
+     *
+     * Remarks:
+     * Frames are stored as two planes: a glyph plane (one byte per
+     * cell), and a plane of style ids, so comparing cells' styles is
+     * a single integer compare.  The table is shared by all windows
+     * (and terminals), so ids can be copied between them verbatim.
+     * Id 0 is always the default (blank) style.
+     */
+    typedef uint16_t TwinStyle;
+#define TWIN_STYLE_BLANK 0
+#define TWIN_STYLE_MAX 65536           /* styles in the table, at most */
+#define TWIN_FRAME_SIZE(rows, columns) \
+    ((size_t) (rows) * (size_t) (columns) * (sizeof(TwinStyle) + 1))
+
     typedef struct TwinCoordinate_t
     {
         int row, column;
@@ -68,6 +101,12 @@ extern "C"
     } TwinRegion;
 
 
+    typedef struct TwinScroll_t
+    {
+        TwinRegion region;             /* inclusive, like damage */
+        int n;                         /* rows: +ve: up, -ve: down */
+    } TwinScroll;
+
     struct Twindow_t;
     typedef int (*TwinProc)(struct Twindow_t * twin, TwinEvent event,
                             void *arg);
@@ -75,10 +114,23 @@ extern "C"
     {
         TwinGeometry geometry;
         TwinRegion damage;             /* if .state & TwinDamage */
+        TwinScroll scroll;             /* if .state & TwinScrolled */
         TwinCoordinate cursor;
         TwinCell style;
         int state;                     /* TwinState */
-        TwinCell *frame;               /* base: array of cells */
+        unsigned int generation;       /* bumped by any change to cells */
+        void *frame;                   /* base: TWIN_FRAME_SIZE() bytes */
+        TwinStyle *styles;             /* style plane, in frame */
+        uint8_t *glyphs;               /* glyph plane, in frame */
+        struct TwinCanvas_t *canvas;   /* sparse tiles, instead of frame */
+        int (*wake)(struct Twindow_t * twin);   /* refills a compacted frame */
+        uint8_t *mask;                 /* per cell, 0: shows through; or NULL */
+        struct TwinUnder_t *under;     /* if transparent: the cells beneath */
+        struct TwinUnder_t *overlays;  /* transparent windows composed on it */
+        int refresh;                   /* hint: ms between flushes (0: any) */
+        uint64_t refresh_due;          /* next flush slot (ms), if refresh */
+        unsigned int flushed;          /* generation, when last flushed */
+        int priority;                  /* hint: +ve: flushed first (0: any) */
         struct Twindow_t *parent;
         struct Twindow_t *child;
         struct Twindow_t *sibling;
@@ -89,32 +141,51 @@ extern "C"
         return row * geometry.size.column + column;
     }
 
+    uint64_t twin_clock(void);
     Twindow *twin_alloc(void);
     void free_twin(Twindow * twin);
+    void free_twin_under(Twindow * twin);
 
     Twindow *twin_init(Twindow * twin, Twindow * parent,
                        int row, int column, int height, int width,
-                       TwinCell * frame);
+                       void *frame);
 
 #define new_twin(parent, row, column, n_rows, n_columns, frame) \
     twin_init(twin_alloc(), parent, row, column, n_rows, n_columns, frame)
 #define init_twin(twin, parent, row, column, frame)                \
         twin_init(twin, parent, rows, columns, NEL(frame), NEL(frame[0]), frame)
 
+    TwinStyle twin_style_intern(TwinCell style);
+    TwinCell twin_style_cell(TwinStyle style);
+    TwinCell twin_get_cell(const Twindow * twin, int row, int col);
+
     void twin_reset(Twindow * twin);
     Twindow *twin_cursor(Twindow * twin, int row, int column);
     Twindow *twin_attr(Twindow * twin, TwinCell attr);
     int twin_set_cell(Twindow * twin, int row, int col, TwinCell cell);
+    int twin_set_glyph(Twindow * twin, int row, int col,
+                       TwinStyle style, uint8_t glyph);
+    Twindow *twin_damage(Twindow * twin, TwinRegion region);
     Twindow *twin_puts(Twindow * twin, const char *text);
+    Twindow *twin_putn(Twindow * twin, const char *text, size_t size);
     Twindow *twin_printf(Twindow * twin, const char *format,
                          ...) PRINTF_ATTRIBUTE(2, 3);
+    Twindow *twin_put_int(Twindow * twin, long value, int width);
+    Twindow *twin_put_fixed(Twindow * twin, long value, int places,
+                            int width);
+    Twindow *twin_put_si(Twindow * twin, long value, int width);
     Twindow *twin_clear(Twindow * twin);
     Twindow *twin_box(Twindow * tw, int row, int column,
                       int n_rows, int n_columns);
     Twindow *twin_hline(Twindow * twin, int row, int column, int size);
     Twindow *twin_vline(Twindow * twin, int row, int column, int size);
+    Twindow *twin_scroll(Twindow * twin, TwinRegion region, int n);
     Twindow *twin_compose(Twindow * dst, Twindow * src,
                           TwinCoordinate offset);
+    Twindow *twin_set_mask(Twindow * twin, uint8_t * mask);
+    Twindow *twin_mask_region(Twindow * twin, TwinRegion region, int opaque);
+    Twindow *twin_set_refresh(Twindow * twin, int interval);
+    Twindow *twin_set_priority(Twindow * twin, int priority);
     Twindow *twin_add_child(Twindow * parent, Twindow * child);
     Twindow *twin_remove_child(Twindow * parent, Twindow * child);
 #ifdef __cplusplus
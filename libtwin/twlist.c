@@ -0,0 +1,283 @@
+/*
+ * TWLIST.C --Recorded display lists of drawing calls.
+ *
+ * Contents:
+ * init_twin_list()      --Initialise an empty display list.
+ * free_twin_list()      --Release a display list's buffers.
+ * twin_list_reset()     --Empty a display list, ready to record.
+ * twin_list_style()     --Record the style for subsequent calls.
+ * twin_list_puts()      --Record a twin_puts() at a position.
+ * twin_list_box()       --Record a twin_box().
+ * twin_list_hline()     --Record a twin_hline().
+ * twin_list_vline()     --Record a twin_vline().
+ * twin_list_invalidate() --Force the next run to execute.
+ * twin_list_run()       --Execute a display list, unless it's unchanged.
+ *
+ * Remarks:
+ * The hash (FNV-1a) is accumulated as calls are recorded, so an app
+ * can re-record its chrome every frame, and still skip the drawing.
+ *
+ * When a list does run, the window is put in TwinBatch mode, so the
+ * individual cell writes don't maintain the damage region; instead,
+ * if anything changed, the list's bounds are damaged once at the end.
+ */
+#include <apex.h>
+#include <apex/log.h>
+#include "twlist.h"
+#include "twutf8.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ull
+#define FNV_PRIME 0x100000001b3ull
+
+static uint64_t list_hash(uint64_t hash, const void *data, size_t size)
+{
+    const uint8_t *byte = data;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ byte[i]) * FNV_PRIME;
+    }
+    return hash;
+}
+
+
+TwinList *init_twin_list(TwinList * list)
+{
+    memset(list, 0, sizeof(*list));
+    twin_list_reset(list);
+    return list;
+}
+
+
+void free_twin_list(TwinList * list)
+{
+    free(list->op);
+    free(list->text);
+    memset(list, 0, sizeof(*list));
+}
+
+
+/*
+ * twin_list_reset() --Empty a display list, ready to record.
+ *
+ * Remarks:
+ * The last run's hash is kept, so that recording the same calls
+ * again allows the next run to be skipped.
+ */
+void twin_list_reset(TwinList * list)
+{
+    static const TwinCell blank = {
+        TWIN_DEFAULT_COLOUR, TWIN_DEFAULT_COLOUR, TwinNormal, ' ', 0
+    };
+
+    list->n_op = 0;
+    list->n_text = 0;
+    list->style = blank;
+    list->bounds.min.row = list->bounds.min.column = INT32_MAX;
+    list->bounds.max.row = list->bounds.max.column = INT32_MIN;
+    list->hash = FNV_OFFSET;
+}
+
+
+void twin_list_style(TwinList * list, TwinCell style)
+{
+    list->style = style;
+}
+
+
+/*
+ * list_add() --Append an op, and extend the hash and bounds.
+ */
+static TwinListOp *list_add(TwinList * list, TwinListOpType type,
+                            int row, int column, int n_rows, int n_columns)
+{
+    TwinListOp *op;
+
+    if (list->n_op == list->op_alloc)
+    {
+        int n_alloc = (list->op_alloc > 0) ? 2 * list->op_alloc : 16;
+
+        if ((op = realloc(list->op, (size_t) n_alloc * sizeof(*op))) == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            return NULL;
+        }
+        list->op = op;
+        list->op_alloc = n_alloc;
+    }
+    op = &list->op[list->n_op++];
+    memset(op, 0, sizeof(*op));        /* (hash includes padding) */
+    op->type = type;
+    op->row = row;
+    op->column = column;
+    op->n_rows = n_rows;
+    op->n_columns = n_columns;
+    op->style = list->style;
+    list->hash = list_hash(list->hash, op, sizeof(*op));
+
+    if (row < list->bounds.min.row)
+    {
+        list->bounds.min.row = row;
+    }
+    if (column < list->bounds.min.column)
+    {
+        list->bounds.min.column = column;
+    }
+    if (row + n_rows - 1 > list->bounds.max.row)
+    {
+        list->bounds.max.row = row + n_rows - 1;
+    }
+    if (column + n_columns - 1 > list->bounds.max.column)
+    {
+        list->bounds.max.column = column + n_columns - 1;
+    }
+    return op;
+}
+
+
+void twin_list_puts(TwinList * list, int row, int column, const char *text)
+{
+    size_t len = strlen(text);
+    TwinListOp *op;
+
+    if (list->n_text + len + 1 > list->text_alloc)
+    {
+        size_t n_alloc = 2 * (list->n_text + len + 1);
+        char *arena = realloc(list->text, n_alloc);
+
+        if (arena == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            return;
+        }
+        list->text = arena;
+        list->text_alloc = n_alloc;
+    }
+    if ((op = list_add(list, TwinListPuts, row, column, 1,
+                       twin_utf8_width(text, len))) != NULL)
+    {
+        op->text = list->n_text;
+        memcpy(list->text + list->n_text, text, len + 1);
+        list->n_text += len + 1;
+        list->hash = list_hash(list->hash, text, len);
+    }
+}
+
+
+void twin_list_box(TwinList * list, int row, int column,
+                   int n_rows, int n_columns)
+{
+    list_add(list, TwinListBox, row, column, n_rows, n_columns);
+}
+
+
+/*
+ * twin_list_hline() --Record a twin_hline().
+ *
+ * Remarks:
+ * Like twin_hline(), a -ve size draws leftwards from column.
+ */
+void twin_list_hline(TwinList * list, int row, int column, int size)
+{
+    TwinListOp *op = list_add(list, TwinListHline, row,
+                              (size < 0) ? column + size + 1 : column,
+                              1, abs(size));
+
+    if (op != NULL)
+    {
+        op->column = column;
+        op->n_columns = size;          /* as called; bounds are done */
+    }
+}
+
+
+void twin_list_vline(TwinList * list, int row, int column, int size)
+{
+    TwinListOp *op = list_add(list, TwinListVline,
+                              (size < 0) ? row + size + 1 : row, column,
+                              abs(size), 1);
+
+    if (op != NULL)
+    {
+        op->row = row;
+        op->n_rows = size;
+    }
+}
+
+
+/*
+ * twin_list_invalidate() --Force the next run to execute.
+ */
+void twin_list_invalidate(TwinList * list)
+{
+    list->run_twin = NULL;
+}
+
+
+/*
+ * twin_list_run() --Execute a display list, unless it's unchanged.
+ *
+ * Returns: (int)
+ * 1 if the list was executed, 0 if it was skipped.
+ */
+int twin_list_run(TwinList * list, Twindow * twin)
+{
+    TwinCell style = twin->style;
+    TwinCoordinate cursor = twin->cursor;
+    int regiond = twin->state & TwinRegiond;
+
+    if (list->run_twin == twin && list->run_hash == list->hash
+        && list->run_generation == twin->generation)
+    {
+        return 0;                      /* unchanged: skip it all */
+    }
+
+    twin->state = (twin->state & ~TwinRegiond) | TwinBatch;
+    for (int i = 0; i < list->n_op; ++i)
+    {
+        TwinListOp *op = &list->op[i];
+
+        twin->style = op->style;
+        switch (op->type)
+        {
+        case TwinListPuts:
+            twin_cursor(twin, op->row, op->column);
+            twin_puts(twin, list->text + op->text);
+            break;
+        case TwinListBox:
+            twin_box(twin, op->row, op->column, op->n_rows, op->n_columns);
+            break;
+        case TwinListHline:
+            twin_hline(twin, op->row, op->column, op->n_columns);
+            break;
+        case TwinListVline:
+            twin_vline(twin, op->row, op->column, op->n_rows);
+            break;
+        }
+    }
+    twin->state &= ~TwinBatch;
+    twin->style = style;
+    twin->cursor = cursor;
+
+    if (twin->state & TwinRegiond)
+    {                                  /* something changed: damage once */
+        TwinRegion bounds = list->bounds;
+
+        bounds.min.row = (bounds.min.row < 0) ? 0 : bounds.min.row;
+        bounds.min.column = (bounds.min.column < 0) ? 0 : bounds.min.column;
+        if (bounds.max.row >= twin->geometry.size.row)
+        {
+            bounds.max.row = twin->geometry.size.row - 1;
+        }
+        if (bounds.max.column >= twin->geometry.size.column)
+        {
+            bounds.max.column = twin->geometry.size.column - 1;
+        }
+        twin_damage(twin, bounds);
+    }
+    twin->state |= regiond;
+    list->run_twin = twin;
+    list->run_hash = list->hash;
+    list->run_generation = twin->generation;
+    return 1;
+}
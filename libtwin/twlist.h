@@ -0,0 +1,69 @@
+/*
+ * TWLIST.H --Recorded display lists of drawing calls.
+ *
+ * Remarks:
+ * A display list records drawing calls (boxes, lines, text) for
+ * replay on a window.  The recorded calls are hashed, and replay is
+ * skipped if the hash is unchanged since the list was last run on the
+ * same window, and nothing else has changed the window's cells since
+ * (see Twindow.generation).  So static chrome, in a window of its
+ * own, can be "redrawn" every frame for free.
+ */
+#ifndef TWLIST_H
+#define TWLIST_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <twin.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+    typedef enum TwinListOpType_t
+    {
+        TwinListPuts,
+        TwinListBox,
+        TwinListHline,
+        TwinListVline
+    } TwinListOpType;
+
+    typedef struct TwinListOp_t
+    {
+        TwinListOpType type;
+        int row, column;
+        int n_rows, n_columns;         /* box size, or line size */
+        size_t text;                   /* offset of TwinListPuts text */
+        TwinCell style;
+    } TwinListOp;
+
+    typedef struct TwinList_t
+    {
+        TwinListOp *op;
+        int n_op, op_alloc;
+        char *text;                    /* arena for TwinListPuts text */
+        size_t n_text, text_alloc;
+        TwinCell style;                /* style for subsequent ops */
+        TwinRegion bounds;             /* cells the ops might touch */
+        uint64_t hash;                 /* of the recorded ops */
+        uint64_t run_hash;             /* ...when last run */
+        Twindow *run_twin;             /* ...on this window */
+        unsigned int run_generation;   /* ...at this generation */
+    } TwinList;
+
+    TwinList *init_twin_list(TwinList * list);
+    void free_twin_list(TwinList * list);
+    void twin_list_reset(TwinList * list);
+    void twin_list_style(TwinList * list, TwinCell style);
+    void twin_list_puts(TwinList * list, int row, int column,
+                        const char *text);
+    void twin_list_box(TwinList * list, int row, int column,
+                       int n_rows, int n_columns);
+    void twin_list_hline(TwinList * list, int row, int column, int size);
+    void twin_list_vline(TwinList * list, int row, int column, int size);
+    void twin_list_invalidate(TwinList * list);
+    int twin_list_run(TwinList * list, Twindow * twin);
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWLIST_H */
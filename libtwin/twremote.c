@@ -0,0 +1,1279 @@
+/*
+ * TWREMOTE.C --Binary frame deltas, for rendering on a remote terminal.
+ *
+ * Contents:
+ * init_twin_server()    --Initialise a server for a root window.
+ * free_twin_server()    --Close a server's sockets, release its buffers.
+ * twin_server_listen()  --Listen on a Unix or TCP socket address.
+ * twin_server_accept()  --Accept new clients, and send them the screen.
+ * twin_server_sync()    --Send the root's changes to all clients.
+ * twin_server_flush()   --Send slow clients their backlog, or the screen.
+ * init_twin_client()    --Initialise a client for an Xterminator.
+ * free_twin_client()    --Close a client's socket, release its buffers.
+ * twin_client_connect() --Connect to a server's socket address.
+ * twin_client_read()    --Read and apply any frames the server has sent.
+ * twin_lz_compress()    --Compress a block, in LZ4 block format.
+ * twin_lz_decompress()  --Decompress an LZ4 block.
+ *
+ * Remarks:
+ * The server keeps a shadow of what its clients have, and diffs the
+ * root's damage against it, much as xterm_sync() does; changed cells
+ * are sent as runs of one style, and a run absorbs short gaps of
+ * unchanged cells, which are cheaper to resend than a new run header.
+ *
+ * Styles are sent once, as numbered entries of a table that's shared
+ * by all the clients; when it fills, it's reset and rebuilt.
+ *
+ * An address containing a '/' is a Unix socket path, anything else
+ * is "host:port" for TCP (host may be empty, for any address).
+ */
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <apex.h>
+#include <apex/log.h>
+#include "twremote.h"
+
+#define REMOTE_GAP 4                   /* unchanged cells a run may absorb */
+#define REMOTE_OP_MAX 32               /* bytes in an op, excluding text */
+#define REMOTE_SIZE_MAX 0xffff         /* rows or columns, at most */
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5             /* LZ4: the block must end in these */
+#define LZ_MATCH_LIMIT 12              /* LZ4: no match starts after this */
+
+static const TwinCell blank = {
+    TWIN_DEFAULT_COLOUR, TWIN_DEFAULT_COLOUR, TwinNormal, ' ', 0
+};
+
+
+/*
+ * buffer_reserve() --Make room for n more bytes in a buffer.
+ */
+static int buffer_reserve(TwinBuffer * buffer, size_t n)
+{
+    if (buffer->n + n > buffer->alloc)
+    {
+        size_t n_alloc = 2 * (buffer->n + n);
+        uint8_t *data = realloc(buffer->data, n_alloc);
+
+        if (data == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            return 0;
+        }
+        buffer->data = data;
+        buffer->alloc = n_alloc;
+    }
+    return 1;
+}
+
+
+static inline void put_byte(TwinBuffer * buffer, uint8_t byte)
+{
+    buffer->data[buffer->n++] = byte;
+}
+
+
+static inline void put_varint(TwinBuffer * buffer, uint32_t value)
+{
+    while (value >= 0x80)
+    {
+        buffer->data[buffer->n++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    buffer->data[buffer->n++] = (uint8_t) value;
+}
+
+
+static inline void put_u32(uint8_t * data, uint32_t value)
+{
+    data[0] = (uint8_t) value;
+    data[1] = (uint8_t) (value >> 8);
+    data[2] = (uint8_t) (value >> 16);
+    data[3] = (uint8_t) (value >> 24);
+}
+
+
+static inline uint32_t get_u32(const uint8_t * data)
+{
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8
+        | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+
+static inline int same_style(TwinCell a, TwinCell b)
+{
+    return a.fg == b.fg && a.bg == b.bg && a.attr == b.attr;
+}
+
+
+/*
+ * remote_socket() --Create a socket, and bind or connect it to an address.
+ *
+ * Returns: (int)
+ * Success: the socket; Failure: -1.
+ */
+static int remote_socket(const char *address, int listening)
+{
+    int fd = -1;
+
+    if (strchr(address, '/') != NULL)
+    {                                  /* Unix socket */
+        struct sockaddr_un sun = {.sun_family = AF_UNIX };
+
+        if (strlen(address) >= sizeof(sun.sun_path))
+        {
+            err("%s(): path too long: \"%s\"", __func__, address);
+            return -1;
+        }
+        strcpy(sun.sun_path, address);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+        {
+            log_sys(LOG_ERR, "cannot create socket");
+            return -1;
+        }
+        if (listening)
+        {
+            unlink(address);           /* stale, from a previous server */
+        }
+        if ((listening
+             ? bind(fd, (struct sockaddr *) &sun, sizeof(sun))
+             : connect(fd, (struct sockaddr *) &sun, sizeof(sun))) < 0)
+        {
+            log_sys(LOG_ERR, "cannot %s \"%s\"",
+                    listening ? "bind" : "connect to", address);
+            close(fd);
+            return -1;
+        }
+    }
+    else
+    {                                  /* TCP: host:port */
+        const char *colon = strrchr(address, ':');
+        struct addrinfo hints = {.ai_family = AF_UNSPEC,
+            .ai_socktype = SOCK_STREAM,
+            .ai_flags = listening ? AI_PASSIVE : 0
+        };
+        struct addrinfo *info, *ai;
+        int one = 1;
+
+        if (colon == NULL)
+        {
+            err("%s(): expected \"host:port\": \"%s\"", __func__, address);
+            return -1;
+        }
+        char host[colon - address + 1];
+
+        memcpy(host, address, (size_t) (colon - address));
+        host[colon - address] = '\0';
+        if (getaddrinfo((host[0] != '\0') ? host : NULL, colon + 1,
+                        &hints, &info) != 0)
+        {
+            err("%s(): cannot resolve \"%s\"", __func__, address);
+            return -1;
+        }
+        for (ai = info; ai != NULL; ai = ai->ai_next)
+        {
+            if ((fd = socket(ai->ai_family, ai->ai_socktype,
+                             ai->ai_protocol)) < 0)
+            {
+                continue;
+            }
+            if (listening)
+            {
+                setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+                if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+                {
+                    break;
+                }
+            }
+            else if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            {
+                setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+                break;
+            }
+            close(fd);
+            fd = -1;
+        }
+        freeaddrinfo(info);
+        if (fd < 0)
+        {
+            log_sys(LOG_ERR, "cannot %s \"%s\"",
+                    listening ? "bind" : "connect to", address);
+            return -1;
+        }
+    }
+    if (listening && listen(fd, TWIN_REMOTE_CLIENTS) < 0)
+    {
+        log_sys(LOG_ERR, "cannot listen on \"%s\"", address);
+        close(fd);
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+
+/*
+ * init_twin_server() --Initialise a server for a root window.
+ *
+ * Parameters:
+ * server --the server to initialise
+ * root   --the window to serve (usually an Xterminator-less root)
+ *
+ * Returns: (TwinServer *)
+ * Success: the server; Failure: NULL.
+ */
+TwinServer *init_twin_server(TwinServer * server, Twindow * root)
+{
+    int rows = root->geometry.size.row;
+    int columns = root->geometry.size.column;
+    void *frame;
+
+    memset(server, 0, sizeof(*server));
+    server->fd = -1;
+    for (int i = 0; i < TWIN_REMOTE_CLIENTS; ++i)
+    {
+        server->client[i] = -1;
+    }
+    if ((frame = malloc(TWIN_FRAME_SIZE(rows, columns))) == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return NULL;
+    }
+    server->root = root;
+    twin_init(&server->shadow, NULL, 0, 0, rows, columns, frame);
+    return server;
+}
+
+
+void free_twin_server(TwinServer * server)
+{
+    for (int i = 0; i < TWIN_REMOTE_CLIENTS; ++i)
+    {
+        if (server->client[i] >= 0)
+        {
+            close(server->client[i]);
+        }
+        free(server->backlog[i].data);
+    }
+    if (server->fd >= 0)
+    {
+        close(server->fd);
+    }
+    free(server->shadow.frame);
+    free(server->plain.data);
+    free(server->wire.data);
+    memset(server, 0, sizeof(*server));
+    server->fd = -1;
+}
+
+
+/*
+ * twin_server_listen() --Listen on a Unix or TCP socket address.
+ *
+ * Returns: (int)
+ * Success: the listening socket (non-blocking), to poll for
+ * clients; Failure: -1.
+ */
+int twin_server_listen(TwinServer * server, const char *address)
+{
+    return server->fd = remote_socket(address, 1);
+}
+
+
+/*
+ * server_style() --Get a style's id, defining it if it's new.
+ *
+ * Parameters:
+ * server --the server
+ * buffer --gets the 'X' and 'T' ops, for any change to the table
+ * cell   --the style
+ *
+ * Returns: (int)
+ * The style's id.
+ */
+static int server_style(TwinServer * server, TwinBuffer * buffer,
+                        TwinCell cell)
+{
+    const unsigned int mask = NEL(server->style_slot) - 1;
+    unsigned int hash = (cell.fg * 31u + cell.bg) * 31u + cell.attr;
+    unsigned int slot;
+    int id;
+
+    hash = (hash * 2654435761u) >> 16;
+    for (slot = hash & mask; server->style_slot[slot] != 0;
+         slot = (slot + 1) & mask)
+    {
+        id = server->style_slot[slot] - 1;
+        if (same_style(server->style[id], cell))
+        {
+            return id;
+        }
+    }
+    if (server->n_style == TWIN_REMOTE_STYLES)
+    {                                  /* full: start again */
+        memset(server->style_slot, 0, sizeof(server->style_slot));
+        server->n_style = 0;
+        put_byte(buffer, 'X');
+        slot = hash & mask;
+    }
+    id = server->n_style++;
+    server->style[id] = cell;
+    server->style_slot[slot] = (uint16_t) (id + 1);
+    put_byte(buffer, 'T');
+    put_varint(buffer, (uint32_t) id);
+    put_varint(buffer, cell.fg);
+    put_varint(buffer, cell.bg);
+    put_varint(buffer, cell.attr);
+    return id;
+}
+
+
+/*
+ * put_glyph() --Put the 'U' op that defines an interned glyph.
+ *
+ * Parameters:
+ * buffer --the buffer
+ * i      --the glyph's index in the table (from TWIN_GLYPH_EXT)
+ */
+static int put_glyph(TwinBuffer * buffer, int i)
+{
+    uint8_t glyph = (uint8_t) (TWIN_GLYPH_EXT + i);
+    int width = 1;
+    uint32_t cp = twin_utf8_codepoint(glyph, &width);
+
+    if (!buffer_reserve(buffer, REMOTE_OP_MAX))
+    {
+        return 0;
+    }
+    put_byte(buffer, 'U');
+    put_varint(buffer, glyph);
+    put_varint(buffer, cp);
+    put_varint(buffer, (uint32_t) width);
+    return 1;
+}
+
+
+/*
+ * server_glyphs() --Define any interned glyphs that are new to clients.
+ *
+ * Parameters:
+ * server --the server
+ * glyph  --the glyphs about to be sent
+ * n      --the number of them
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (out of memory).
+ */
+static int server_glyphs(TwinServer * server, const uint8_t * glyph, int n)
+{
+    for (int i = 0; i < n; ++i)
+    {
+        if (glyph[i] < TWIN_GLYPH_EXT
+            || glyph[i] - TWIN_GLYPH_EXT < server->n_glyph)
+        {
+            continue;
+        }
+        for (; server->n_glyph <= glyph[i] - TWIN_GLYPH_EXT;
+             ++server->n_glyph)
+        {
+            if (!put_glyph(&server->plain, server->n_glyph))
+            {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * server_encode_row() --Encode a row's changed cells as runs.
+ *
+ * Parameters:
+ * server   --the server
+ * source   --the window whose cells are sent
+ * row      --the row to encode
+ * from, to --the range of columns (inclusive)
+ * all      --if set, send every cell, not just the changed ones
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (out of memory).
+ *
+ * Remarks:
+ * The shadow is updated to match the cells sent.
+ */
+static int server_encode_row(TwinServer * server, Twindow * source, int row,
+                             int from, int to, int all)
+{
+    TwinBuffer *plain = &server->plain;
+    int offset = twin_cell(source->geometry, row, 0);
+    const uint8_t *glyph = &source->glyphs[offset];
+    const TwinStyle *style = &source->styles[offset];
+    uint8_t *shadow_glyph = &server->shadow.glyphs[offset];
+    TwinStyle *shadow_style = &server->shadow.styles[offset];
+
+#define CHANGED(c) (all || glyph[c] != shadow_glyph[c] \
+                    || style[c] != shadow_style[c])
+    for (int c = from; c <= to;)
+    {
+        int end, fill = 1, id;
+
+        if (!CHANGED(c))
+        {
+            ++c;
+            continue;
+        }
+        for (end = c; end < to;)
+        {                              /* extend, over short gaps */
+            int k = end + 1;
+
+            while (k <= to && k - end <= REMOTE_GAP && !CHANGED(k)
+                   && style[k] == style[c])
+            {
+                ++k;
+            }
+            if (k > to || k - end > REMOTE_GAP || !CHANGED(k)
+                || style[k] != style[c])
+            {
+                break;
+            }
+            end = k;
+        }
+        for (int k = c + 1; k <= end && fill; ++k)
+        {
+            fill = (glyph[k] == glyph[c]);
+        }
+        fill = fill && end - c + 1 >= LZ_MIN_MATCH;
+
+        if (!server_glyphs(server, &glyph[c], end - c + 1)
+            || !buffer_reserve(plain, 2 * REMOTE_OP_MAX
+                               + (size_t) (end - c + 1)))
+        {
+            return 0;
+        }
+        id = server_style(server, plain, twin_style_cell(style[c]));
+        put_byte(plain, fill ? 'F' : 'R');
+        put_varint(plain, (uint32_t) row);
+        put_varint(plain, (uint32_t) c);
+        put_varint(plain, (uint32_t) (end - c + 1));
+        put_varint(plain, (uint32_t) id);
+        for (int k = c; k <= (fill ? c : end); ++k)
+        {
+            put_byte(plain, glyph[k]);
+        }
+        if (source != &server->shadow)
+        {
+            memcpy(&shadow_glyph[c], &glyph[c], (size_t) (end - c + 1));
+            memcpy(&shadow_style[c], &style[c],
+                   (size_t) (end - c + 1) * sizeof(TwinStyle));
+        }
+        c = end + 1;
+    }
+#undef CHANGED
+    return 1;
+}
+
+
+/*
+ * send_some() --Write as much of a buffer to a socket as it will take.
+ *
+ * Returns: (long)
+ * Success: the number of bytes written (0 if it's full);
+ * Failure: -1 (the client has gone).
+ */
+static long send_some(int fd, const uint8_t * data, size_t n)
+{
+    size_t total = 0;
+
+    while (total < n)
+    {
+        ssize_t sent = send(fd, data + total, n - total, MSG_NOSIGNAL);
+
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                break;                 /* slow client: don't wait */
+            }
+            return -1;
+        }
+        total += (size_t) sent;
+    }
+    return (long) total;
+}
+
+
+/*
+ * server_drop() --Close a client's socket, and free its slot.
+ */
+static void server_drop(TwinServer * server, int slot)
+{
+    debug("%s(): dropping client %d", __func__, server->client[slot]);
+    close(server->client[slot]);
+    server->client[slot] = -1;
+    server->backlog[slot].n = 0;
+    server->stale[slot] = 0;
+}
+
+
+/*
+ * server_send_client() --Send the wire buffer to a client.
+ *
+ * Remarks:
+ * A client that's still writing an earlier frame can't be sent this
+ * one; it's marked stale, to be sent the whole screen later.  What a
+ * full socket doesn't take is kept in the client's backlog.
+ */
+static void server_send_client(TwinServer * server, int slot)
+{
+    TwinBuffer *wire = &server->wire;
+    TwinBuffer *backlog = &server->backlog[slot];
+    long sent;
+
+    if (backlog->n > 0)
+    {
+        server->stale[slot] = 1;
+        return;
+    }
+    if ((sent = send_some(server->client[slot], wire->data, wire->n)) < 0)
+    {
+        server_drop(server, slot);
+        return;
+    }
+    if ((size_t) sent < wire->n)
+    {
+        if (!buffer_reserve(backlog, wire->n - (size_t) sent))
+        {                              /* half a frame is no use */
+            server_drop(server, slot);
+            return;
+        }
+        memcpy(backlog->data, wire->data + sent, wire->n - (size_t) sent);
+        backlog->n = wire->n - (size_t) sent;
+    }
+}
+
+
+/*
+ * server_send() --Frame the plain buffer, and send it.
+ *
+ * Parameters:
+ * server --the server
+ * slot   --the client to send to, or -1 for all (but stale) ones
+ *
+ * Returns: (size_t)
+ * The frame's size on the wire.
+ */
+static size_t server_send(TwinServer * server, int slot)
+{
+    TwinBuffer *plain = &server->plain;
+    TwinBuffer *wire = &server->wire;
+    size_t n = 0;
+
+    wire->n = 0;
+    if (!buffer_reserve(wire, TWIN_REMOTE_HEADER + plain->n + plain->n / 255
+                        + 16))
+    {
+        return 0;
+    }
+    if (server->compress)
+    {
+        n = twin_lz_compress(plain->data, plain->n,
+                             wire->data + TWIN_REMOTE_HEADER,
+                             wire->alloc - TWIN_REMOTE_HEADER,
+                             server->lz_table);
+    }
+    if (n > 0 && n < plain->n)
+    {
+        wire->data[0] = 'Z';
+    }
+    else
+    {
+        wire->data[0] = 'F';
+        n = plain->n;
+        memcpy(wire->data + TWIN_REMOTE_HEADER, plain->data, n);
+    }
+    put_u32(wire->data + 1, (uint32_t) plain->n);
+    put_u32(wire->data + 5, (uint32_t) n);
+    wire->n = TWIN_REMOTE_HEADER + n;
+
+    for (int i = 0; i < TWIN_REMOTE_CLIENTS; ++i)
+    {
+        if (server->client[i] < 0 || (slot >= 0 && i != slot)
+            || (slot < 0 && server->stale[i]))
+        {
+            continue;
+        }
+        server_send_client(server, i);
+    }
+    server->bytes += wire->n;
+    return wire->n;
+}
+
+
+/*
+ * server_snapshot() --Send a client the whole screen.
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (out of memory).
+ *
+ * Remarks:
+ * Any styles on the screen that aren't in the table are defined for
+ * the other clients first, so the table stays the same for all.
+ */
+static int server_snapshot(TwinServer * server, int slot)
+{
+    Twindow *shadow = &server->shadow;
+
+    server->stale[slot] = 1;           /* not sent the styles' ops */
+    server->plain.n = 0;
+    for (int i = 0; i < shadow->geometry.size.row
+         * shadow->geometry.size.column; ++i)
+    {
+        if (!buffer_reserve(&server->plain, REMOTE_OP_MAX))
+        {
+            return 0;
+        }
+        server_style(server, &server->plain,
+                     twin_style_cell(shadow->styles[i]));
+    }
+    if (server->plain.n > 0)
+    {
+        server_send(server, -1);
+    }
+
+    server->plain.n = 0;               /* the screen, for this client */
+    if (!buffer_reserve(&server->plain, REMOTE_OP_MAX
+                        + (size_t) server->n_style * REMOTE_OP_MAX))
+    {
+        return 0;
+    }
+    put_byte(&server->plain, 'S');
+    put_varint(&server->plain, (uint32_t) shadow->geometry.size.row);
+    put_varint(&server->plain, (uint32_t) shadow->geometry.size.column);
+    put_byte(&server->plain, 'X');
+    for (int id = 0; id < server->n_style; ++id)
+    {
+        put_byte(&server->plain, 'T');
+        put_varint(&server->plain, (uint32_t) id);
+        put_varint(&server->plain, server->style[id].fg);
+        put_varint(&server->plain, server->style[id].bg);
+        put_varint(&server->plain, server->style[id].attr);
+    }
+    for (int i = 0; i < server->n_glyph; ++i)
+    {
+        if (!put_glyph(&server->plain, i))
+        {
+            return 0;
+        }
+    }
+    for (int r = 0; r < shadow->geometry.size.row; ++r)
+    {
+        server_encode_row(server, shadow, r,
+                          0, shadow->geometry.size.column - 1, 1);
+    }
+    server->stale[slot] = 0;
+    server_send(server, slot);
+    return 1;
+}
+
+
+/*
+ * twin_server_accept() --Accept new clients, and send them the screen.
+ *
+ * Returns: (int)
+ * The number of clients accepted.
+ */
+int twin_server_accept(TwinServer * server)
+{
+    int n_accept = 0;
+    int fd, slot;
+
+    while ((fd = accept(server->fd, NULL, NULL)) >= 0)
+    {
+        for (slot = 0; slot < TWIN_REMOTE_CLIENTS; ++slot)
+        {
+            if (server->client[slot] < 0)
+            {
+                break;
+            }
+        }
+        if (slot == TWIN_REMOTE_CLIENTS)
+        {
+            err("%s(): too many clients", __func__);
+            close(fd);
+            continue;
+        }
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        server->client[slot] = fd;
+        if (!server_snapshot(server, slot))
+        {
+            server_drop(server, slot);
+            return n_accept;
+        }
+        ++n_accept;
+    }
+    return n_accept;
+}
+
+
+/*
+ * twin_server_flush() --Send slow clients their backlog, or the screen.
+ *
+ * Returns: (int)
+ * The number of clients that still have a backlog, i.e. to poll
+ * for POLLOUT.
+ *
+ * Remarks:
+ * A stale client is sent the whole screen once its backlog is
+ * written; if that's too big for its socket, it's backlogged too.
+ */
+int twin_server_flush(TwinServer * server)
+{
+    int n_backlog = 0;
+
+    for (int i = 0; i < TWIN_REMOTE_CLIENTS; ++i)
+    {
+        TwinBuffer *backlog = &server->backlog[i];
+
+        if (server->client[i] < 0)
+        {
+            continue;
+        }
+        if (backlog->n > 0)
+        {
+            long sent = send_some(server->client[i], backlog->data,
+                                  backlog->n);
+
+            if (sent < 0)
+            {
+                server_drop(server, i);
+                continue;
+            }
+            backlog->n -= (size_t) sent;
+            memmove(backlog->data, backlog->data + sent, backlog->n);
+        }
+        if (backlog->n == 0 && server->stale[i])
+        {
+            server_snapshot(server, i);    /* out of memory: try again */
+        }
+        n_backlog += (server->client[i] >= 0 && backlog->n > 0);
+    }
+    return n_backlog;
+}
+
+
+/*
+ * twin_server_sync() --Send the root's changes to all clients.
+ *
+ * Returns: (int)
+ * The frame's size on the wire, or 0 if nothing changed.
+ *
+ * Remarks:
+ * Like xterm_sync(), this resets the root's damage.  Clients that
+ * are still writing an earlier frame don't get this one, and are
+ * sent the whole screen by a later twin_server_flush().
+ */
+int twin_server_sync(TwinServer * server)
+{
+    Twindow *root = server->root;
+    TwinBuffer *plain = &server->plain;
+    TwinRegion damage = root->damage;
+    int width = server->shadow.geometry.size.column;
+    int height = server->shadow.geometry.size.row;
+
+    twin_server_flush(server);
+    if (!(root->state & TwinRegiond))
+    {
+        return 0;                      /* nothing is damaged */
+    }
+    plain->n = 0;
+    if ((root->state & TwinScrolled) && root->scroll.n != 0
+        && buffer_reserve(plain, REMOTE_OP_MAX))
+    {
+        TwinRegion region = root->scroll.region;
+        int n = root->scroll.n;
+
+        put_byte(plain, 'V');
+        put_varint(plain, (uint32_t) region.min.row);
+        put_varint(plain, (uint32_t) region.min.column);
+        put_varint(plain, (uint32_t) region.max.row);
+        put_varint(plain, (uint32_t) region.max.column);
+        put_varint(plain, ((uint32_t) n << 1) ^ (uint32_t) (n >> 31));
+        server->shadow.style = blank;
+        twin_scroll(&server->shadow, region, n);
+    }
+    damage.min.row = (damage.min.row < 0) ? 0 : damage.min.row;
+    damage.min.column = (damage.min.column < 0) ? 0 : damage.min.column;
+    damage.max.row = (damage.max.row >= height) ? height - 1 : damage.max.row;
+    damage.max.column =
+        (damage.max.column >= width) ? width - 1 : damage.max.column;
+    for (int r = damage.min.row; r <= damage.max.row; ++r)
+    {
+        if (!server_encode_row(server, root, r,
+                               damage.min.column, damage.max.column, 0))
+        {
+            break;
+        }
+    }
+    twin_reset(root);
+    twin_reset(&server->shadow);
+    return (plain->n > 0) ? (int) server_send(server, -1) : 0;
+}
+
+
+/*
+ * init_twin_client() --Initialise a client for an Xterminator.
+ */
+TwinClient *init_twin_client(TwinClient * client, Xterminator * xterm)
+{
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+    client->xterm = xterm;
+    for (int id = 0; id < TWIN_REMOTE_STYLES; ++id)
+    {
+        client->style[id] = blank;
+    }
+    return client;
+}
+
+
+void free_twin_client(TwinClient * client)
+{
+    if (client->fd >= 0)
+    {
+        close(client->fd);
+    }
+    free(client->input.data);
+    free(client->plain.data);
+    memset(client, 0, sizeof(*client));
+    client->fd = -1;
+}
+
+
+/*
+ * twin_client_connect() --Connect to a server's socket address.
+ *
+ * Returns: (int)
+ * Success: the socket (non-blocking), to poll for frames;
+ * Failure: -1.
+ */
+int twin_client_connect(TwinClient * client, const char *address)
+{
+    return client->fd = remote_socket(address, 0);
+}
+
+
+typedef struct Reader_t
+{
+    const uint8_t *data, *end;
+    int ok;
+} Reader;
+
+
+static inline uint32_t get_varint(Reader * reader)
+{
+    uint32_t value = 0;
+
+    for (int shift = 0; shift < 35; shift += 7)
+    {
+        if (reader->data >= reader->end)
+        {
+            break;
+        }
+        uint8_t byte = *reader->data++;
+
+        value |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+        {
+            return value;
+        }
+    }
+    reader->ok = 0;
+    return 0;
+}
+
+
+/*
+ * client_apply() --Apply a frame's ops to the root window.
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (the frame is malformed).
+ *
+ * Remarks:
+ * Runs must fit in the screen size the server sent, so a bad count
+ * can't make us loop over billions of cells.
+ */
+static int client_apply(TwinClient * client, const uint8_t * data, size_t n)
+{
+    Twindow *root = &client->xterm->root;
+    Reader reader = { data, data + n, 1 };
+
+    while (reader.ok && reader.data < reader.end)
+    {
+        uint8_t op = *reader.data++;
+        uint32_t row, column, count, id;
+        TwinCell cell;
+
+        switch (op)
+        {
+        case 'S':
+            row = get_varint(&reader);
+            column = get_varint(&reader);
+            if (row > REMOTE_SIZE_MAX || column > REMOTE_SIZE_MAX)
+            {
+                return 0;
+            }
+            client->size.row = (int) row;
+            client->size.column = (int) column;
+            break;
+        case 'X':
+            for (id = 0; id < TWIN_REMOTE_STYLES; ++id)
+            {
+                client->style[id] = blank;
+            }
+            break;
+        case 'T':
+            id = get_varint(&reader);
+            cell = blank;
+            cell.fg = get_varint(&reader);
+            cell.bg = get_varint(&reader);
+            cell.attr = (uint8_t) get_varint(&reader);
+            if (id >= TWIN_REMOTE_STYLES)
+            {
+                return 0;
+            }
+            client->style[id] = cell;
+            break;
+        case 'R':
+        case 'F':
+            row = get_varint(&reader);
+            column = get_varint(&reader);
+            count = get_varint(&reader);
+            id = get_varint(&reader);
+            if (!reader.ok || id >= TWIN_REMOTE_STYLES
+                || row >= (uint32_t) client->size.row
+                || column > (uint32_t) client->size.column
+                || count > (uint32_t) client->size.column - column
+                || (size_t) (reader.end - reader.data)
+                < ((op == 'F') ? 1 : count))
+            {                          /* (off the server's screen) */
+                return 0;
+            }
+            cell = client->style[id];
+            for (uint32_t i = 0; i < count; ++i)
+            {
+                cell.ch = (op == 'F') ? reader.data[0] : reader.data[i];
+                if (cell.ch >= TWIN_GLYPH_EXT)
+                {                      /* the server's glyph: ours */
+                    cell.ch = client->glyph[cell.ch - TWIN_GLYPH_EXT];
+                    cell.ch = (cell.ch != 0) ? cell.ch : TWIN_UTF8_REPLACEMENT;
+                }
+                twin_set_cell(root, (int) row, (int) (column + i), cell);
+            }
+            reader.data += (op == 'F') ? 1 : count;
+            break;
+        case 'U':
+            {
+                uint32_t cp, width;
+
+                id = get_varint(&reader);
+                cp = get_varint(&reader);
+                width = get_varint(&reader);
+                if (!reader.ok || id < TWIN_GLYPH_EXT || id >= TWIN_GLYPH_MAX
+                    || cp < 0x80 || cp > 0x10ffff || width < 1 || width > 2)
+                {
+                    return 0;
+                }
+                client->glyph[id - TWIN_GLYPH_EXT] =
+                    twin_utf8_intern(cp, (int) width);
+            }
+            break;
+        case 'V':
+            {
+                TwinRegion region;
+                TwinCell style = root->style;
+                uint32_t zigzag;
+
+                region.min.row = (int) get_varint(&reader);
+                region.min.column = (int) get_varint(&reader);
+                region.max.row = (int) get_varint(&reader);
+                region.max.column = (int) get_varint(&reader);
+                zigzag = get_varint(&reader);
+                root->style = blank;
+                twin_scroll(root, region,
+                            (int) (zigzag >> 1) ^ -(int) (zigzag & 1));
+                root->style = style;
+            }
+            break;
+        default:
+            return 0;
+        }
+    }
+    return reader.ok;
+}
+
+
+/*
+ * twin_client_read() --Read and apply any frames the server has sent.
+ *
+ * Returns: (int)
+ * The number of frames applied (possibly 0), or -1 if the connection
+ * is closed, or the stream is malformed.
+ *
+ * Remarks:
+ * The frames are applied to the Xterminator's root, so the caller
+ * renders them with xterm_sync() as usual.
+ */
+int twin_client_read(TwinClient * client)
+{
+    TwinBuffer *input = &client->input;
+    int n_frame = 0;
+    ssize_t n;
+
+    if (!buffer_reserve(input, 65536))
+    {
+        return -1;
+    }
+    n = read(client->fd, input->data + input->n, input->alloc - input->n);
+    if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK
+                   && errno != EINTR))
+    {
+        return -1;
+    }
+    input->n += (n > 0) ? (size_t) n : 0;
+
+    while (input->n >= TWIN_REMOTE_HEADER)
+    {
+        uint8_t type = input->data[0];
+        uint32_t n_plain = get_u32(input->data + 1);
+        uint32_t n_wire = get_u32(input->data + 5);
+        const uint8_t *payload = input->data + TWIN_REMOTE_HEADER;
+
+        if ((type != 'F' && type != 'Z') || n_plain > TWIN_REMOTE_FRAME_MAX
+            || n_wire > TWIN_REMOTE_FRAME_MAX)
+        {
+            err("%s(): malformed frame header", __func__);
+            return -1;
+        }
+        if (input->n < TWIN_REMOTE_HEADER + n_wire)
+        {
+            break;                     /* wait for the rest */
+        }
+        if (type == 'Z')
+        {
+            client->plain.n = 0;
+            if (!buffer_reserve(&client->plain, n_plain)
+                || twin_lz_decompress(payload, n_wire, client->plain.data,
+                                      n_plain) != (long) n_plain)
+            {
+                err("%s(): malformed compressed frame", __func__);
+                return -1;
+            }
+            payload = client->plain.data;
+        }
+        if (!client_apply(client, payload, n_plain))
+        {
+            err("%s(): malformed frame", __func__);
+            return -1;
+        }
+        input->n -= TWIN_REMOTE_HEADER + n_wire;
+        memmove(input->data, input->data + TWIN_REMOTE_HEADER + n_wire,
+                input->n);
+        ++n_frame;
+    }
+    return n_frame;
+}
+
+
+static inline uint32_t lz_hash(const uint8_t * data)
+{
+    uint32_t word;
+
+    memcpy(&word, data, sizeof(word));
+    return (word * 2654435761u) >> (32 - TWIN_LZ_HASH_BITS);
+}
+
+
+/*
+ * lz_length() --Append an LZ4 length extension (after a 15 nibble).
+ */
+static uint8_t *lz_length(uint8_t * out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+    {
+        *out++ = 255;
+    }
+    *out++ = (uint8_t) length;
+    return out;
+}
+
+
+/*
+ * twin_lz_compress() --Compress a block, in LZ4 block format.
+ *
+ * Parameters:
+ * src, n_src --the data to compress
+ * dst, n_dst --the output buffer
+ * table      --the hash table (1 << TWIN_LZ_HASH_BITS entries)
+ *
+ * Returns: (size_t)
+ * Success: the compressed size; Failure: 0 (dst is too small).
+ *
+ * Remarks:
+ * This is the simple, greedy, single-probe form of LZ4; frame deltas
+ * are small and repetitive, so that gets most of the gain.
+ */
+size_t twin_lz_compress(const uint8_t * src, size_t n_src,
+                        uint8_t * dst, size_t n_dst, uint32_t * table)
+{
+    const uint8_t *anchor = src;
+    const uint8_t *end = src + n_src;
+    uint8_t *out = dst;
+    size_t ip = 0;
+
+    memset(table, 0, sizeof(*table) << TWIN_LZ_HASH_BITS);
+    while (n_src > LZ_MATCH_LIMIT && ip < n_src - LZ_MATCH_LIMIT)
+    {
+        uint32_t hash = lz_hash(src + ip);
+        size_t ref = table[hash];      /* position + 1, or 0 */
+        size_t match, n_literal;
+
+        table[hash] = (uint32_t) (ip + 1);
+        if (ref == 0 || ip - (ref - 1) > 65535
+            || memcmp(src + ref - 1, src + ip, LZ_MIN_MATCH) != 0)
+        {
+            ++ip;
+            continue;
+        }
+        --ref;
+        for (match = LZ_MIN_MATCH;
+             ip + match < n_src - LZ_LAST_LITERALS
+             && src[ref + match] == src[ip + match]; ++match)
+        {
+            continue;
+        }
+        n_literal = (size_t) (src + ip - anchor);
+        if ((size_t) (out - dst) + n_literal + n_literal / 255 + match / 255
+            + 8 > n_dst)
+        {
+            return 0;
+        }
+        uint8_t *token = out++;
+
+        *token = (uint8_t) (((n_literal < 15) ? n_literal : 15) << 4);
+        if (n_literal >= 15)
+        {
+            out = lz_length(out, n_literal - 15);
+        }
+        memcpy(out, anchor, n_literal);
+        out += n_literal;
+        *out++ = (uint8_t) (ip - ref);
+        *out++ = (uint8_t) ((ip - ref) >> 8);
+        *token |= (uint8_t) ((match - LZ_MIN_MATCH < 15)
+                             ? match - LZ_MIN_MATCH : 15);
+        if (match - LZ_MIN_MATCH >= 15)
+        {
+            out = lz_length(out, match - LZ_MIN_MATCH - 15);
+        }
+        ip += match;
+        anchor = src + ip;
+    }
+
+    size_t n_literal = (size_t) (end - anchor);    /* the last literals */
+
+    if ((size_t) (out - dst) + n_literal + n_literal / 255 + 2 > n_dst)
+    {
+        return 0;
+    }
+    *out++ = (uint8_t) (((n_literal < 15) ? n_literal : 15) << 4);
+    if (n_literal >= 15)
+    {
+        out = lz_length(out, n_literal - 15);
+    }
+    memcpy(out, anchor, n_literal);
+    out += n_literal;
+    return (size_t) (out - dst);
+}
+
+
+/*
+ * twin_lz_decompress() --Decompress an LZ4 block.
+ *
+ * Returns: (long)
+ * Success: the decompressed size; Failure: -1 (malformed, or dst is
+ * too small).
+ */
+long twin_lz_decompress(const uint8_t * src, size_t n_src,
+                        uint8_t * dst, size_t n_dst)
+{
+    size_t ip = 0, op = 0;
+
+    while (ip < n_src)
+    {
+        unsigned int token = src[ip++];
+        size_t length = token >> 4;
+        size_t offset;
+        uint8_t byte;
+
+        if (length == 15)
+        {
+            do
+            {
+                if (ip >= n_src)
+                {
+                    return -1;
+                }
+                length += (byte = src[ip++]);
+            } while (byte == 255);
+        }
+        if (length > n_src - ip || length > n_dst - op)
+        {
+            return -1;
+        }
+        memcpy(dst + op, src + ip, length);
+        ip += length;
+        op += length;
+        if (ip == n_src)
+        {
+            break;                     /* the last literals */
+        }
+
+        if (n_src - ip < 2)
+        {
+            return -1;
+        }
+        offset = (size_t) src[ip] | (size_t) src[ip + 1] << 8;
+        ip += 2;
+        length = (token & 15) + LZ_MIN_MATCH;
+        if ((token & 15) == 15)
+        {
+            do
+            {
+                if (ip >= n_src)
+                {
+                    return -1;
+                }
+                length += (byte = src[ip++]);
+            } while (byte == 255);
+        }
+        if (offset == 0 || offset > op || length > n_dst - op)
+        {
+            return -1;
+        }
+        for (size_t i = 0; i < length; ++i, ++op)
+        {                              /* note: may overlap */
+            dst[op] = dst[op - offset];
+        }
+    }
+    return (long) op;
+}
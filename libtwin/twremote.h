@@ -0,0 +1,108 @@
+/*
+ * TWREMOTE.H --Binary frame deltas, for rendering on a remote terminal.
+ *
+ * Remarks:
+ * A TwinServer streams the changes to a root window to any number of
+ * clients over a Unix or TCP socket, as compact binary deltas rather
+ * than escape sequences; a TwinClient applies them to the root of its
+ * own Xterminator, which does the style encoding and cursor planning
+ * for whatever terminal it's driving.
+ *
+ * The stream is a sequence of frames, each with a 9 byte header:
+ * the frame type ('F': plain, 'Z': LZ4 block compressed), then the
+ * plain and wire sizes (uint32, little-endian).  A frame's payload is
+ * a sequence of ops, each an op byte followed by varint arguments:
+ *
+ * * 'S' rows columns            --the server's screen size
+ * * 'X'                         --reset the style table
+ * * 'T' id fg bg attr           --define style id
+ * * 'R' row column n style ch*n --a run of cells, in one style
+ * * 'F' row column n style ch   --n copies of a cell
+ * * 'V' top left bottom right n --scroll a region (n zig-zag encoded)
+ * * 'U' glyph cp width          --define an interned (non-ASCII) glyph
+ *
+ * Scrolled-in rows are filled with the default (blank) style.  Glyphs
+ * are bytes, as in a Twindow; the server's interned glyphs (see
+ * twutf8.h) are defined by 'U' before they're used, and the client
+ * interns them in turn.
+ *
+ * Clients' sockets are never waited on: a client that can't take a
+ * whole frame keeps the rest in its backlog, and misses any frames
+ * sent before that's written; it's then sent the whole screen again.
+ * twin_server_flush() does this, and is called by twin_server_sync(),
+ * but a server that's idle should call it when a client with a
+ * backlog is writable.
+ */
+#ifndef TWREMOTE_H
+#define TWREMOTE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <twin.h>
+#include <twutf8.h>
+#include <xterminator.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+#define TWIN_REMOTE_STYLES 1024        /* style table size */
+#define TWIN_REMOTE_CLIENTS 8          /* clients per server */
+#define TWIN_REMOTE_HEADER 9           /* bytes in a frame header */
+#define TWIN_REMOTE_FRAME_MAX (1 << 24) /* sanity limit on frame size */
+#define TWIN_LZ_HASH_BITS 12           /* compressor's hash table size */
+
+    typedef struct TwinBuffer_t
+    {
+        uint8_t *data;
+        size_t n, alloc;
+    } TwinBuffer;
+
+    typedef struct TwinServer_t
+    {
+        int fd;                        /* listening socket */
+        int client[TWIN_REMOTE_CLIENTS];    /* -1: unused */
+        TwinBuffer backlog[TWIN_REMOTE_CLIENTS];        /* ...unsent bytes */
+        int stale[TWIN_REMOTE_CLIENTS];     /* ...missed a frame */
+        int compress;                  /* LZ4-compress frames */
+        Twindow *root;                 /* what's drawn */
+        Twindow shadow;                /* ...what the clients have */
+        TwinCell style[TWIN_REMOTE_STYLES];     /* style table, by id */
+        int n_style;
+        uint16_t style_slot[2 * TWIN_REMOTE_STYLES];  /* hash: id + 1 */
+        int n_glyph;                   /* interned glyphs defined */
+        TwinBuffer plain, wire;        /* encoding buffers */
+        uint32_t lz_table[1 << TWIN_LZ_HASH_BITS];
+        size_t bytes;                  /* sent, in total (per client) */
+    } TwinServer;
+
+    typedef struct TwinClient_t
+    {
+        int fd;
+        Xterminator *xterm;            /* deltas are applied to its root */
+        TwinCoordinate size;           /* the server's screen size */
+        TwinCell style[TWIN_REMOTE_STYLES];
+        uint8_t glyph[TWIN_GLYPH_MAX - TWIN_GLYPH_EXT];   /* ours, or 0 */
+        TwinBuffer input, plain;
+    } TwinClient;
+
+    TwinServer *init_twin_server(TwinServer * server, Twindow * root);
+    void free_twin_server(TwinServer * server);
+    int twin_server_listen(TwinServer * server, const char *address);
+    int twin_server_accept(TwinServer * server);
+    int twin_server_sync(TwinServer * server);
+    int twin_server_flush(TwinServer * server);
+
+    TwinClient *init_twin_client(TwinClient * client, Xterminator * xterm);
+    void free_twin_client(TwinClient * client);
+    int twin_client_connect(TwinClient * client, const char *address);
+    int twin_client_read(TwinClient * client);
+
+    size_t twin_lz_compress(const uint8_t * src, size_t n_src,
+                            uint8_t * dst, size_t n_dst, uint32_t * table);
+    long twin_lz_decompress(const uint8_t * src, size_t n_src,
+                            uint8_t * dst, size_t n_dst);
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWREMOTE_H */
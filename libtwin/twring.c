@@ -0,0 +1,336 @@
+/*
+ * TWRING.C --A lock-free queue of draw commands, from any thread.
+ *
+ * Contents:
+ * init_twin_ring()      --Initialise an empty ring.
+ * free_twin_ring()      --Release a ring's slots.
+ * twin_ring_push()      --Push a command (any thread).
+ * twin_ring_text()      --Push some text (any thread).
+ * twin_ring_span()      --Push a span of identical cells (any thread).
+ * twin_ring_style()     --Push a change of window style (any thread).
+ * twin_ring_invalidate() --Push a widget invalidation (any thread).
+ * twin_ring_drain()     --Apply the queued commands (render thread).
+ *
+ * Remarks:
+ * This is Vyukov's bounded queue: each slot has a sequence number
+ * that says whether it's free for the producer claiming that position,
+ * or full for the consumer; producers claim positions with a CAS on
+ * the tail.  Only one thread may drain.
+ *
+ * Draining works in batches: commands that are superseded by a later
+ * command in the same batch with the same target and extent (e.g. a
+ * metric updated several times in a frame) aren't applied.
+ */
+#include <apex.h>
+#include <apex/log.h>
+#include "twring.h"
+#include "twutf8.h"
+
+/*
+ * init_twin_ring() --Initialise an empty ring.
+ *
+ * Parameters:
+ * ring     --the ring to initialise
+ * n_slot   --the capacity, rounded up to a power of 2
+ */
+TwinRing *init_twin_ring(TwinRing * ring, size_t n_slot)
+{
+    size_t n = 2;
+
+    while (n < n_slot)
+    {
+        n *= 2;
+    }
+    if ((ring->slot = malloc(n * sizeof(TwinRingSlot))) == NULL)
+    {
+        return NULL;                   /* failure: no memory */
+    }
+    for (size_t i = 0; i < n; ++i)
+    {
+        atomic_init(&ring->slot[i].sequence, i);
+    }
+    atomic_init(&ring->tail, 0);
+    ring->head = 0;
+    ring->mask = n - 1;
+    return ring;
+}
+
+
+void free_twin_ring(TwinRing * ring)
+{
+    free(ring->slot);
+    ring->slot = NULL;
+}
+
+
+/*
+ * twin_ring_push() --Push a command (any thread).
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (the ring is full).
+ */
+int twin_ring_push(TwinRing * ring, const TwinCommand * command)
+{
+    size_t position = atomic_load_explicit(&ring->tail,
+                                           memory_order_relaxed);
+    TwinRingSlot *slot;
+
+    for (;;)
+    {
+        slot = &ring->slot[position & ring->mask];
+
+        size_t sequence = atomic_load_explicit(&slot->sequence,
+                                               memory_order_acquire);
+        intptr_t diff = (intptr_t) sequence - (intptr_t) position;
+
+        if (diff == 0)
+        {                              /* free: try to claim it */
+            if (atomic_compare_exchange_weak_explicit(&ring->tail,
+                                                      &position,
+                                                      position + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            return 0;                  /* full */
+        }
+        else
+        {                              /* another producer beat us */
+            position = atomic_load_explicit(&ring->tail,
+                                            memory_order_relaxed);
+        }
+    }
+    slot->command = *command;
+    atomic_store_explicit(&slot->sequence, position + 1,
+                          memory_order_release);
+    return 1;
+}
+
+
+/*
+ * twin_ring_text() --Push some text (any thread).
+ *
+ * Returns: (int)
+ * The number of bytes queued; long text is split across commands.
+ */
+int twin_ring_text(TwinRing * ring, Twindow * twin, int row, int column,
+                   TwinCell style, const char *text)
+{
+    TwinCommand command;
+    int n = 0;
+
+    command.type = TwinCommandText;
+    command.target = twin;
+    command.row = row;
+    command.style = style;
+    do
+    {
+        int len = (int) strnlen(text + n, TWIN_COMMAND_TEXT);
+
+        if (len == TWIN_COMMAND_TEXT)
+        {                              /* split between characters */
+            len = (int) twin_utf8_truncate(text + n, (size_t) len);
+        }
+        command.column = column;
+        command.len = len;
+        command.width = twin_utf8_width(text + n, (size_t) len);
+        memcpy(command.text, text + n, (size_t) len);
+        if (!twin_ring_push(ring, &command))
+        {
+            break;
+        }
+        column += command.width;
+        n += len;
+    }
+    while (text[n] != '\0');
+    return n;
+}
+
+
+int twin_ring_span(TwinRing * ring, Twindow * twin, int row, int column,
+                   int n, TwinCell cell)
+{
+    TwinCommand command;
+
+    command.type = TwinCommandSpan;
+    command.target = twin;
+    command.row = row;
+    command.column = column;
+    command.len = command.width = n;
+    command.style = cell;
+    return twin_ring_push(ring, &command);
+}
+
+
+int twin_ring_style(TwinRing * ring, Twindow * twin, TwinCell style)
+{
+    TwinCommand command;
+
+    command.type = TwinCommandStyle;
+    command.target = twin;
+    command.row = command.column = command.len = command.width = 0;
+    command.style = style;
+    return twin_ring_push(ring, &command);
+}
+
+
+int twin_ring_invalidate(TwinRing * ring, Twidget * widget)
+{
+    TwinCommand command;
+
+    command.type = TwinCommandInvalidate;
+    command.target = widget;
+    command.row = command.column = command.len = command.width = 0;
+    return twin_ring_push(ring, &command);
+}
+
+
+/*
+ * ring_pop() --Take the next command (consumer only).
+ */
+static int ring_pop(TwinRing * ring, TwinCommand * command)
+{
+    TwinRingSlot *slot = &ring->slot[ring->head & ring->mask];
+    size_t sequence = atomic_load_explicit(&slot->sequence,
+                                           memory_order_acquire);
+
+    if (sequence != ring->head + 1)
+    {
+        return 0;                      /* empty (or not yet written) */
+    }
+    *command = slot->command;
+    atomic_store_explicit(&slot->sequence, ring->head + ring->mask + 1,
+                          memory_order_release);
+    ring->head += 1;
+    return 1;
+}
+
+
+/*
+ * command_key() --Hash a command's target and extent.
+ *
+ * Remarks:
+ * The extent is the cells covered (row, column and width), not the
+ * text's length in bytes: "ab" and "\xc3\xa9" are both 2 bytes, but
+ * the second doesn't cover the first's second column.
+ */
+static uint64_t command_key(const TwinCommand * command)
+{
+    uint64_t key = (uint64_t) (uintptr_t) command->target;
+
+    key = key * 31 + (uint64_t) command->type;
+    key = key * 31 + (uint64_t) command->row;
+    key = key * 31 + (uint64_t) command->column;
+    key = key * 31 + (uint64_t) command->width;
+    return key * 0x9E3779B97F4A7C15ull;
+}
+
+
+static int command_same(const TwinCommand * a, const TwinCommand * b)
+{
+    return a->target == b->target && a->type == b->type
+        && a->row == b->row && a->column == b->column
+        && a->width == b->width;
+}
+
+
+static void command_apply(const TwinCommand * command)
+{
+    Twindow *twin = command->target;
+    TwinCell cell = command->style;
+
+    switch (command->type)
+    {
+    case TwinCommandText:
+        {
+            uint8_t glyph[TWIN_COMMAND_TEXT];
+            int n_glyph;
+
+            twin_utf8_glyphs(command->text, (size_t) command->len, glyph,
+                             TWIN_COMMAND_TEXT, &n_glyph);
+            for (int i = 0; i < n_glyph; ++i)
+            {
+                cell.ch = glyph[i];
+                twin_set_cell(twin, command->row, command->column + i, cell);
+            }
+        }
+        break;
+    case TwinCommandSpan:
+        for (int i = 0; i < command->len; ++i)
+        {
+            twin_set_cell(twin, command->row, command->column + i, cell);
+        }
+        break;
+    case TwinCommandStyle:
+        twin->style = command->style;
+        break;
+    case TwinCommandInvalidate:
+        twidget_invalidate((Twidget *) command->target);
+        break;
+    }
+}
+
+
+/*
+ * twin_ring_drain() --Apply the queued commands (render thread).
+ *
+ * Returns: (int)
+ * The number of commands drained (including superseded ones).
+ *
+ * Remarks:
+ * Commands are applied in order, but within each batch a command is
+ * skipped if a later one has the same target and extent.  Commands
+ * pushed while draining are left for the next frame.
+ */
+int twin_ring_drain(TwinRing * ring)
+{
+    TwinCommand batch[TWIN_RING_BATCH];
+    int16_t seen[2 * TWIN_RING_BATCH]; /* open-addressed: batch index */
+    char skip[TWIN_RING_BATCH];
+    size_t end = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    int total = 0;
+    int n;
+
+    do
+    {
+        for (n = 0; n < TWIN_RING_BATCH && ring->head != end
+             && ring_pop(ring, &batch[n]); ++n)
+        {
+            ;
+        }
+        memset(seen, -1, sizeof(seen));
+        for (int i = n - 1; i >= 0; --i)
+        {                              /* latest first: mark superseded */
+            size_t h = (size_t) ((command_key(&batch[i]) >> 32)
+                                 % (2 * TWIN_RING_BATCH));
+
+            skip[i] = 0;
+            while (seen[h] >= 0 && !command_same(&batch[seen[h]], &batch[i]))
+            {
+                h = (h + 1) & (2 * TWIN_RING_BATCH - 1);
+            }
+            if (seen[h] >= 0)
+            {
+                skip[i] = 1;
+            }
+            else
+            {
+                seen[h] = (int16_t) i;
+            }
+        }
+        for (int i = 0; i < n; ++i)
+        {
+            if (!skip[i])
+            {
+                command_apply(&batch[i]);
+            }
+        }
+        total += n;
+    }
+    while (n == TWIN_RING_BATCH);
+    return total;
+}
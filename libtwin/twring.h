@@ -0,0 +1,71 @@
+/*
+ * TWRING.H --A lock-free queue of draw commands, from any thread.
+ *
+ * Remarks:
+ * Twindows aren't thread-safe, so other threads push draw commands
+ * into a bounded multi-producer, single-consumer ring, and the render
+ * thread drains it at the start of each frame.  Pushing never blocks;
+ * it fails if the ring is full.
+ */
+#ifndef TWRING_H
+#define TWRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <twin.h>
+#include <twidget.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+#define TWIN_COMMAND_TEXT 64           /* text bytes per command */
+#define TWIN_RING_BATCH 256            /* commands deduplicated together */
+
+    typedef enum TwinCommandType_t
+    {
+        TwinCommandText,               /* text at row, column, in style */
+        TwinCommandSpan,               /* len copies of style (a cell) */
+        TwinCommandStyle,              /* set the window's style */
+        TwinCommandInvalidate          /* invalidate a widget */
+    } TwinCommandType;
+
+    typedef struct TwinCommand_t
+    {
+        TwinCommandType type;
+        int row, column;
+        int len;                       /* text length, or span size */
+        int width;                     /* columns covered */
+        void *target;                  /* Twindow, or Twidget */
+        TwinCell style;
+        char text[TWIN_COMMAND_TEXT];
+    } TwinCommand;
+
+    typedef struct TwinRingSlot_t
+    {
+        atomic_size_t sequence;
+        TwinCommand command;
+    } TwinRingSlot;
+
+    typedef struct TwinRing_t
+    {
+        atomic_size_t tail;            /* producers: next slot to claim */
+        size_t head;                   /* consumer: next slot to drain */
+        size_t mask;                   /* n_slot - 1 */
+        TwinRingSlot *slot;
+    } TwinRing;
+
+    TwinRing *init_twin_ring(TwinRing * ring, size_t n_slot);
+    void free_twin_ring(TwinRing * ring);
+    int twin_ring_push(TwinRing * ring, const TwinCommand * command);
+    int twin_ring_text(TwinRing * ring, Twindow * twin, int row, int column,
+                       TwinCell style, const char *text);
+    int twin_ring_span(TwinRing * ring, Twindow * twin, int row, int column,
+                       int n, TwinCell cell);
+    int twin_ring_style(TwinRing * ring, Twindow * twin, TwinCell style);
+    int twin_ring_invalidate(TwinRing * ring, Twidget * widget);
+    int twin_ring_drain(TwinRing * ring);
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWRING_H */
@@ -0,0 +1,265 @@
+/*
+ * TWTRACE.C --Update latency tracing, from damage to write().
+ *
+ * Contents:
+ * init_twin_trace()   --Initialise a trace, with an empty ring.
+ * free_twin_trace()   --Release a trace's ring.
+ * twin_trace_start()  --Start tracing frames into a trace.
+ * twin_trace_stop()   --Stop tracing.
+ * twin_trace_mark()   --Timestamp a point in the current frame.
+ * twin_trace_compose() --Timestamp compose start/end (outermost call).
+ * twin_trace_frame()  --Finish the current frame, and push its span.
+ * twin_trace_dump()   --Write the traced spans as Chrome trace JSON.
+ *
+ * Remarks:
+ * The render thread is the only producer, and the dumper the only
+ * consumer, so the ring only needs acquire/release ordering on its
+ * head and tail.  If the ring is full, new spans are dropped (and
+ * counted) rather than overwriting ones that may be being dumped.
+ */
+#include <time.h>
+#include <apex.h>
+#include <apex/log.h>
+#include "twtrace.h"
+
+TwinTrace *twin_trace;
+
+static const char *trace_phase[] = {  /* from the previous point */
+    NULL, "wait", "compose", "wait", "encode", "write"
+};
+
+
+/*
+ * init_twin_trace() --Initialise a trace, with an empty ring.
+ *
+ * Parameters:
+ * trace    --the trace to initialise
+ * n_span   --the ring's capacity (frames), rounded up to a power of 2
+ */
+TwinTrace *init_twin_trace(TwinTrace * trace, size_t n_span)
+{
+    size_t n = 2;
+
+    while (n < n_span)
+    {
+        n *= 2;
+    }
+    memset(trace, 0, sizeof(*trace));
+    if ((trace->span = malloc(n * sizeof(TwinTraceSpan))) == NULL)
+    {
+        return NULL;                   /* failure: no memory */
+    }
+    atomic_init(&trace->head, 0);
+    atomic_init(&trace->tail, 0);
+    trace->mask = n - 1;
+    return trace;
+}
+
+
+void free_twin_trace(TwinTrace * trace)
+{
+    if (twin_trace == trace)
+    {
+        twin_trace_stop();
+    }
+    free(trace->span);
+    trace->span = NULL;
+}
+
+
+void twin_trace_start(TwinTrace * trace)
+{
+    memset(&trace->current, 0, sizeof(trace->current));
+    trace->compose_depth = 0;
+    twin_trace = trace;
+}
+
+
+void twin_trace_stop(void)
+{
+    twin_trace = NULL;
+}
+
+
+static uint64_t trace_ns(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000 + (uint64_t) t.tv_nsec;
+}
+
+
+/*
+ * twin_trace_mark() --Timestamp a point in the current frame.
+ *
+ * Remarks:
+ * Damage and compose start keep their first time in the frame; the
+ * other points keep their latest.
+ */
+void twin_trace_mark(TwinTracePoint point)
+{
+    uint64_t *t = &twin_trace->current.t[point];
+
+    if (*t == 0 || (point != TwinTraceDamage
+                    && point != TwinTraceComposeStart))
+    {
+        *t = trace_ns();
+    }
+}
+
+
+/*
+ * twin_trace_compose() --Timestamp compose start/end (outermost call).
+ */
+void twin_trace_compose(int start)
+{
+    TwinTrace *trace = twin_trace;
+
+    if (start && trace->compose_depth++ == 0)
+    {
+        twin_trace_mark(TwinTraceComposeStart);
+    }
+    else if (!start && --trace->compose_depth == 0)
+    {
+        twin_trace_mark(TwinTraceComposeEnd);
+    }
+}
+
+
+/*
+ * twin_trace_frame() --Finish the current frame, and push its span.
+ *
+ * Parameters:
+ * changes  --the number of cells sent
+ * bytes    --the number of bytes written
+ *
+ * Remarks:
+ * This is called by xterm_sync() once the frame has been written.
+ */
+void twin_trace_frame(int changes, size_t bytes)
+{
+    TwinTrace *trace = twin_trace;
+    TwinTraceSpan *current = &trace->current;
+    size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+
+    current->t[TwinTraceWriteEnd] = trace_ns();
+    current->changes = (uint32_t) changes;
+    current->bytes = bytes;
+    if (tail - head > trace->mask)
+    {
+        trace->dropped += 1;           /* full: the dumper's behind */
+    }
+    else
+    {
+        trace->span[tail & trace->mask] = *current;
+        atomic_store_explicit(&trace->tail, tail + 1, memory_order_release);
+    }
+    memset(current->t, 0, sizeof(current->t));
+    current->frame += 1;
+}
+
+
+static int trace_cmp(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a;
+    uint64_t y = *(const uint64_t *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+/*
+ * twin_trace_dump() --Write the traced spans as Chrome trace JSON.
+ *
+ * Parameters:
+ * trace    --the trace to dump (and drain)
+ * file     --where to write the JSON, or NULL just for stats
+ * stats    --returns the update-to-write latency percentiles, or NULL
+ *
+ * Returns: (size_t)
+ * The number of frames dumped.
+ *
+ * Remarks:
+ * Each frame is a "frame" event (damage to write end) on thread 1,
+ * and its phases (wait, compose, wait, encode, write) on thread 2.
+ * Points a frame didn't reach (e.g. no compose) are skipped.
+ */
+size_t twin_trace_dump(TwinTrace * trace, FILE * file,
+                       TwinTraceStats * stats)
+{
+    size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&trace->tail, memory_order_acquire);
+    size_t n = tail - head;
+    uint64_t *latency = (stats != NULL) ? malloc(n * sizeof(*latency) + 1)
+        : NULL;
+    size_t n_latency = 0;
+    const char *sep = "";
+
+    if (file != NULL)
+    {
+        fputs("{\"traceEvents\": [\n", file);
+    }
+    for (; head != tail; ++head)
+    {
+        const TwinTraceSpan *span = &trace->span[head & trace->mask];
+        uint64_t start = span->t[TwinTraceDamage];
+        uint64_t end = span->t[TwinTraceWriteEnd];
+        uint64_t from = start;
+
+        if (start == 0)
+        {
+            continue;                  /* (nothing damaged: a retry) */
+        }
+        if (latency != NULL)
+        {
+            latency[n_latency++] = end - start;
+        }
+        if (file == NULL)
+        {
+            continue;
+        }
+        fprintf(file, "%s{\"name\": \"frame\", \"ph\": \"X\", \"pid\": 1, "
+                "\"tid\": 1, \"ts\": %.3f, \"dur\": %.3f, \"args\": "
+                "{\"frame\": %u, \"changes\": %u, \"bytes\": %llu}}",
+                sep, start / 1e3, (end - start) / 1e3, span->frame,
+                span->changes, (unsigned long long) span->bytes);
+        sep = ",\n";
+        for (int point = TwinTraceComposeStart; point < TwinTracePoints;
+             ++point)
+        {
+            uint64_t t = span->t[point];
+
+            if (t == 0 || t < from)
+            {
+                continue;
+            }
+            fprintf(file, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, "
+                    "\"tid\": 2, \"ts\": %.3f, \"dur\": %.3f}",
+                    trace_phase[point], from / 1e3, (t - from) / 1e3);
+            from = t;
+        }
+    }
+    atomic_store_explicit(&trace->head, tail, memory_order_release);
+
+    if (stats != NULL)
+    {
+        memset(stats, 0, sizeof(*stats));
+        if (latency != NULL && n_latency > 0)
+        {
+            qsort(latency, n_latency, sizeof(*latency), trace_cmp);
+            stats->n_frame = n_latency;
+            stats->p50 = latency[(n_latency - 1) * 50 / 100];
+            stats->p99 = latency[(n_latency - 1) * 99 / 100];
+            stats->max = latency[n_latency - 1];
+        }
+        free(latency);
+    }
+    if (file != NULL)
+    {
+        fprintf(file, "\n], \"displayTimeUnit\": \"ms\", "
+                "\"otherData\": {\"dropped\": %lu}}\n", trace->dropped);
+    }
+    return n;
+}
@@ -0,0 +1,89 @@
+/*
+ * TWTRACE.H --Update latency tracing, from damage to write().
+ *
+ * Remarks:
+ * When tracing is started, each frame is timestamped as it goes
+ * through the pipeline: the first damage to any window, compose start
+ * and end, xterm_sync() start, encode end, and the completion of the
+ * write.  Each frame's span is pushed into a lock-free (single
+ * producer, single consumer) ring, which can be dumped from another
+ * thread as Chrome trace-event JSON (chrome://tracing, Perfetto).
+ *
+ * When tracing isn't started, each trace point is a load and a
+ * not-taken branch.
+ */
+#ifndef TWTRACE_H
+#define TWTRACE_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+    typedef enum TwinTracePoint_t
+    {
+        TwinTraceDamage,               /* first damage, since the last frame */
+        TwinTraceComposeStart,         /* first twin_compose() */
+        TwinTraceComposeEnd,           /* last twin_compose() */
+        TwinTraceSyncStart,            /* xterm_sync(), when not deferred */
+        TwinTraceEncodeEnd,            /* frame encoded, before flushing */
+        TwinTraceWriteEnd,             /* ...and written */
+        TwinTracePoints
+    } TwinTracePoint;
+
+    typedef struct TwinTraceSpan_t
+    {
+        uint64_t t[TwinTracePoints];   /* ns (monotonic); 0: not reached */
+        uint32_t frame;
+        uint32_t changes;              /* cells sent */
+        uint64_t bytes;                /* bytes written */
+    } TwinTraceSpan;
+
+    typedef struct TwinTraceStats_t
+    {
+        size_t n_frame;
+        uint64_t p50, p99, max;        /* damage to write end (ns) */
+    } TwinTraceStats;
+
+    typedef struct TwinTrace_t
+    {
+        TwinTraceSpan current;         /* the frame in progress */
+        int compose_depth;             /* (twin_compose() recurses) */
+        atomic_size_t head;            /* consumer: next span to dump */
+        atomic_size_t tail;            /* producer: next span to fill */
+        size_t mask;                   /* n_span - 1 */
+        TwinTraceSpan *span;
+        unsigned long dropped;         /* spans lost to a full ring */
+    } TwinTrace;
+
+    extern TwinTrace *twin_trace;      /* the active trace, or NULL */
+
+    TwinTrace *init_twin_trace(TwinTrace * trace, size_t n_span);
+    void free_twin_trace(TwinTrace * trace);
+    void twin_trace_start(TwinTrace * trace);
+    void twin_trace_stop(void);
+    void twin_trace_mark(TwinTracePoint point);
+    void twin_trace_compose(int start);
+    void twin_trace_frame(int changes, size_t bytes);
+    size_t twin_trace_dump(TwinTrace * trace, FILE * file,
+                           TwinTraceStats * stats);
+
+/*
+ * TWIN_TRACE() --Timestamp a trace point, if tracing.
+ */
+#define TWIN_TRACE(point)                       \
+    do                                          \
+    {                                           \
+        if (twin_trace != NULL)                 \
+        {                                       \
+            twin_trace_mark(point);             \
+        }                                       \
+    } while (0)
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWTRACE_H */
@@ -0,0 +1,364 @@
+/*
+ * TWUTF8.C --UTF-8 text, for cells a byte wide.
+ *
+ * Contents:
+ * twin_utf8_glyphs()   --Decode text into a glyph per column.
+ * twin_utf8_width()    --Get the width (columns) of some text.
+ * twin_utf8_valid()    --Check that some text is valid UTF-8.
+ * twin_utf8_truncate() --Trim an incomplete character from some text.
+ * twin_utf8_intern()   --Get the glyph for a (non-ASCII) character.
+ * twin_utf8_codepoint() --Get the character an interned glyph stands for.
+ * twin_utf8_encode()   --Encode a character as UTF-8.
+ *
+ * Remarks:
+ * Most text is ASCII, so it's checked 16 bytes at a time (two 64-bit
+ * words, tested for any high bit), and copied straight through; only
+ * the characters in between are decoded and measured, a byte at a
+ * time.  The widths follow wcwidth(): combining marks are 0 columns,
+ * East Asian wide/fullwidth characters (and emoji) are 2, but the
+ * table is a short list of the common ranges, not all of Unicode's.
+ *
+ * The glyph table has 127 entries, which is plenty for the odd
+ * accented name; it's searched linearly, from the last character
+ * interned (they tend to repeat).
+ */
+#include <limits.h>
+#include <string.h>
+#include <apex.h>
+#include "twutf8.h"
+
+#define UTF8_STEP 16                   /* bytes checked per ASCII step */
+#define UTF8_HIGH_BITS 0x8080808080808080ull
+#define UTF8_N_GLYPH (TWIN_GLYPH_MAX - TWIN_GLYPH_EXT)
+
+static const uint32_t utf8_zero_width[][2] = {
+    {0x0300, 0x036f}, {0x0483, 0x0489}, {0x0591, 0x05bd}, {0x0610, 0x061a},
+    {0x064b, 0x065f}, {0x1ab0, 0x1aff}, {0x1dc0, 0x1dff}, {0x200b, 0x200f},
+    {0x20d0, 0x20ff}, {0xfe00, 0xfe0f}, {0xfe20, 0xfe2f}, {0xe0100, 0xe01ef}
+};
+static const uint32_t utf8_wide[][2] = {
+    {0x1100, 0x115f}, {0x2e80, 0x303e}, {0x3041, 0x33ff}, {0x3400, 0x4dbf},
+    {0x4e00, 0x9fff}, {0xa000, 0xa4cf}, {0xac00, 0xd7a3}, {0xf900, 0xfaff},
+    {0xfe30, 0xfe4f}, {0xff00, 0xff60}, {0xffe0, 0xffe6}, {0x1f300, 0x1f64f},
+    {0x1f900, 0x1f9ff}, {0x20000, 0x3fffd}
+};
+
+static uint32_t utf8_glyph[UTF8_N_GLYPH];      /* codepoint, by glyph */
+static uint8_t utf8_glyph_width[UTF8_N_GLYPH];
+static int n_utf8_glyph;
+
+
+static inline int utf8_ascii(const char *text)
+{
+    uint64_t a, b;
+
+    memcpy(&a, text, sizeof(a));
+    memcpy(&b, text + sizeof(a), sizeof(b));
+    return ((a | b) & UTF8_HIGH_BITS) == 0;
+}
+
+
+static int utf8_in(uint32_t cp, const uint32_t (*range)[2], size_t n)
+{
+    for (size_t i = 0; i < n && cp >= range[i][0]; ++i)
+    {
+        if (cp <= range[i][1])
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * utf8_decode() --Decode a (non-ASCII) character.
+ *
+ * Returns: (int)
+ * Its length in bytes, or 0 if it's invalid (overlong, a surrogate,
+ * out of range, or truncated).
+ */
+static int utf8_decode(const uint8_t * s, size_t size, uint32_t * cp)
+{
+    static const uint32_t min[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    int n;
+
+    if (s[0] < 0xc2 || s[0] > 0xf4)
+    {
+        return 0;                      /* continuation, overlong, or > 4 */
+    }
+    n = (s[0] < 0xe0) ? 2 : (s[0] < 0xf0) ? 3 : 4;
+    if ((size_t) n > size)
+    {
+        return 0;
+    }
+    *cp = s[0] & (0x7f >> n);
+    for (int i = 1; i < n; ++i)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            return 0;
+        }
+        *cp = (*cp << 6) | (s[i] & 0x3f);
+    }
+    if (*cp < min[n] || (*cp >= 0xd800 && *cp <= 0xdfff) || *cp > 0x10ffff)
+    {
+        return 0;
+    }
+    return n;
+}
+
+
+/*
+ * twin_utf8_glyphs() --Decode text into a glyph per column.
+ *
+ * Parameters:
+ * text     --the text (not necessarily NUL-terminated)
+ * size     --its length in bytes
+ * glyph    --returns the glyphs, or NULL just to measure
+ * max      --the most columns to decode
+ * n_glyph  --returns the number of columns decoded
+ *
+ * Returns: (size_t)
+ * The number of bytes decoded; less than size if max columns were
+ * reached (or the next character is too wide to fit).
+ */
+size_t twin_utf8_glyphs(const char *text, size_t size,
+                        uint8_t * glyph, int max, int *n_glyph)
+{
+    size_t i = 0;
+    int n = 0;
+
+    while (i < size && n < max)
+    {
+        uint32_t cp;
+        int len, width;
+
+        while (i + UTF8_STEP <= size && n + UTF8_STEP <= max
+               && utf8_ascii(text + i))
+        {                              /* the common case */
+            if (glyph != NULL)
+            {
+                memcpy(glyph + n, text + i, UTF8_STEP);
+            }
+            i += UTF8_STEP;
+            n += UTF8_STEP;
+        }
+        if (i >= size || n >= max)
+        {
+            break;
+        }
+        if ((uint8_t) text[i] < 0x80)
+        {
+            if (glyph != NULL)
+            {
+                glyph[n] = (uint8_t) text[i];
+            }
+            ++i, ++n;
+            continue;
+        }
+        if ((len = utf8_decode((const uint8_t *) text + i, size - i, &cp)) == 0)
+        {
+            len = width = 1;           /* invalid: a column per bad byte */
+        }
+        else if (utf8_in(cp, utf8_zero_width, NEL(utf8_zero_width)))
+        {
+            width = 0;
+        }
+        else
+        {
+            width = utf8_in(cp, utf8_wide, NEL(utf8_wide)) ? 2 : 1;
+        }
+        if (n + width > max)
+        {
+            break;
+        }
+        if (glyph != NULL && width > 0)
+        {
+            uint8_t g = (len > 1) ? twin_utf8_intern(cp, width)
+                : TWIN_UTF8_REPLACEMENT;
+
+            glyph[n] = g;
+            if (width == 2)
+            {
+                glyph[n + 1] = (g >= TWIN_GLYPH_EXT) ? TWIN_GLYPH_WIDE : g;
+            }
+        }
+        n += width;
+        i += (size_t) len;
+    }
+    *n_glyph = n;
+    return i;
+}
+
+
+int twin_utf8_width(const char *text, size_t size)
+{
+    int n;
+
+    twin_utf8_glyphs(text, size, NULL, INT_MAX, &n);
+    return n;
+}
+
+
+int twin_utf8_valid(const char *text, size_t size)
+{
+    size_t i = 0;
+    uint32_t cp;
+
+    while (i < size)
+    {
+        int len;
+
+        while (i + UTF8_STEP <= size && utf8_ascii(text + i))
+        {
+            i += UTF8_STEP;
+        }
+        if (i >= size)
+        {
+            break;
+        }
+        if ((uint8_t) text[i] < 0x80)
+        {
+            ++i;
+            continue;
+        }
+        if ((len = utf8_decode((const uint8_t *) text + i, size - i, &cp)) == 0)
+        {
+            return 0;
+        }
+        i += (size_t) len;
+    }
+    return 1;
+}
+
+
+/*
+ * twin_utf8_truncate() --Trim an incomplete character from some text.
+ *
+ * Returns: (size_t)
+ * The length of text that doesn't end part-way through a character,
+ * e.g. to split long text into chunks.
+ */
+size_t twin_utf8_truncate(const char *text, size_t size)
+{
+    size_t lead = size;
+
+    while (lead > 0 && size - lead < 4
+           && ((uint8_t) text[lead - 1] & 0xc0) == 0x80)
+    {
+        --lead;                        /* back over continuation bytes */
+    }
+    if (lead > 0 && (uint8_t) text[lead - 1] >= 0xc0)
+    {
+        uint8_t c = (uint8_t) text[lead - 1];
+        size_t n = (c < 0xe0) ? 2 : (c < 0xf0) ? 3 : 4;
+
+        if (size - (lead - 1) < n)
+        {
+            return lead - 1;           /* incomplete: drop it */
+        }
+    }
+    return size;
+}
+
+
+/*
+ * twin_utf8_intern() --Get the glyph for a (non-ASCII) character.
+ *
+ * Parameters:
+ * cp       --the character
+ * width    --the columns it covers (1 or 2)
+ *
+ * Returns: (uint8_t)
+ * Its glyph (TWIN_GLYPH_EXT and up), or TWIN_UTF8_REPLACEMENT if the
+ * table is full.
+ */
+uint8_t twin_utf8_intern(uint32_t cp, int width)
+{
+    static int last;
+
+    for (int n = 0, i = last; n < n_utf8_glyph; ++n)
+    {
+        if (utf8_glyph[i] == cp)
+        {
+            last = i;
+            return (uint8_t) (TWIN_GLYPH_EXT + i);
+        }
+        i = (i == 0) ? n_utf8_glyph - 1 : i - 1;
+    }
+    if (n_utf8_glyph == UTF8_N_GLYPH)
+    {
+        return TWIN_UTF8_REPLACEMENT;
+    }
+    utf8_glyph[n_utf8_glyph] = cp;
+    utf8_glyph_width[n_utf8_glyph] = (uint8_t) width;
+    last = n_utf8_glyph++;
+    return (uint8_t) (TWIN_GLYPH_EXT + last);
+}
+
+
+/*
+ * twin_utf8_codepoint() --Get the character an interned glyph stands for.
+ *
+ * Parameters:
+ * glyph    --the glyph
+ * width    --returns the columns it covers, or NULL
+ *
+ * Returns: (uint32_t)
+ * The character, or 0 if the glyph isn't an interned one.
+ */
+uint32_t twin_utf8_codepoint(uint8_t glyph, int *width)
+{
+    int i = glyph - TWIN_GLYPH_EXT;
+
+    if (i < 0 || i >= n_utf8_glyph)
+    {
+        return 0;
+    }
+    if (width != NULL)
+    {
+        *width = utf8_glyph_width[i];
+    }
+    return utf8_glyph[i];
+}
+
+
+/*
+ * twin_utf8_encode() --Encode a character as UTF-8.
+ *
+ * Parameters:
+ * cp       --the character (valid, i.e. not a surrogate)
+ * utf8     --returns its encoding (at least 4 bytes)
+ *
+ * Returns: (int)
+ * The encoding's length in bytes.
+ */
+int twin_utf8_encode(uint32_t cp, char *utf8)
+{
+    uint8_t *s = (uint8_t *) utf8;
+
+    if (cp < 0x80)
+    {
+        s[0] = (uint8_t) cp;
+        return 1;
+    }
+    if (cp < 0x800)
+    {
+        s[0] = (uint8_t) (0xc0 | (cp >> 6));
+        s[1] = (uint8_t) (0x80 | (cp & 0x3f));
+        return 2;
+    }
+    if (cp < 0x10000)
+    {
+        s[0] = (uint8_t) (0xe0 | (cp >> 12));
+        s[1] = (uint8_t) (0x80 | ((cp >> 6) & 0x3f));
+        s[2] = (uint8_t) (0x80 | (cp & 0x3f));
+        return 3;
+    }
+    s[0] = (uint8_t) (0xf0 | (cp >> 18));
+    s[1] = (uint8_t) (0x80 | ((cp >> 12) & 0x3f));
+    s[2] = (uint8_t) (0x80 | ((cp >> 6) & 0x3f));
+    s[3] = (uint8_t) (0x80 | (cp & 0x3f));
+    return 4;
+}
@@ -0,0 +1,44 @@
+/*
+ * TWUTF8.H --UTF-8 text, for cells a byte wide.
+ *
+ * Remarks:
+ * A cell's glyph is one byte, so text is decoded into a glyph per
+ * column: ASCII is copied as-is, and any other character is interned
+ * in a small side table, and stored as its index (TWIN_GLYPH_EXT and
+ * up).  East Asian wide characters cover two columns: the glyph, then
+ * TWIN_GLYPH_WIDE.  Combining marks, which cover none, are dropped.
+ * Invalid UTF-8 (or a character that doesn't fit in a full table)
+ * becomes TWIN_UTF8_REPLACEMENT, one per column.  So the layout (and
+ * what follows on the row) matches what a UTF-8 terminal would show.
+ *
+ * Like the style table, the glyph table is process-wide, append-only,
+ * and belongs to the render thread.
+ */
+#ifndef TWUTF8_H
+#define TWUTF8_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif                                 /* C++ */
+#define TWIN_UTF8_REPLACEMENT '?'      /* glyph for undecodable columns */
+#define TWIN_GLYPH_WIDE 0x80           /* 2nd column of a wide character */
+#define TWIN_GLYPH_EXT 0x81            /* first interned character */
+#define TWIN_GLYPH_MAX 0x100           /* ...and the limit */
+#define TWIN_UTF8_BLOCK 256            /* bytes decoded per step, by callers */
+
+    size_t twin_utf8_glyphs(const char *text, size_t size,
+                            uint8_t * glyph, int max, int *n_glyph);
+    int twin_utf8_width(const char *text, size_t size);
+    int twin_utf8_valid(const char *text, size_t size);
+    size_t twin_utf8_truncate(const char *text, size_t size);
+    uint8_t twin_utf8_intern(uint32_t cp, int width);
+    uint32_t twin_utf8_codepoint(uint8_t glyph, int *width);
+    int twin_utf8_encode(uint32_t cp, char *utf8);
+#ifdef __cplusplus
+}
+#endif                                 /* C++ */
+#endif                                 /* TWUTF8_H */
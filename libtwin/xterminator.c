@@ -5,6 +5,14 @@
  * xterminator_init()  --Initialise the Xterminator structure.
  * close_xterminator() --Close, release resources, reset terminal.
  * xterm_sync()        --Render any changes to the device.
+ * xterm_sync_region() --Render the changes in part of the screen.
+ * xterm_sync_timeout() --Get the time until a deferred frame can be sent.
+ * xterm_clear()       --Clear the terminal, and repaint it from root.
+ * xterm_persist()     --Keep the screen frame in shared memory, or adopt it.
+ * xterm_compact()     --Compact an idle terminal's frames.
+ * xterm_read()        --Read input, consuming any capability query replies.
+ * xterm_read_timeout() --Get the time until held input must be read.
+ * xterm_colour_256()  --Map a colour to its nearest xterm-256 palette index.
  * free_xterminator()  --Release any resources used by a Xterminator.
  *
  * Remarks:
@@ -14,12 +22,59 @@
  * * screen --contains the current state of the actual screen.
  *
  * Root and screen are compared when updating the actual screen.
+ *
+ * RGB colours are sent as-is if the terminal supports truecolour
+ * (advertised by $COLORTERM), otherwise they're mapped to the
+ * xterm-256 palette via a 32x32x32 lookup table, built once.
+ *
+ * Over a slow link (ssh, serial console) the tty's output queue backs
+ * up, and sending every frame would leave the display minutes behind.
+ * So xterm_sync() checks the link first (POLLOUT, TIOCOUTQ), and while
+ * it's backed up the frame is deferred: root keeps its damage, and the
+ * screen frame still describes what was actually sent, so the next
+ * frame that does go out is diffed against that, and carries only the
+ * final state.  The link's throughput is measured whenever a flush
+ * blocks, and used to pace frames to what the link can carry.
+ *
+ * Frames are encoded (through stdio) into our own buffer, and written
+ * to the tty's fd with write(), keeping the offset of what's unsent:
+ * if a non-blocking fd fills up mid-frame, the rest goes out before
+ * the next frame.  (stdio can't do that: on EAGAIN, fflush() discards
+ * what it couldn't write, and the screen frame no longer matches.)
+ *
+ * With xterm_persist(), the screen frame lives in a shared memory
+ * segment named after the tty, along with the terminal's cursor and
+ * style state.  A process that replaces us on the same tty (e.g. a new
+ * build of a dashboard) can adopt it, and skip the reset and full
+ * repaint: its first frame is just diffed against what's on the screen.
+ * To hand over, exit without calling close_xterminator().
+ *
+ * The baseline is plain xterm, but open_xterminator() also asks the
+ * terminal what else it can do (XTGETTCAP, DECRQM, DA2, then DA1,
+ * which every terminal answers, so its reply ends the probe).  The
+ * replies arrive on the input, so they're picked out by xterm_read(),
+ * and the encoder upgrades as they come in: REP for runs of a glyph,
+ * synchronized output around frames, margins for partial-width scrolls.
+ * Nothing waits for them: until then (or if the terminal never
+ * answers) frames are just encoded the baseline way.
  */
+#define _GNU_SOURCE                    /* fopencookie() */
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <termios.h>
+#include <errno.h>
+#include <poll.h>
+#include <stdio_ext.h>
+#include <stddef.h>
 #include <apex.h>
 #include <apex/log.h>
 #include <apex/estring.h>
 #include "xterminator.h"
+#include "twtrace.h"
+#include "twutf8.h"
 
 #ifdef DEBUG_TTY
 #define SO "<so>"
@@ -31,6 +86,19 @@
 #define ESC "\033"
 #endif /* DEBUG_TTY */
 
+#define XT_SHADOW_MAGIC 0x54774e32     /* "Twn2" */
+#define XT_SHADOW_FRAME (sizeof(XtShadow) + TWIN_STYLE_MAX * sizeof(TwinCell))
+#define XT_SHADOW_SIZE(rows, cols) \
+    (XT_SHADOW_FRAME + TWIN_FRAME_SIZE(rows, cols))
+
+#define XT_PROBE_TIMEOUT 500           /* ms to wait for DA1 */
+
+static const char xt_probe_cmd[] =     /* capability queries... */
+    ESC "P+q524742;5463;726570" ESC "\\"    /* XTGETTCAP: RGB, Tc, rep */
+    ESC "[?2026$p"                     /* DECRQM: synchronized output */
+    ESC "[?69$p"                       /* DECRQM: left/right margins */
+    ESC "[>c"                          /* DA2: terminal type, version */
+    ESC "[c";                          /* DA1: answered last, by everyone */
 static const char xt_init_cmd[] =      /* initialisation commands... */
     ESC "[!p"                          /* soft reset */
     ESC "[?3;4l"                       /* normal-width, jump scroll */
@@ -43,15 +111,132 @@ static const char xt_end_cmd[] = ESC "[?1049l"; /* restore cursor, screen */
 static const char xt_cup_cmd[] = ESC "[%d;%dH";
 static const char xt_clear_cmd[] = ESC "[2J";
 static const char xt_ed_cmd[] = ESC "[J";   /* ...to end of screen */
+static const char xt_home_cmd[] = ESC "[H";
+static const char xt_sgr_reset_cmd[] = ESC "[m" SI;    /* default style */
+static const char xt_stbm_cmd[] = ESC "[%d;%dr";  /* set scroll region */
+static const char xt_stbm_reset_cmd[] = ESC "[r";
+static const char xt_slrm_cmd[] = ESC "[?69h" ESC "[%d;%ds";    /* margins */
+static const char xt_slrm_reset_cmd[] = ESC "[s" ESC "[?69l";
+static const char xt_su_cmd[] = ESC "[%dS";   /* scroll up */
+static const char xt_sd_cmd[] = ESC "[%dT";   /* scroll down */
+static const char xt_rep_cmd[] = ESC "[%db"; /* repeat last glyph */
+static const char xt_bsu_cmd[] = ESC "[?2026h";    /* begin/end frame */
+static const char xt_esu_cmd[] = ESC "[?2026l";
 static const char xt_line_map[] = "~xqmxxltqjqvkuwn";
 static const char xt_fg_8_cmd[] = ESC "[3%dm";
 static const char xt_fg_256_cmd[] = ESC "[38;5;%dm";
 static const char xt_bg_8_cmd[] = ESC "[4%dm";
 static const char xt_bg_256_cmd[] = ESC "[48;5;%dm";
+static const char xt_fg_rgb_cmd[] = ESC "[38;2;%d;%d;%dm";
+static const char xt_bg_rgb_cmd[] = ESC "[48;2;%d;%d;%dm";
+
+#define XT_FLOW_BACKLOG 1024           /* tty queue (bytes) that defers frames */
+#define XT_FLOW_BLOCKED 2              /* flush time (ms) that means saturated */
+#define XT_FLOW_INTERVAL_MAX 1000      /* slowest frame pacing (ms) */
+#define XT_FLOW_RETRY 10               /* polling interval (ms) when backed up */
+#define XT_FRAME_BYTES(rows, cols) (4096 + (size_t) (rows) * (cols) * 8)
+#define XT_DRAIN_WAIT 1000             /* ms to wait for the tty, on close */
+
+#define XT_REFRESH_HOLD 32             /* windows held back per frame, at most */
+
+/*
+ * XtPass: --A prioritised window's damaged screen region.
+ */
+typedef struct XtPass_t
+{
+    TwinRegion area;
+    int priority;
+} XtPass;
+
+/*
+ * XtRefresh: --The windows whose damage a frame holds back, or orders.
+ */
+typedef struct XtRefresh_t
+{
+    uint64_t now;
+    uint64_t due;                      /* the first held window's slot */
+    TwinRegion damage;                 /* root's damage */
+    TwinRegion scroll;                 /* root's pending scroll, or empty */
+    TwinRegion held;                   /* bounds of the held regions */
+    int n_due;                         /* damaged windows with hints, due */
+    int n_hold;
+    TwinRegion hold[XT_REFRESH_HOLD];  /* held windows (screen, clipped) */
+    int n_pass;
+    XtPass pass[XT_REFRESH_HOLD];      /* prioritised windows, highest first */
+} XtRefresh;
+
+/*
+ * XtRow: --A compacted frame row (see xterm_compact()).
+ */
+struct XtRow_t
+{
+    struct XtRow_t *next;              /* hash chain */
+    uint32_t hash;
+    uint32_t refs;                     /* frames showing it */
+    uint32_t size;                     /* bytes of runs */
+    uint8_t runs[];                    /* see xterm_row_encode() */
+};
+
+#define XT_ROW_REPEAT 0x8000           /* run: one glyph, repeated */
+#define XT_ROW_SHORT 6                 /* repeats shorter go in literal runs */
+#define XT_ROW_MAX(columns) ((size_t) (columns) * 5)    /* worst case */
+
+static XtRow **xt_row_table;           /* interned rows, by hash */
+static size_t xt_n_row, xt_n_bucket;
+
+#define XT_LUT_BITS 5                  /* bits per channel in RGB LUT */
+#define XT_LUT_SIZE (1 << XT_LUT_BITS)
+static uint8_t xt_rgb_lut[XT_LUT_SIZE * XT_LUT_SIZE * XT_LUT_SIZE];
+static int xt_rgb_lut_ready;
 
 
 static int xterm_style(Xterminator * xterm, TwinCell style);
 static void xterm_cursor(Xterminator * xterm, int row, int column);
+static void xterm_scroll(Xterminator * xterm, TwinScroll scroll);
+static void xterm_init_rgb_lut(void);
+static int xterm_flow_ready(Xterminator * xterm, int count);
+static int xterm_flush_start(Xterminator * xterm);
+static void xterm_flush_end(Xterminator * xterm, int change);
+static int xterm_diff(Xterminator * xterm, TwinRegion region,
+                      const TwinRegion * skip, int n_skip, int *cut);
+static int xterm_sync_span(Xterminator * xterm, int r, int from, int to);
+static int xterm_put_cell(Xterminator * xterm, int r, int c);
+static int xterm_repaint(Xterminator * xterm);
+static int xterm_repaint_row(Xterminator * xterm, int r);
+static void xterm_refresh_init(Xterminator * xterm, XtRefresh * refresh);
+static void xterm_refresh_walk(XtRefresh * refresh, Twindow * twin,
+                               TwinCoordinate offset, int schedule);
+static int xterm_refresh_changed(const Twindow * twin);
+static int xterm_skip(const TwinRegion * skip, int n_skip,
+                      int row, int column);
+static inline int xterm_region_clip(TwinRegion * region, TwinRegion bound);
+static inline void xterm_region_union(TwinRegion * region, TwinRegion other);
+static void xterm_flow_flushed(Xterminator * xterm);
+static ssize_t xterm_out_write(void *cookie, const char *data, size_t size);
+static int xterm_out_drain(Xterminator * xterm, int wait);
+static void xterm_out_flush(Xterminator * xterm);
+static void xterm_shadow_style(Xterminator * xterm, TwinStyle style);
+static void xterm_shadow_glyph(Xterminator * xterm, uint8_t glyph);
+static void xterm_probe(Xterminator * xterm);
+static inline int xt_csi_cost(int n);
+static int xterm_shadow_name(Xterminator * xterm, char *name, size_t size,
+                             struct stat *tty);
+static int xterm_screen_wake(Xterminator * xterm);
+static inline void xterm_screen_row(Xterminator * xterm, int row);
+static size_t xterm_row_encode(const Twindow * twin, int row, uint8_t * runs);
+static inline int xterm_row_repeat(const TwinStyle * style,
+                                   const uint8_t * glyph, int column,
+                                   int columns);
+static void xterm_row_expand(Xterminator * xterm, int row);
+static void xterm_row_decode(const XtRow * row, TwinStyle * style,
+                             uint8_t * glyph);
+static int xterm_root_compact(Xterminator * xterm, uint8_t * runs);
+static int xterm_root_wake(Twindow * root);
+static int xterm_root_expand(Xterminator * xterm);
+static XtRow *xterm_row_intern(const uint8_t * runs, size_t size);
+static int xterm_row_grow(void);
+static void xterm_row_release(XtRow * row);
+static void xterm_compact_release(Xterminator * xterm);
 
 Xterminator *new_xterminator(int input, FILE * output)
 {
@@ -76,29 +261,83 @@ Xterminator *xterminator_init(Xterminator * xterm, int input, FILE * output)
     struct winsize size;
 
     if (ioctl(fileno(output), TIOCGWINSZ, &size) < 0)
-    {
-        log_sys(LOG_ERR, "cannot get window size");
+    {                                  /* not a tty: $LINES x $COLUMNS */
+        const char *rows = getenv("LINES");
+        const char *columns = getenv("COLUMNS");
+
+        debug("%s(): cannot get window size", __func__);
+        size.ws_row = (rows != NULL && atoi(rows) > 0) ? atoi(rows) : 24;
+        size.ws_col = (columns != NULL && atoi(columns) > 0)
+            ? atoi(columns) : 80;
     }
     debug("%s(): size: %d rows, %d cols", __func__, size.ws_row, size.ws_col);
 
     memset(xterm, 0, sizeof(*xterm));
     xterm->input = input;
-    xterm->output = output;
-    setvbuf(xterm->output, NULL, _IOFBF, 0);
+    xterm->tty = output;
+    size_t buffer_size = XT_FRAME_BYTES(size.ws_row, size.ws_col);
+    cookie_io_functions_t io = { NULL, xterm_out_write, NULL, NULL };
+
+    if ((xterm->buffer = malloc(buffer_size)) != NULL)
+    {                                  /* big enough for most frames */
+        xterm->buffer_alloc = buffer_size;
+        xterm->output = fopencookie(xterm, "w", io);
+    }
+    if (xterm->output == NULL)
+    {                                  /* fall back to stdio (see flushed) */
+        log_sys(LOG_ERR, "%s(): cannot buffer output", __func__);
+        xterm->output = output;
+        setvbuf(xterm->output, NULL, _IOFBF, 0);
+    }
+
+    const char *colorterm = getenv("COLORTERM");
+
+    if (colorterm != NULL
+        && (strcmp(colorterm, "truecolor") == 0
+            || strcmp(colorterm, "24bit") == 0))
+    {
+        xterm->features |= XtTrueColour;
+    }
+    xterm_init_rgb_lut();
 
     twin_init(&xterm->root,
               NULL, 0, 0, size.ws_row, size.ws_col,
-              malloc(size.ws_row * size.ws_col * sizeof(TwinCell)));
+              malloc(TWIN_FRAME_SIZE(size.ws_row, size.ws_col)));
     twin_init(&xterm->screen,
               NULL, 0, 0, size.ws_row, size.ws_col,
-              malloc(size.ws_row * size.ws_col * sizeof(TwinCell)));
+              malloc(TWIN_FRAME_SIZE(size.ws_row, size.ws_col)));
+    xterm->style_id = -1;
     return xterm;                      /* success */
 }
 
+/*
+ * open_xterminator() --Start using the terminal.
+ *
+ * Remarks:
+ * The tty's output mode is sampled here (rather than at init), so
+ * that any raw-mode setup done by the caller has taken effect; the
+ * cursor motion planner uses it to decide whether LF is usable.
+ */
 void open_xterminator(Xterminator * xterm)
 {
-    fputs(xt_init_cmd, xterm->output);
-    fflush(xterm->output);
+    struct termios tty;
+
+    xterm->features &= ~(XtNewlineKnown | XtNewlineReturn);
+    if (tcgetattr(fileno(xterm->tty), &tty) == 0)
+    {                                  /* LF is only safe if we know its mapping */
+        xterm->features |= XtNewlineKnown;
+        if ((tty.c_oflag & OPOST) && (tty.c_oflag & ONLCR))
+        {
+            xterm->features |= XtNewlineReturn;
+        }
+    }
+    if (!xterm->adopted)
+    {                                  /* (else: it's already set up) */
+        fputs(xt_init_cmd, xterm->output);
+        xterm->repaint = XtRepaintClear;
+    }
+    xterm_probe(xterm);
+    xterm_out_flush(xterm);
 }
 
 
@@ -115,6 +354,23 @@ void close_xterminator(Xterminator * xterm)
 
     xterm_style(xterm, no_style);
     fputs(xt_end_cmd, xterm->output);
+    fflush(xterm->output);
+    xterm_out_drain(xterm, 1);
+    if (xterm->probe.state == XtProbeSent)
+    {                                  /* don't leave replies for the shell */
+        tcflush(xterm->input, TCIFLUSH);
+    }
+    if (xterm->shadow != NULL)
+    {                                  /* the screen's gone: nothing to adopt */
+        char name[64];
+
+        xterm->shadow->state = XtShadowSyncing;
+        xterm->shadow->pid = 0;
+        if (xterm_shadow_name(xterm, name, sizeof(name), NULL) == 0)
+        {
+            shm_unlink(name);
+        }
+    }
 }
 
 
@@ -123,11 +379,34 @@ void close_xterminator(Xterminator * xterm)
  *
  * Returns: (int)
  * The number of changes.
+ *
+ * Remarks:
+ * Windows with a refresh hint (twin_set_refresh()) are flushed on
+ * their own schedule: damage in a window that has changed since it
+ * was last flushed, but whose next slot hasn't come, is held back,
+ * and everything else goes out now.  The held damage
+ * stays in root's damage (without TwinRegiond, which only flags new
+ * damage), until the first held slot or some new damage.  A held
+ * window that overlaps a pending scroll goes out anyway, since the
+ * scroll moves its cells on the screen.
+ *
+ * The rest goes out in priority order (twin_set_priority()): windows
+ * with a positive priority first, highest first, then everything
+ * else, then windows with a negative priority.  If the frame reaches
+ * the byte budget (flow.budget), it's cut short, and root keeps its
+ * damage: the next frame's diff carries on where this one stopped.
+ *
+ * The first frame after open_xterminator(), and after xterm_clear(),
+ * is a full repaint instead (see xterm_repaint()).
  */
 int xterm_sync(Xterminator * xterm)
 {
+    static const TwinCoordinate no_offset = { 0, 0 };
+    XtRefresh refresh;
+    TwinRegion skip[2 * XT_REFRESH_HOLD];
+    int n_skip;
     int change = 0;
-
+    int cut = 0;
 
     debug("%s(): position: %d, %d. size: %d, %d",
           __func__,
@@ -138,135 +417,2625 @@ int xterm_sync(Xterminator * xterm)
           xterm->root.damage.min.row, xterm->root.damage.min.column,
           xterm->root.damage.max.row, xterm->root.damage.max.column);
 
-    if (!(xterm->root.state & TwinRegiond))
+    if (xterm->repaint != XtRepaintNone)
+    {                                  /* the screen frame's no use: redraw */
+        if ((change = xterm_repaint(xterm)) < 0)
+        {
+            return 0;
+        }
+        xterm_refresh_init(xterm, &refresh);
+        refresh.damage.min.row = refresh.damage.min.column = 0;
+        refresh.damage.max.row = xterm->root.geometry.size.row - 1;
+        refresh.damage.max.column = xterm->root.geometry.size.column - 1;
+        xterm_refresh_walk(&refresh, &xterm->root, no_offset, 1);
+        twin_reset(&xterm->root);      /* (the windows' slots are taken) */
+        xterm->flow.held_due = 0;
+        return change;
+    }
+    if (!(xterm->root.state & TwinRegiond)
+        && (xterm->flow.held_due == 0 || twin_clock() < xterm->flow.held_due))
+    {
+        return 0;                      /* nothing is damaged (or due) */
+    }
+    xterm_refresh_init(xterm, &refresh);
+    xterm_refresh_walk(&refresh, &xterm->root, no_offset, 0);
+    if (!xterm_flush_start(xterm))
+    {
+        return 0;                      /* backed up: keep root's damage */
+    }
+    memcpy(skip, refresh.hold, (size_t) refresh.n_hold * sizeof(TwinRegion));
+    n_skip = refresh.n_hold;
+    for (int i = 0; i < refresh.n_pass && !cut; ++i)
+    {                                  /* important windows first */
+        if (refresh.pass[i].priority > 0)
+        {
+            change += xterm_diff(xterm, refresh.pass[i].area,
+                                 refresh.hold, refresh.n_hold, &cut);
+        }
+        skip[n_skip++] = refresh.pass[i].area;  /* (done, or done later) */
+    }
+    if (!cut)
     {
-        return change;                 /* nothing is damaged */
+        change += xterm_diff(xterm, xterm->root.damage, skip, n_skip, &cut);
+    }
+    for (int i = 0; i < refresh.n_pass && !cut; ++i)
+    {                                  /* ...and unimportant ones last */
+        if (refresh.pass[i].priority < 0)
+        {
+            change += xterm_diff(xterm, refresh.pass[i].area,
+                                 refresh.hold, refresh.n_hold, &cut);
+        }
     }
+    xterm_flush_end(xterm, change);
 
-    for (int r = xterm->root.damage.min.row; r <= xterm->root.damage.max.row;
-         ++r)
+    if (cut)
+    {                                  /* keep it all: (and the slots) */
+        xterm->root.state &= ~TwinScrolled;
+        debug("%s(): %d changes, cut at %zu bytes", __func__, change,
+              xterm->flow.bytes);
+        return change;
+    }
+    if (refresh.n_due > 0 || refresh.n_pass > 0)
+    {                                  /* take slots, and mark what went out */
+        refresh.n_hold = refresh.n_pass = 0;
+        xterm_refresh_walk(&refresh, &xterm->root, no_offset, 1);
+    }
+    if (refresh.n_hold > 0)
+    {
+        xterm->root.damage = refresh.held;
+        xterm->root.state &= ~(TwinRegiond | TwinScrolled);
+        xterm->flow.held_due = refresh.due;
+    }
+    else
     {
-        for (int c = xterm->root.damage.min.column;
-             c <= xterm->root.damage.max.column; ++c)
-        {                              /* TODO: optimise for trailing space? */
-            int offset = twin_cell(xterm->root.geometry, r, c);
-            TwinCell cell = xterm->root.frame[offset];
+        twin_reset(&xterm->root);
+        xterm->flow.held_due = 0;
+    }
+    debug("%s(): %d changes, %d windows held", __func__, change,
+          refresh.n_hold);
+    return change;
+}
 
-            if (memcmp(&cell, &xterm->screen.frame[offset], sizeof(TwinCell))
-                == 0)
-            {
-                continue;
-            }
-            xterm_cursor(xterm, r, c);
-            xterm_style(xterm, cell);
 
-            if ((cell.attr & TwinAlt) && cell.ch < 16)
-            {                          /* line graphic */
-                fputc(xt_line_map[cell.ch], xterm->output);
-            }
-            else
-            {
-                fputc(cell.ch, xterm->output);
-            }
-            /* note: raw assignment avoids twin_set_cell()'s damage control */
-            xterm->screen.frame[offset] = xterm->root.frame[offset];
-            xterm->screen.cursor.column += 1;
-            ++change;
-#ifdef DEBUG_TTY
-            fputc('\n', xterm->output);
-#endif /* DEBUG_TTY */
+/*
+ * xterm_sync_region() --Render the changes in part of the screen.
+ *
+ * Parameters:
+ * xterm    --the terminal
+ * region   --the screen region to bring up to date
+ *
+ * Returns: (int)
+ * The number of changes.
+ *
+ * Remarks:
+ * This ignores refresh hints and priorities: it's for a caller that
+ * knows a region (e.g. a 60 Hz sparkline) must go out now, without
+ * dragging along whatever else happens to be damaged.  The rest of
+ * root's damage is kept for the next sync, trimmed if the region spans
+ * its full width or height.  A pending scroll is always sent, with the
+ * rows it moves.  The byte budget still applies.  If the screen needs
+ * a repaint (e.g. after a resize, or a frame lost to EAGAIN), that's
+ * done instead, as by xterm_sync().
+ */
+int xterm_sync_region(Xterminator * xterm, TwinRegion region)
+{
+    TwinRegion *damage = &xterm->root.damage;
+    int change;
+    int cut = 0;
+
+    if (xterm->repaint != XtRepaintNone)
+    {                                  /* the screen frame's no use... */
+        return xterm_sync(xterm);      /* ...so repaint all of it */
+    }
+    if (!(xterm->root.state & TwinRegiond) && xterm->flow.held_due == 0)
+    {
+        return 0;                      /* nothing is damaged */
+    }
+    if ((xterm->root.state & TwinScrolled) && xterm->root.scroll.n != 0)
+    {
+        xterm_region_union(&region, xterm->root.scroll.region);
+    }
+    if (!xterm_region_clip(&region, *damage))
+    {
+        return 0;                      /* ...there */
+    }
+    if (!xterm_flush_start(xterm))
+    {
+        return 0;
+    }
+    change = xterm_diff(xterm, region, NULL, 0, &cut);
+    xterm_flush_end(xterm, change);
+    xterm->root.state &= ~TwinScrolled;
+    if (cut)
+    {
+        return change;
+    }
+    if (region.min.column == damage->min.column
+        && region.max.column == damage->max.column)
+    {                                  /* full width: trim the rows sent */
+        if (region.min.row == damage->min.row)
+        {
+            damage->min.row = region.max.row + 1;
+        }
+        else if (region.max.row == damage->max.row)
+        {
+            damage->max.row = region.min.row - 1;
         }
     }
-    fflush(xterm->output);
-    twin_reset(&xterm->root);
-    debug("%s(): %d changes", __func__, change);
+    else if (region.min.row == damage->min.row
+             && region.max.row == damage->max.row)
+    {                                  /* full height: trim the columns */
+        if (region.min.column == damage->min.column)
+        {
+            damage->min.column = region.max.column + 1;
+        }
+        else if (region.max.column == damage->max.column)
+        {
+            damage->max.column = region.min.column - 1;
+        }
+    }
+    if (damage->min.row > damage->max.row
+        || damage->min.column > damage->max.column)
+    {
+        twin_reset(&xterm->root);
+        xterm->flow.held_due = 0;
+    }
     return change;
 }
 
-static int xterm_style(Xterminator * xterm, TwinCell style)
+
+/*
+ * xterm_repaint() --Clear the terminal, and draw all of root on it.
+ *
+ * Returns: (int)
+ * The number of changes, or -1 if the link is backed up.
+ *
+ * Remarks:
+ * This is for when the screen frame doesn't describe the terminal
+ * (at startup, or after something else has written to it): rather
+ * than diffing against it, the screen's cleared once, in the default
+ * style, and only root's non-blank content is drawn.  Each row is
+ * drawn a style at a time (see xterm_repaint_row()).  Held windows,
+ * priorities and the byte budget don't apply: it's all one frame.
+ */
+static int xterm_repaint(Xterminator * xterm)
 {
+    static const TwinCell default_style = {
+        TWIN_DEFAULT_COLOUR, TWIN_DEFAULT_COLOUR, TwinNormal, ' ', 0
+    };
+    Twindow *screen = &xterm->screen;
+    size_t n = (size_t) screen->geometry.size.row * screen->geometry.size.column;
     int change = 0;
-    TwinCell screen_style = xterm->screen.style;
 
-    xterm->screen.style = style;
-    if (screen_style.attr != style.attr)
-    {                                  /* adjust attributes */
-        if ((screen_style.attr & TwinAlt) != (style.attr & TwinAlt))
-        {                              /* handle alt. character set */
-            fputs((style.attr & TwinAlt) ? SO : SI, xterm->output);
-            change = 1;
-        }
-        screen_style.attr &= ~TwinAlt; /* clear ACS differences */
-        style.attr &= ~TwinAlt;
+    xterm->root.state &= ~TwinScrolled; /* (it's all redrawn) */
+    if (!xterm_flush_start(xterm))
+    {
+        return -1;
+    }
+    xterm_compact_release(xterm);
+    if (xterm->repaint == XtRepaintReset)
+    {                                  /* the terminal's state is unknown */
+        fputs(xt_sgr_reset_cmd, xterm->output);
+        fputs(xt_home_cmd, xterm->output);
+        fputs(xt_ed_cmd, xterm->output);
+        screen->style = default_style;
+        screen->cursor.row = screen->cursor.column = 0;
+    }
+    else
+    {                                  /* (erased in the current background) */
+        xterm_style(xterm, default_style);
+        fputs(xt_clear_cmd, xterm->output);
+    }
+    xterm->style_id = TWIN_STYLE_BLANK;
+    xterm_shadow_style(xterm, TWIN_STYLE_BLANK);
+    memset(screen->styles, 0, n * sizeof(TwinStyle));   /* TWIN_STYLE_BLANK */
+    memset(screen->glyphs, ' ', n);
 
-        if (screen_style.attr != style.attr)
-        {                              /* handle misc. other attributes */
-            fputs(ESC "[", xterm->output);
-            for (int i = 0; i < 8; ++i)
+    for (int r = 0; r < screen->geometry.size.row; ++r)
+    {
+        change += xterm_repaint_row(xterm, r);
+    }
+    xterm_flush_end(xterm, change);
+    xterm->repaint = XtRepaintNone;
+    debug("%s(): %d changes, %zu bytes", __func__, change, xterm->flow.bytes);
+    return change;
+}
+
+
+/*
+ * xterm_repaint_row() --Draw a row's non-blank cells, a style at a time.
+ *
+ * Returns: (int)
+ * The number of changes.
+ *
+ * Remarks:
+ * The spans in the current style go first (so a row usually starts
+ * in the style the previous one ended in), then those of the leftmost
+ * style left, and so on; the cursor skips over the other styles' cells
+ * and any default blanks.  Cells that are done compare equal to the
+ * (cleared) screen frame, so there's nothing to keep track of.
+ */
+static int xterm_repaint_row(Xterminator * xterm, int r)
+{
+    int columns = xterm->root.geometry.size.column;
+    int offset = twin_cell(xterm->root.geometry, r, 0);
+    const uint8_t *glyph = &xterm->root.glyphs[offset];
+    const TwinStyle *style = &xterm->root.styles[offset];
+    const uint8_t *screen_glyph = &xterm->screen.glyphs[offset];
+    const TwinStyle *screen_style = &xterm->screen.styles[offset];
+    int change = 0;
+
+#define XT_DIFFERS(c) \
+    (glyph[c] != screen_glyph[c] || style[c] != screen_style[c])
+    for (;;)
+    {
+        int first = -1;
+        int next = -1;
+
+        for (int c = 0; c < columns; ++c)
+        {                              /* pick the style to draw next */
+            if (XT_DIFFERS(c))
             {
-                if (style.attr & (1 << i))
-                {                      /* note: first ';' clears attributes */
-                    fprintf(xterm->output, ";%d", i + 1);
+                first = (first < 0) ? c : first;
+                if (style[c] == xterm->style_id)
+                {
+                    next = style[c];
+                    break;
                 }
             }
-            fputc('m', xterm->output);
-            screen_style.fg = TWIN_DEFAULT_COLOUR;  /* mode changes reset fg, bg */
-            screen_style.bg = TWIN_DEFAULT_COLOUR;
-            change = 1;
-        }
-    }
-
-    if (screen_style.fg != style.fg)
-    {                                  /* adjust foreground colour */
-        if (style.fg <= 9)
-        {
-            fprintf(xterm->output, xt_fg_8_cmd, style.fg);
         }
-        else
-        {
-            fprintf(xterm->output, xt_fg_256_cmd, style.fg);
-        }
-        change = 1;
-    }
-    if (screen_style.bg != style.bg)
-    {                                  /* adjust background too */
-        if (style.bg <= 9)
+        if (first < 0)
         {
-            fprintf(xterm->output, xt_bg_8_cmd, style.bg);
+            break;                     /* row's done */
         }
-        else
-        {
-            fprintf(xterm->output, xt_bg_256_cmd, style.bg);
+        next = (next < 0) ? style[first] : next;
+        for (int c = first; c < columns; ++c)
+        {                              /* draw its spans, left to right */
+            int to = c;
+
+            if (style[c] != next || !XT_DIFFERS(c))
+            {
+                continue;
+            }
+            for (int i = c + 1; i < columns && style[i] == next; ++i)
+            {
+                to = XT_DIFFERS(i) ? i : to;
+            }
+            change += xterm_sync_span(xterm, r, c, to);
+            c = to;
         }
-        change = 1;
     }
+#undef XT_DIFFERS
     return change;
 }
 
-static void xterm_cursor(Xterminator * xterm, int row, int column)
+
+/*
+ * xterm_flush_start() --Start a frame, if the link can take one.
+ *
+ * Returns: (int)
+ * 1: go ahead, diff and then xterm_flush_end(); 0: the link is
+ * backed up.
+ */
+static int xterm_flush_start(Xterminator * xterm)
 {
-    if (xterm->screen.cursor.row == row
-        && xterm->screen.cursor.column == column)
+    if (!xterm_flow_ready(xterm, 1) || !xterm_screen_wake(xterm)
+        || !xterm_root_expand(xterm))
     {
-        return;                        /* we're already there */
+        return 0;
     }
-    /* TODO: logic to move cursor efficiently on same row */
-    fprintf(xterm->output, xt_cup_cmd, row + 1, column + 1);
-    xterm->screen.cursor.row = row;
-    xterm->screen.cursor.column = column;
+    TWIN_TRACE(TwinTraceSyncStart);
+    xterm->flow.emitted = 0;
+    if (xterm->shadow != NULL)
+    {
+        xterm->shadow->state = XtShadowSyncing;
+    }
+    if (xterm->features & XtSyncOutput)
+    {                                  /* terminal shows the frame at once */
+        fputs(xt_bsu_cmd, xterm->output);
+    }
+    if ((xterm->root.state & TwinScrolled) && xterm->root.scroll.n != 0)
+    {
+        xterm_scroll(xterm, xterm->root.scroll);
+    }
+    return 1;
 }
 
 
+/*
+ * xterm_flush_end() --Finish a frame, and flush it.
+ *
+ * Remarks:
+ * Root's damage is left to the caller.
+ */
+static void xterm_flush_end(Xterminator * xterm, int change)
+{
+    if (xterm->features & XtSyncOutput)
+    {
+        fputs(xt_esu_cmd, xterm->output);
+    }
+    TWIN_TRACE(TwinTraceEncodeEnd);
+    xterm->flow.changes = change;
+    xterm_flow_flushed(xterm);
+    if (xterm->shadow != NULL)
+    {                                  /* clean, if it all went out */
+        xterm->shadow->cursor = xterm->screen.cursor;
+        xterm->shadow->style = xterm->screen.style;
+        xterm->shadow->state = xterm->flow.blocked
+            ? XtShadowSyncing : XtShadowClean;
+    }
+}
 
 
 /*
- * free_xterminator() --Release any resources used by a Xterminator.
+ * xterm_diff() --Send the changes in a region.
+ *
+ * Parameters:
+ * xterm    --the terminal
+ * region   --the (damaged) screen region to diff
+ * skip     --screen regions to leave (held, or sent separately)
+ * n_skip   --the number of regions to skip
+ * cut      --set if the byte budget ran out
+ *
+ * Returns: (int)
+ * The number of changes.
+ *
+ * Remarks:
+ * Skipped cells just aren't diffed, so the screen frame still
+ * describes what's on the screen.  The budget is checked a row at a
+ * time, so a frame can overrun it by a row's worth of output.  The
+ * bytes are counted as stdio hands them to our buffer, so without
+ * one (if fopencookie() failed) there's no budget.
  */
-void free_xterminator(Xterminator * xterm)
+static int xterm_diff(Xterminator * xterm, TwinRegion region,
+                      const TwinRegion * skip, int n_skip, int *cut)
 {
-    if (xterm->screen.frame != NULL)
+    size_t budget = xterm->flow.budget;
+    int change = 0;
+
+    for (int r = region.min.row; r <= region.max.row; ++r)
     {
-        free(xterm->screen.frame);
+        int from = xterm_skip(skip, n_skip, r, region.min.column);
+
+        if (budget != 0 && xterm->output != xterm->tty)
+        {
+            fflush(xterm->output);     /* (just into our buffer) */
+            if (xterm->flow.emitted >= budget)
+            {
+                *cut = 1;
+                break;
+            }
+        }
+        while (from <= region.max.column)
+        {                              /* send the spans between skipped ones */
+            int to = region.max.column;
+
+            for (int i = 0; i < n_skip; ++i)
+            {
+                if (r >= skip[i].min.row && r <= skip[i].max.row
+                    && skip[i].min.column > from && skip[i].min.column <= to)
+                {
+                    to = skip[i].min.column - 1;
+                }
+            }
+            change += xterm_sync_span(xterm, r, from, to);
+            from = xterm_skip(skip, n_skip, r, to + 1);
+        }
+    }
+    return change;
+}
+
+
+/*
+ * xterm_put_cell() --Send a cell of root, at the cursor.
+ *
+ * Returns: (int)
+ * The number of columns written: 2 for a wide character (and its
+ * TWIN_GLYPH_WIDE column), otherwise 1.
+ *
+ * Remarks:
+ * Interned glyphs are sent as UTF-8.  A wide character without its
+ * second column (e.g. clipped by a window's edge) is sent as
+ * TWIN_UTF8_REPLACEMENT, and a second column without its character
+ * as a space, as a terminal would show them.
+ */
+static int xterm_put_cell(Xterminator * xterm, int r, int c)
+{
+    int offset = twin_cell(xterm->root.geometry, r, c);
+    uint8_t glyph = xterm->root.glyphs[offset];
+    TwinStyle style = xterm->root.styles[offset];
+    int n = 1;
+
+    if (style != xterm->style_id)
+    {                                  /* style changes are rare: by id */
+        xterm_style(xterm, twin_style_cell(style));
+        xterm->style_id = style;
+        xterm_shadow_style(xterm, style);
+    }
+    if ((xterm->screen.style.attr & TwinAlt) && glyph < 16)
+    {                                  /* line graphic */
+        fputc(xt_line_map[glyph], xterm->output);
+    }
+    else if (glyph < TWIN_GLYPH_WIDE)
+    {
+        fputc(glyph, xterm->output);
+    }
+    else if (glyph == TWIN_GLYPH_WIDE)
+    {
+        fputc(' ', xterm->output);     /* (its character was overwritten) */
+    }
+    else
+    {
+        char utf8[4];
+        int width = 1;
+        uint32_t cp = twin_utf8_codepoint(glyph, &width);
+
+        if (width == 2
+            && (c + 1 >= xterm->root.geometry.size.column
+                || xterm->root.glyphs[offset + 1] != TWIN_GLYPH_WIDE))
+        {
+            cp = 0;                    /* no room for it */
+        }
+        if (cp == 0)
+        {
+            fputc(TWIN_UTF8_REPLACEMENT, xterm->output);
+        }
+        else
+        {
+            fwrite(utf8, 1, (size_t) twin_utf8_encode(cp, utf8),
+                   xterm->output);
+            xterm_shadow_glyph(xterm, glyph);
+            n = width;
+        }
+    }
+    /* note: raw assignment avoids twin_set_cell()'s damage control */
+    memcpy(&xterm->screen.glyphs[offset], &xterm->root.glyphs[offset],
+           (size_t) n);
+    memcpy(&xterm->screen.styles[offset], &xterm->root.styles[offset],
+           (size_t) n * sizeof(TwinStyle));
+    xterm->screen.cursor.column += n;
+    return n;
+}
+
+
+/*
+ * xterm_sync_span() --Send the changed cells in part of a row.
+ *
+ * Returns: (int)
+ * The number of changes.
+ *
+ * Remarks:
+ * Writing over either column of a wide character on the screen
+ * erases both, so the other column is rewritten too, even if root
+ * hasn't changed it (or it's outside the span).
+ */
+static int xterm_sync_span(Xterminator * xterm, int r, int from, int to)
+{
+    int columns = xterm->root.geometry.size.column;
+    int offset = twin_cell(xterm->root.geometry, r, 0);
+    const uint8_t *glyph = &xterm->root.glyphs[offset];
+    const TwinStyle *style = &xterm->root.styles[offset];
+    uint8_t *screen_glyph;
+    TwinStyle *screen_style;
+    int change = 0;
+
+    xterm_screen_row(xterm, r);
+    screen_glyph = &xterm->screen.glyphs[offset];
+    screen_style = &xterm->screen.styles[offset];
+
+    for (int c = from; c <= to;)
+    {                                  /* TODO: optimise for trailing space? */
+        int n;
+
+        if (glyph[c] == screen_glyph[c] && style[c] == screen_style[c])
+        {
+            ++c;
+            continue;
+        }
+        if (c > 0 && screen_glyph[c] == TWIN_GLYPH_WIDE
+            && screen_glyph[c - 1] >= TWIN_GLYPH_EXT)
+        {                              /* its 2nd column: go back */
+            --c;
+        }
+        xterm_cursor(xterm, r, c);
+        n = xterm_put_cell(xterm, r, c);
+        if (c + n < columns && screen_glyph[c + n] == TWIN_GLYPH_WIDE)
+        {                              /* ...we erased its other half */
+            n += xterm_put_cell(xterm, r, c + n);
+        }
+        change += n;
+        c += n;
+
+        if ((xterm->features & XtRepeat) && glyph[c - 1] < TWIN_GLYPH_WIDE)
+        {                              /* a run of this glyph: REP it */
+            int k = 0;
+
+            while (c + k <= to && glyph[c + k] == glyph[c - 1]
+                   && style[c + k] == style[c - 1]
+                   && screen_glyph[c + k] < TWIN_GLYPH_WIDE)
+            {
+                ++k;
+            }
+            if (k > xt_csi_cost(k))
+            {                          /* (else: the diff does them) */
+                fprintf(xterm->output, xt_rep_cmd, k);
+                memset(screen_glyph + c, glyph[c - 1], (size_t) k);
+                for (int i = 0; i < k; ++i)
+                {
+                    screen_style[c + i] = style[c - 1];
+                }
+                xterm->screen.cursor.column += k;
+                change += k;
+                c += k;
+            }
+        }
+#ifdef DEBUG_TTY
+        fputc('\n', xterm->output);
+#endif /* DEBUG_TTY */
+    }
+    return change;
+}
+
+
+/*
+ * xterm_refresh_init() --Start collecting the windows to hold back/order.
+ */
+static void xterm_refresh_init(Xterminator * xterm, XtRefresh * refresh)
+{
+    memset(refresh, 0, sizeof(*refresh));
+    refresh->now = twin_clock();
+    refresh->due = UINT64_MAX;
+    refresh->damage = xterm->root.damage;
+    refresh->scroll.min.row = refresh->scroll.min.column = 0;
+    refresh->scroll.max.row = refresh->scroll.max.column = -1;  /* none */
+    if ((xterm->root.state & TwinScrolled) && xterm->root.scroll.n != 0)
+    {
+        refresh->scroll = xterm->root.scroll.region;
+    }
+}
+
+
+/*
+ * xterm_refresh_walk() --Find the damaged windows to hold back, or order.
+ *
+ * Parameters:
+ * refresh  --collects the held, and the prioritised, windows' regions
+ * twin     --the window whose children to visit
+ * offset   --twin's position on the screen
+ * schedule --if set, move the windows that are due to their next slot
+ *
+ * Remarks:
+ * This follows the window tree the way twin_compose() does.  A held
+ * window's children are held with it (they're usually inside it); a
+ * prioritised window's children go with it, unless they have their
+ * own priority.  Only windows that have changed since they were last
+ * flushed count (see xterm_refresh_changed()): root's damage is one
+ * box, so a quiet window inside it isn't held, or put first.  When
+ * scheduling, the windows that go out are marked as flushed.
+ */
+static void xterm_refresh_walk(XtRefresh * refresh, Twindow * twin,
+                               TwinCoordinate offset, int schedule)
+{
+    for (Twindow * child = twin->child; child != NULL;
+         child = child->sibling)
+    {
+        TwinCoordinate position = {
+            offset.row + child->geometry.position.row,
+            offset.column + child->geometry.position.column
+        };
+        TwinRegion area = {
+            position, {position.row + child->geometry.size.row - 1,
+                       position.column + child->geometry.size.column - 1}
+        };
+        int damaged = xterm_region_clip(&area, refresh->damage);
+
+        if (!damaged || (child->refresh == 0 && child->priority == 0)
+            || !xterm_refresh_changed(child))
+        {                              /* (not damaged, no hints, or quiet) */
+            if (schedule && damaged)
+            {
+                child->flushed = child->generation;
+            }
+            xterm_refresh_walk(refresh, child, position, schedule);
+            continue;
+        }
+        if (child->refresh > 0)
+        {
+            TwinRegion scrolled = refresh->scroll;
+
+            if (child->refresh_due > refresh->now
+                && refresh->n_hold < XT_REFRESH_HOLD
+                && !xterm_region_clip(&scrolled, area))
+            {
+                if (refresh->n_hold++ == 0)
+                {
+                    refresh->held = area;
+                }
+                xterm_region_union(&refresh->held, area);
+                refresh->hold[refresh->n_hold - 1] = area;
+                if (child->refresh_due < refresh->due)
+                {
+                    refresh->due = child->refresh_due;
+                }
+                continue;
+            }
+            refresh->n_due += 1;
+            if (schedule)
+            {
+                child->refresh_due = refresh->now + (uint64_t) child->refresh;
+            }
+        }
+        if (schedule)
+        {
+            child->flushed = child->generation;
+        }
+        if (child->priority != 0 && refresh->n_pass < XT_REFRESH_HOLD)
+        {                              /* insert, highest priority first */
+            int i = refresh->n_pass++;
+
+            for (; i > 0 && refresh->pass[i - 1].priority < child->priority;
+                 --i)
+            {
+                refresh->pass[i] = refresh->pass[i - 1];
+            }
+            refresh->pass[i].area = area;
+            refresh->pass[i].priority = child->priority;
+        }
+        xterm_refresh_walk(refresh, child, position, schedule);
+    }
+}
+
+
+/*
+ * xterm_refresh_changed() --Check if a window has changed since flushed.
+ *
+ * Remarks:
+ * A window's children are part of it, except those with their own
+ * refresh hint, which are held (or not) by themselves.
+ */
+static int xterm_refresh_changed(const Twindow * twin)
+{
+    if (twin->generation != twin->flushed)
+    {
+        return 1;
+    }
+    for (const Twindow * child = twin->child; child != NULL;
+         child = child->sibling)
+    {
+        if (child->refresh == 0 && xterm_refresh_changed(child))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+/*
+ * xterm_skip() --Skip past any skipped spans at a cell.
+ *
+ * Returns: (int)
+ * The first column from column on that isn't skipped.
+ */
+static int xterm_skip(const TwinRegion * skip, int n_skip, int row,
+                      int column)
+{
+    for (int i = 0; i < n_skip; ++i)
+    {
+        if (row >= skip[i].min.row && row <= skip[i].max.row
+            && column >= skip[i].min.column && column <= skip[i].max.column)
+        {
+            column = skip[i].max.column + 1;
+            i = -1;                    /* (spans may be in any order) */
+        }
+    }
+    return column;
+}
+
+
+/*
+ * xterm_region_clip() --Clip a region to a bound.
+ *
+ * Returns: (int)
+ * 1 if anything's left, 0 if the region is outside the bound.
+ */
+static inline int xterm_region_clip(TwinRegion * region, TwinRegion bound)
+{
+    region->min.row = (region->min.row < bound.min.row)
+        ? bound.min.row : region->min.row;
+    region->min.column = (region->min.column < bound.min.column)
+        ? bound.min.column : region->min.column;
+    region->max.row = (region->max.row > bound.max.row)
+        ? bound.max.row : region->max.row;
+    region->max.column = (region->max.column > bound.max.column)
+        ? bound.max.column : region->max.column;
+    return region->min.row <= region->max.row
+        && region->min.column <= region->max.column;
+}
+
+
+static inline void xterm_region_union(TwinRegion * region, TwinRegion other)
+{
+    region->min.row = (other.min.row < region->min.row)
+        ? other.min.row : region->min.row;
+    region->min.column = (other.min.column < region->min.column)
+        ? other.min.column : region->min.column;
+    region->max.row = (other.max.row > region->max.row)
+        ? other.max.row : region->max.row;
+    region->max.column = (other.max.column > region->max.column)
+        ? other.max.column : region->max.column;
+}
+
+
+/*
+ * xterm_init_rgb_lut() --Build the RGB -> xterm-256 lookup table.
+ *
+ * Remarks:
+ * Each entry is the nearest (euclidean) colour from either the 6x6x6
+ * colour cube or the 24-step grey ramp, for the centre of its cell.
+ * The cube is separable, so its nearest entry is the nearest level on
+ * each axis; the nearest grey is the one nearest to the channel mean.
+ * The system colours (0-15) are skipped: their RGB values vary by
+ * terminal.
+ */
+static void xterm_init_rgb_lut(void)
+{
+    static const int cube_level[] = { 0, 95, 135, 175, 215, 255 };
+    const int shift = 8 - XT_LUT_BITS;
+    const int half = 1 << (7 - XT_LUT_BITS);   /* centre of LUT cell */
+    int nearest_level[XT_LUT_SIZE];
+    uint8_t *lut = xt_rgb_lut;
+
+    if (xt_rgb_lut_ready)
+    {
+        return;                        /* already built */
+    }
+    for (int i = 0; i < XT_LUT_SIZE; ++i)
+    {                                  /* nearest cube level, per axis */
+        int value = (i << shift) + half;
+        int best = 0;
+
+        for (int l = 1; l < (int) NEL(cube_level); ++l)
+        {
+            if (abs(cube_level[l] - value) < abs(cube_level[best] - value))
+            {
+                best = l;
+            }
+        }
+        nearest_level[i] = best;
+    }
+
+    for (int r = 0; r < XT_LUT_SIZE; ++r)
+    {
+        for (int g = 0; g < XT_LUT_SIZE; ++g)
+        {
+            for (int b = 0; b < XT_LUT_SIZE; ++b)
+            {
+                int rv = (r << shift) + half;
+                int gv = (g << shift) + half;
+                int bv = (b << shift) + half;
+                int lr = nearest_level[r];
+                int lg = nearest_level[g];
+                int lb = nearest_level[b];
+                int dr = cube_level[lr] - rv;
+                int dg = cube_level[lg] - gv;
+                int db = cube_level[lb] - bv;
+                int cube_dist = dr * dr + dg * dg + db * db;
+                int grey = ((rv + gv + bv) / 3 - 8 + 5) / 10;
+
+                grey = (grey < 0) ? 0 : (grey > 23) ? 23 : grey;
+                int gl = 8 + 10 * grey;
+                int grey_dist = (gl - rv) * (gl - rv)
+                    + (gl - gv) * (gl - gv) + (gl - bv) * (gl - bv);
+
+                *lut++ = (uint8_t) ((grey_dist < cube_dist)
+                                    ? 232 + grey
+                                    : 16 + 36 * lr + 6 * lg + lb);
+            }
+        }
+    }
+    xt_rgb_lut_ready = 1;
+}
+
+
+/*
+ * xterm_colour_256() --Map a colour to its nearest xterm-256 palette index.
+ *
+ * Parameters:
+ * colour   --a palette index, or an RGB colour
+ *
+ * Returns: (uint8_t)
+ * The palette index; palette colours are returned unchanged.
+ */
+uint8_t xterm_colour_256(TwinColour colour)
+{
+    if (!TWIN_IS_RGB(colour))
+    {
+        return (uint8_t) colour;
+    }
+    xterm_init_rgb_lut();
+    return xt_rgb_lut[((TWIN_RED(colour) >> (8 - XT_LUT_BITS))
+                       << (2 * XT_LUT_BITS))
+                      | ((TWIN_GREEN(colour) >> (8 - XT_LUT_BITS))
+                         << XT_LUT_BITS)
+                      | (TWIN_BLUE(colour) >> (8 - XT_LUT_BITS))];
+}
+
+
+/*
+ * xterm_colour() --Reduce a colour to what the terminal can display.
+ */
+static inline TwinColour xterm_colour(Xterminator * xterm, TwinColour colour)
+{
+    if (TWIN_IS_RGB(colour) && !(xterm->features & XtTrueColour))
+    {
+        return xterm_colour_256(colour);
+    }
+    return colour;
+}
+
+
+/*
+ * xterm_put_colour() --Output the SGR sequence for a (reduced) colour.
+ */
+static void xterm_put_colour(Xterminator * xterm, TwinColour colour,
+                             const char *cmd_8, const char *cmd_256,
+                             const char *cmd_rgb)
+{
+    if (TWIN_IS_RGB(colour))
+    {
+        fprintf(xterm->output, cmd_rgb, (int) TWIN_RED(colour),
+                (int) TWIN_GREEN(colour), (int) TWIN_BLUE(colour));
+    }
+    else if (colour <= 9)
+    {
+        fprintf(xterm->output, cmd_8, (int) colour);
+    }
+    else
+    {
+        fprintf(xterm->output, cmd_256, (int) colour);
+    }
+}
+
+
+static int xterm_style(Xterminator * xterm, TwinCell style)
+{
+    int change = 0;
+    TwinCell screen_style = xterm->screen.style;
+
+    xterm->style_id = -1;              /* (xterm_sync() sets it, after) */
+    style.fg = xterm_colour(xterm, style.fg);
+    style.bg = xterm_colour(xterm, style.bg);
+    xterm->screen.style = style;
+    if (screen_style.attr != style.attr)
+    {                                  /* adjust attributes */
+        if ((screen_style.attr & TwinAlt) != (style.attr & TwinAlt))
+        {                              /* handle alt. character set */
+            fputs((style.attr & TwinAlt) ? SO : SI, xterm->output);
+            change = 1;
+        }
+        screen_style.attr &= ~TwinAlt; /* clear ACS differences */
+        style.attr &= ~TwinAlt;
+
+        if (screen_style.attr != style.attr)
+        {                              /* handle misc. other attributes */
+            fputs(ESC "[", xterm->output);
+            for (int i = 0; i < 8; ++i)
+            {
+                if (style.attr & (1 << i))
+                {                      /* note: first ';' clears attributes */
+                    fprintf(xterm->output, ";%d", i + 1);
+                }
+            }
+            fputc('m', xterm->output);
+            screen_style.fg = TWIN_DEFAULT_COLOUR;  /* mode changes reset fg, bg */
+            screen_style.bg = TWIN_DEFAULT_COLOUR;
+            change = 1;
+        }
+    }
+
+    if (screen_style.fg != style.fg)
+    {                                  /* adjust foreground colour */
+        xterm_put_colour(xterm, style.fg,
+                         xt_fg_8_cmd, xt_fg_256_cmd, xt_fg_rgb_cmd);
+        change = 1;
+    }
+    if (screen_style.bg != style.bg)
+    {                                  /* adjust background too */
+        xterm_put_colour(xterm, style.bg,
+                         xt_bg_8_cmd, xt_bg_256_cmd, xt_bg_rgb_cmd);
+        change = 1;
+    }
+    return change;
+}
+
+/*
+ * xterm_scroll() --Scroll the terminal, and the screen frame to match.
+ *
+ * Remarks:
+ * This uses the scroll region (DECSTBM), so it only applies to
+ * full-width regions, unless the terminal has left/right margins
+ * (DECSLRM); anything else falls back to being repainted by the
+ * diff.  Setting/resetting the scroll region homes the cursor, and
+ * exposed rows are erased in the current background, so the style is
+ * reset to the default first.
+ */
+static void xterm_scroll(Xterminator * xterm, TwinScroll scroll)
+{
+    static const TwinCell default_style = {
+        TWIN_DEFAULT_COLOUR, TWIN_DEFAULT_COLOUR, TwinNormal, ' ', 0
+    };
+    TwinRegion region = scroll.region;
+    int margins = (region.min.column != 0
+                   || region.max.column !=
+                   xterm->screen.geometry.size.column - 1);
+
+    if (margins && !(xterm->features & XtMargins))
+    {
+        return;                        /* not full-width: repaint */
+    }
+    xterm_style(xterm, default_style);
+    fprintf(xterm->output, xt_stbm_cmd,
+            region.min.row + 1, region.max.row + 1);
+    if (margins)
+    {
+        fprintf(xterm->output, xt_slrm_cmd,
+                region.min.column + 1, region.max.column + 1);
+    }
+    fprintf(xterm->output, (scroll.n > 0) ? xt_su_cmd : xt_sd_cmd,
+            abs(scroll.n));
+    fputs(xt_stbm_reset_cmd, xterm->output);
+    if (margins)
+    {
+        fputs(xt_slrm_reset_cmd, xterm->output);
+    }
+    xterm->screen.cursor.row = 0;
+    xterm->screen.cursor.column = 0;
+
+    for (int r = region.min.row; r <= region.max.row; ++r)
+    {
+        xterm_screen_row(xterm, r);
+    }
+    twin_scroll(&xterm->screen, region, scroll.n);
+    twin_reset(&xterm->screen);        /* screen damage is meaningless */
+}
+
+
+/*
+ * xterm_sync_timeout() --Get the time until a deferred frame can be sent.
+ *
+ * Returns: (int)
+ * The time (ms) to wait before calling xterm_sync() again, 0 if it
+ * can be called now, or -1 if there's nothing to send.
+ *
+ * Remarks:
+ * A deferred frame (or damage held back by a window's refresh hint)
+ * is only sent by a later xterm_sync(), so a caller that would
+ * otherwise sleep indefinitely should poll() with this.
+ */
+int xterm_sync_timeout(Xterminator * xterm)
+{
+    uint64_t now = twin_clock();
+    uint64_t next = xterm->flow.next;
+
+    if (!(xterm->root.state & TwinRegiond) && xterm->repaint == XtRepaintNone)
+    {
+        if (xterm->flow.held_due == 0)
+        {
+            return -1;
+        }
+        next = (xterm->flow.held_due > next) ? xterm->flow.held_due : next;
+    }
+    if (next > now)
+    {
+        return (int) (next - now);
+    }
+    return xterm_flow_ready(xterm, 0) ? 0 : XT_FLOW_RETRY;
+}
+
+
+/*
+ * xterm_clear() --Clear the terminal, and repaint it from root.
+ *
+ * Returns: (int)
+ * The number of changes (cells drawn), or 0 if the link is backed up
+ * (the repaint is then done by the next xterm_sync()).
+ *
+ * Remarks:
+ * This is for recovering a garbled screen (e.g. something else wrote
+ * to the tty): nothing is assumed about the terminal's cursor or style.
+ */
+int xterm_clear(Xterminator * xterm)
+{
+    xterm->repaint = XtRepaintReset;
+    return xterm_sync(xterm);
+}
+
+
+/*
+ * xterm_flow_ready() --Check if the output link can take another frame.
+ *
+ * Parameters:
+ * xterm --the terminal
+ * count --if set, count a deferral in the stats
+ *
+ * Returns: (int)
+ * 1: send the frame; 0: defer it.
+ *
+ * Remarks:
+ * The link is backed up if the fd isn't writable (a pty, socket or
+ * pipe that's full), or the tty's output queue is long (a serial
+ * line); TIOCOUTQ alone isn't enough, because ptys always report 0.
+ */
+static int xterm_flow_ready(Xterminator * xterm, int count)
+{
+    XtFlow *flow = &xterm->flow;
+    struct pollfd writable = { fileno(xterm->tty), POLLOUT, 0 };
+    int queued = 0;
+
+    if (flow->blocked)
+    {                                  /* push out the previous frame first */
+        if (!xterm_out_drain(xterm, 0))
+        {
+            flow->skipped += count;
+            return 0;
+        }
+        flow->blocked = 0;
+        if (twin_trace != NULL)
+        {                              /* the blocked frame's now written */
+            twin_trace_frame(flow->changes, flow->bytes);
+        }
+    }
+    if (twin_clock() < flow->next
+        || (poll(&writable, 1, 0) == 1 && !(writable.revents & POLLOUT))
+        || (ioctl(fileno(xterm->tty), TIOCOUTQ, &queued) == 0
+            && queued > XT_FLOW_BACKLOG))
+    {
+        flow->skipped += count;
+        debug("%s(): deferred: %d bytes queued", __func__, queued);
+        return 0;
+    }
+    return 1;
+}
+
+
+/*
+ * xterm_flow_flushed() --Flush a frame, and pace the next one.
+ *
+ * Remarks:
+ * If the flush blocks, the link is saturated: the frame's size over
+ * the time spent blocked measures its throughput, and the next frame
+ * is held back until the link has had time to carry this one.  If the
+ * flush doesn't block, the link is keeping up, and frames aren't paced.
+ */
+static void xterm_flow_flushed(Xterminator * xterm)
+{
+    XtFlow *flow = &xterm->flow;
+    long bytes = (long) (__fpending(xterm->output)
+                         + xterm->n_buffer - xterm->buffer_sent);
+    uint64_t start = twin_clock();
+    uint64_t end;
+
+    flow->bytes = (size_t) bytes;
+    if (fflush(xterm->output) == EOF
+        && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {                                  /* (no buffer: stdio dropped the rest) */
+        clearerr(xterm->output);
+        xterm->repaint = XtRepaintReset;
+        flow->blocked = 1;
+        return;
+    }
+    if (!xterm_out_drain(xterm, 0))
+    {                                  /* non-blocking fd: the rest waits */
+        flow->blocked = 1;
+        return;
+    }
+    end = twin_clock();
+    if (twin_trace != NULL)
+    {
+        twin_trace_frame(flow->changes, flow->bytes);
+    }
+    flow->next = 0;
+    if (end - start >= XT_FLOW_BLOCKED && bytes > 0)
+    {
+        long rate = bytes * 1000L / (long) (end - start);
+        long interval;
+
+        flow->rate = (flow->rate == 0) ? rate : (3 * flow->rate + rate) / 4;
+        interval = bytes * 1000L / flow->rate;
+        flow->next = end + (uint64_t) ((interval < XT_FLOW_INTERVAL_MAX)
+                                       ? interval : XT_FLOW_INTERVAL_MAX);
+    }
+}
+
+
+/*
+ * xterm_out_write() --Append encoded output to the buffer (stdio cookie).
+ */
+static ssize_t xterm_out_write(void *cookie, const char *data, size_t size)
+{
+    Xterminator *xterm = cookie;
+
+    if (xterm->n_buffer + size > xterm->buffer_alloc)
+    {
+        size_t n_alloc = 2 * (xterm->n_buffer + size);
+        char *buffer = realloc(xterm->buffer, n_alloc);
+
+        if (buffer == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            return 0;                  /* (a stdio error) */
+        }
+        xterm->buffer = buffer;
+        xterm->buffer_alloc = n_alloc;
+    }
+    memcpy(xterm->buffer + xterm->n_buffer, data, size);
+    xterm->n_buffer += size;
+    xterm->flow.emitted += size;
+    return (ssize_t) size;
+}
+
+
+/*
+ * xterm_out_drain() --Write the buffered output to the tty.
+ *
+ * Parameters:
+ * xterm    --the terminal
+ * wait     --if set, wait (a while) for a full fd to drain
+ *
+ * Returns: (int)
+ * 1: it's all written (or lost to an error); 0: the fd is full, and
+ * the rest is kept for the next call.
+ *
+ * Remarks:
+ * If the tty isn't a file descriptor (e.g. a cookie stream), the
+ * output is passed on to it with fwrite().
+ */
+static int xterm_out_drain(Xterminator * xterm, int wait)
+{
+    int fd = fileno(xterm->tty);
+
+    if (xterm->buffer_sent == xterm->n_buffer)
+    {
+        return 1;                      /* nothing to do */
+    }
+    if (fd < 0)
+    {
+        fwrite(xterm->buffer + xterm->buffer_sent, 1,
+               xterm->n_buffer - xterm->buffer_sent, xterm->tty);
+        fflush(xterm->tty);
+        xterm->buffer_sent = xterm->n_buffer = 0;
+        return 1;
+    }
+    fflush(xterm->tty);                /* (anything the caller wrote first) */
+    clearerr(xterm->tty);
+    while (xterm->buffer_sent < xterm->n_buffer)
+    {
+        ssize_t n = write(fd, xterm->buffer + xterm->buffer_sent,
+                          xterm->n_buffer - xterm->buffer_sent);
+
+        if (n >= 0)
+        {
+            xterm->buffer_sent += (size_t) n;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            struct pollfd writable = { fd, POLLOUT, 0 };
+
+            if (!wait || poll(&writable, 1, XT_DRAIN_WAIT) != 1)
+            {
+                return 0;              /* keep the rest */
+            }
+        }
+        else if (errno != EINTR)
+        {
+            log_sys(LOG_ERR, "%s(): write failed", __func__);
+            break;                     /* the tty's gone: drop it */
+        }
+    }
+    xterm->buffer_sent = xterm->n_buffer = 0;
+    return 1;
+}
+
+
+/*
+ * xterm_out_flush() --Flush output to the tty, outside of a frame.
+ */
+static void xterm_out_flush(Xterminator * xterm)
+{
+    fflush(xterm->output);
+    if (!xterm->flow.blocked && !xterm_out_drain(xterm, 0))
+    {
+        xterm->flow.blocked = 1;       /* (the next frame waits for it) */
+    }
+}
+
+
+/*
+ * xterm_probe() --Ask the terminal about its optional capabilities.
+ *
+ * Remarks:
+ * The queries are only sent if the input is a tty in non-canonical,
+ * no-echo mode, so that the replies can't appear on the screen, and
+ * will be read promptly (by xterm_read()).
+ */
+static void xterm_probe(Xterminator * xterm)
+{
+    struct termios tty;
+
+    if (xterm->probe.state != XtProbeNone
+        || tcgetattr(xterm->input, &tty) < 0
+        || (tty.c_lflag & (ICANON | ECHO)))
+    {
+        return;
+    }
+    fputs(xt_probe_cmd, xterm->output);
+    xterm->probe.state = XtProbeSent;
+    xterm->probe.deadline = twin_clock() + XT_PROBE_TIMEOUT;
+}
+
+
+/*
+ * xt_params() --Parse an escape sequence's numeric parameters.
+ *
+ * Returns: (int)
+ * The number of parameters found (at most max).
+ */
+static int xt_params(const char *text, int *param, int max)
+{
+    int n = 0;
+
+    for (; n < max; ++text)
+    {
+        param[n] = 0;
+        if (*text < '0' || *text > '9')
+        {
+            break;
+        }
+        while (*text >= '0' && *text <= '9')
+        {
+            param[n] = param[n] * 10 + (*text++ - '0');
+        }
+        ++n;
+        if (*text != ';')
+        {
+            break;
+        }
+    }
+    return n;
+}
+
+
+/*
+ * xterm_probe_reply() --Learn from a (complete) escape sequence.
+ *
+ * Returns: (int)
+ * 1: it was a reply to a query, and is consumed; 0: it's input.
+ */
+static int xterm_probe_reply(Xterminator * xterm, const char *seq, int n)
+{
+    XtProbe *probe = &xterm->probe;
+    int param[3];
+    char final = seq[n - 1];
+
+    if (seq[1] == 'P')
+    {                                  /* DCS [01] + r name[=value] ST */
+        if (n < 7 || seq[3] != '+' || seq[4] != 'r')
+        {
+            return 0;
+        }
+        for (const char *name = seq + 5; seq[2] == '1' && name < seq + n;)
+        {                              /* name[=value];... (hex-encoded) */
+            size_t len = 0;
+
+            while (name + len < seq + n && name[len] != '='
+                   && name[len] != ';' && name[len] != '\033')
+            {
+                ++len;
+            }
+
+            if ((len == 6 && memcmp(name, "524742", 6) == 0)
+                || (len == 4 && memcmp(name, "5463", 4) == 0))
+            {                          /* (Tc is boolean: no value) */
+                xterm->features |= XtTrueColour;
+            }
+            else if (len == 6 && memcmp(name, "726570", 6) == 0)
+            {
+                xterm->features |= XtRepeat;
+            }
+            while (name < seq + n && *name++ != ';')
+            {
+                continue;
+            }
+        }
+        return 1;
+    }
+    if (final == 'c' && seq[2] == '?')
+    {                                  /* DA1: the last reply */
+        xt_params(seq + 3, param, 1);
+        probe->da1_class = param[0];
+        probe->state = XtProbeDone;
+        debug("%s(): features: %#x", __func__, xterm->features);
+        return 1;
+    }
+    if (final == 'c' && seq[2] == '>')
+    {                                  /* DA2: type; version; ROM */
+        if (xt_params(seq + 3, param, 2) == 2)
+        {
+            probe->da2_id = param[0];
+            probe->da2_version = param[1];
+        }
+        return 1;
+    }
+    if (final == 'y' && seq[2] == '?' && seq[n - 2] == '$')
+    {                                  /* DECRPM: mode; 1,2,3: supported */
+        if (xt_params(seq + 3, param, 2) == 2
+            && param[1] >= 1 && param[1] <= 3)
+        {
+            xterm->features |= (param[0] == 2026) ? XtSyncOutput
+                : (param[0] == 69) ? XtMargins : 0;
+        }
+        return 1;
+    }
+    return 0;
+}
+
+
+/*
+ * xt_sequence() --Check how much of an escape sequence has arrived.
+ *
+ * Returns: (int)
+ * 1: it's complete; 0: it's incomplete; -1: it's not a CSI/DCS
+ * sequence (or too long), so it can't be a reply.
+ */
+static int xt_sequence(const char *seq, int n)
+{
+    if (n == 1)
+    {
+        return 0;
+    }
+    if (n >= XT_PROBE_PENDING || (seq[1] != '[' && seq[1] != 'P'))
+    {
+        return -1;
+    }
+    if (seq[1] == 'P')
+    {                                  /* ...ends with ST */
+        return (n >= 4 && seq[n - 2] == '\033' && seq[n - 1] == '\\');
+    }
+    if (n == 2)
+    {
+        return 0;
+    }
+    if (seq[n - 1] >= 0x40 && seq[n - 1] <= 0x7e)
+    {                                  /* final byte */
+        return 1;
+    }
+    return (seq[n - 1] >= 0x20 && seq[n - 1] < 0x40) ? 0 : -1;
+}
+
+
+/*
+ * xterm_read() --Read input, consuming any capability query replies.
+ *
+ * Parameters:
+ * xterm  --the terminal
+ * buffer --returns the input
+ * size   --the buffer's size (at least XT_PROBE_PENDING is best)
+ *
+ * Returns: (ssize_t)
+ * Success: the number of bytes of input (which may be 0, if it was
+ * all replies); Failure: -1, as read().
+ *
+ * Remarks:
+ * This does a single read(), so it's for use when poll() says the
+ * input is readable.  While the probe is outstanding, escape sequences
+ * are held back until they're complete; if they're not replies, they
+ * are returned as input.  After DA1's reply, or the timeout, input is
+ * passed through untouched, and anything held back is released: on
+ * the timeout, without a read() (see xterm_read_timeout()).
+ */
+ssize_t xterm_read(Xterminator * xterm, char *buffer, size_t size)
+{
+    XtProbe *probe = &xterm->probe;
+    char input[XT_PROBE_PENDING];
+    size_t out = 0;
+    ssize_t n;
+
+    if (probe->state == XtProbeSent && twin_clock() > probe->deadline)
+    {
+        probe->state = XtProbeDone;    /* no answer: stay as we are */
+        debug("%s(): probe timed out", __func__);
+    }
+    if (probe->state != XtProbeSent && probe->n_pending == 0)
+    {
+        return read(xterm->input, buffer, size);
+    }
+    if (probe->n_pending > 0 && (size_t) probe->n_pending >= size)
+    {                                  /* (tiny buffer: drain held input) */
+        memcpy(buffer, probe->pending, size);
+        probe->n_pending -= (int) size;
+        memmove(probe->pending, probe->pending + size,
+                (size_t) probe->n_pending);
+        return (ssize_t) size;
+    }
+    if (probe->state != XtProbeSent)
+    {                                  /* release anything held back */
+        memcpy(buffer, probe->pending, (size_t) probe->n_pending);
+        out = (size_t) probe->n_pending;
+        probe->n_pending = 0;
+        return (ssize_t) out;
+    }
+
+    size = size - (size_t) probe->n_pending;   /* worst case: all output */
+    if ((n = read(xterm->input, input,
+                  (size < sizeof(input)) ? size : sizeof(input))) <= 0)
+    {
+        return n;
+    }
+    for (ssize_t i = 0; i < n; ++i)
+    {
+        int status;
+
+        if (probe->n_pending == 0 && input[i] != '\033')
+        {
+            buffer[out++] = input[i];  /* plain input */
+            continue;
+        }
+        probe->pending[probe->n_pending++] = input[i];
+        if ((status = xt_sequence(probe->pending, probe->n_pending)) == 0)
+        {
+            continue;                  /* wait for the rest */
+        }
+        if (status < 0 && probe->n_pending > 1 && input[i] == '\033')
+        {                              /* a lone ESC, then a sequence */
+            memcpy(buffer + out, probe->pending,
+                   (size_t) probe->n_pending - 1);
+            out += (size_t) probe->n_pending - 1;
+            probe->pending[0] = '\033';
+            probe->n_pending = 1;
+            continue;
+        }
+        if (status < 0
+            || !xterm_probe_reply(xterm, probe->pending, probe->n_pending))
+        {                              /* not ours: it's input */
+            memcpy(buffer + out, probe->pending, (size_t) probe->n_pending);
+            out += (size_t) probe->n_pending;
+        }
+        probe->n_pending = 0;
+    }
+    if (probe->state != XtProbeSent)
+    {                                  /* DA1 came: release the rest */
+        memcpy(buffer + out, probe->pending, (size_t) probe->n_pending);
+        out += (size_t) probe->n_pending;
+        probe->n_pending = 0;
+    }
+    return (ssize_t) out;
+}
+
+
+/*
+ * xterm_read_timeout() --Get the time until held input must be read.
+ *
+ * Returns: (int)
+ * The time (ms) to wait before calling xterm_read() again, even if
+ * the input isn't readable; 0 if it can be called now, or -1 if
+ * there's nothing held back.
+ *
+ * Remarks:
+ * A lone ESC (i.e. the Escape key) that arrives during the probe is
+ * held, in case it starts a reply; if the probe times out, only
+ * xterm_read() releases it, and it doesn't read() to do so.
+ */
+int xterm_read_timeout(Xterminator * xterm)
+{
+    XtProbe *probe = &xterm->probe;
+    uint64_t now = twin_clock();
+
+    if (probe->n_pending == 0)
+    {
+        return -1;
+    }
+    if (probe->state == XtProbeSent && probe->deadline >= now)
+    {
+        return (int) (probe->deadline - now) + 1;
+    }
+    return 0;
+}
+
+
+/*
+ * xterm_shadow_style() --Make sure the shadow's style table covers an id.
+ *
+ * Remarks:
+ * The style table is append-only, so entries never go stale; they're
+ * copied in id order, the first time an id is sent.
+ */
+static void xterm_shadow_style(Xterminator * xterm, TwinStyle style)
+{
+    XtShadow *shadow = xterm->shadow;
+
+    if (shadow != NULL)
+    {
+        TwinCell *table = (TwinCell *) (shadow + 1);
+
+        for (; shadow->n_style <= style; ++shadow->n_style)
+        {
+            table[shadow->n_style] = twin_style_cell(shadow->n_style);
+        }
+    }
+}
+
+
+/*
+ * xterm_shadow_glyph() --Make sure the shadow's glyph table covers a glyph.
+ *
+ * Remarks:
+ * Like the style table, it's copied in order, as glyphs are sent.
+ */
+static void xterm_shadow_glyph(Xterminator * xterm, uint8_t glyph)
+{
+    XtShadow *shadow = xterm->shadow;
+
+    if (shadow != NULL && glyph >= TWIN_GLYPH_EXT)
+    {
+        for (; shadow->n_glyph <= (uint32_t) (glyph - TWIN_GLYPH_EXT);
+             ++shadow->n_glyph)
+        {
+            int width = 1;
+            uint32_t cp =
+                twin_utf8_codepoint((uint8_t) (TWIN_GLYPH_EXT
+                                               + shadow->n_glyph), &width);
+
+            shadow->glyph[shadow->n_glyph] = cp | (uint32_t) width << 24;
+        }
+    }
+}
+
+
+/*
+ * xterm_shadow_name() --Get the shared memory name for a terminal.
+ *
+ * Returns: (int)
+ * Success: 0; Failure: -1 (the output isn't a tty).
+ */
+static int xterm_shadow_name(Xterminator * xterm, char *name, size_t size,
+                             struct stat *tty)
+{
+    struct stat st;
+
+    tty = (tty != NULL) ? tty : &st;
+    if (fstat(fileno(xterm->tty), tty) < 0 || !S_ISCHR(tty->st_mode))
+    {
+        return -1;
+    }
+    snprintf(name, size, "/twin-%lx", (unsigned long) tty->st_rdev);
+    return 0;
+}
+
+
+/*
+ * xterm_shadow_adopt() --Take over a previous process's screen shadow.
+ *
+ * Returns: (int)
+ * 1: adopted; 0: the shadow doesn't describe this screen.
+ *
+ * Remarks:
+ * The frame's style ids and glyphs belong to the previous process,
+ * so they're reinterned (via the shadow's tables) into ours.
+ */
+static int xterm_shadow_adopt(Xterminator * xterm, XtShadow * shadow,
+                              int64_t tty_ctime)
+{
+    Twindow *screen = &xterm->screen;
+    size_t n = (size_t) shadow->rows * (size_t) shadow->columns;
+    TwinCell *table = (TwinCell *) (shadow + 1);
+    TwinStyle *styles = (TwinStyle *) ((char *) shadow + XT_SHADOW_FRAME);
+    uint8_t *glyphs = (uint8_t *) (styles + n);
+    uint32_t *id;
+    TwinStyle max_id = TWIN_STYLE_BLANK;
+    uint8_t max_glyph = 0;
+
+    if (shadow->magic != XT_SHADOW_MAGIC
+        || shadow->state != XtShadowClean
+        || shadow->rows != screen->geometry.size.row
+        || shadow->columns != screen->geometry.size.column
+        || shadow->tty_ctime != tty_ctime
+        || shadow->n_style == 0 || shadow->n_style > TWIN_STYLE_MAX
+        || shadow->n_glyph > TWIN_GLYPH_MAX - TWIN_GLYPH_EXT)
+    {
+        return 0;                      /* stale */
+    }
+    if ((id = malloc(shadow->n_style * sizeof(*id))) == NULL)
+    {
+        return 0;
+    }
+    memset(id, 0xff, shadow->n_style * sizeof(*id));    /* not yet interned */
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (styles[i] >= shadow->n_style)
+        {
+            free(id);
+            return 0;                  /* corrupt */
+        }
+        if (id[styles[i]] == UINT32_MAX)
+        {
+            id[styles[i]] = twin_style_intern(table[styles[i]]);
+        }
+        styles[i] = (TwinStyle) id[styles[i]];
+        max_id = (styles[i] > max_id) ? styles[i] : max_id;
+    }
+    free(id);
+    for (size_t i = 0; i < n; ++i)
+    {                                  /* and glyphs, the same way */
+        uint32_t g = glyphs[i];
+
+        if (g >= TWIN_GLYPH_EXT)
+        {
+            if (g - TWIN_GLYPH_EXT >= shadow->n_glyph)
+            {
+                return 0;              /* corrupt */
+            }
+            g = shadow->glyph[g - TWIN_GLYPH_EXT];
+            glyphs[i] = twin_utf8_intern(g & 0xffffff, (int) (g >> 24));
+            max_glyph = (glyphs[i] > max_glyph) ? glyphs[i] : max_glyph;
+        }
+    }
+
+    shadow->n_style = shadow->n_glyph = 0;      /* now in our ids */
+    xterm->shadow = shadow;
+    xterm_shadow_style(xterm, max_id);
+    xterm_shadow_glyph(xterm, max_glyph);
+    screen->cursor = shadow->cursor;
+    screen->style = shadow->style;
+    return 1;
+}
+
+
+/*
+ * xterm_persist() --Keep the screen frame in shared memory, or adopt it.
+ *
+ * Returns: (int)
+ * 1: a previous process's screen was adopted; 0: a new shadow was
+ * created; -1: failure (the screen frame stays private).
+ *
+ * Remarks:
+ * This must be called after xterminator_init(), and before
+ * open_xterminator(), which doesn't reset the terminal if the screen
+ * was adopted.  The segment is named after the tty's device number,
+ * and is only adopted if it's clean, the same size, for the same tty
+ * instance, and its owner has exited.  When adopted, root is entirely
+ * damaged, so the first xterm_sync() clears anything stale, but only
+ * cells that actually differ are sent.
+ */
+int xterm_persist(Xterminator * xterm)
+{
+    Twindow *screen = &xterm->screen;
+    int rows = screen->geometry.size.row;
+    int columns = screen->geometry.size.column;
+    size_t size = XT_SHADOW_SIZE(rows, columns);
+    struct stat tty, segment;
+    char name[64];
+    int fd;
+    XtShadow *shadow;
+
+    if (xterm_shadow_name(xterm, name, sizeof(name), &tty) < 0)
+    {
+        return -1;                     /* not a tty: nothing to persist */
+    }
+    if (!xterm_screen_wake(xterm))
+    {
+        return -1;
+    }
+    for (int r = 0; r < rows; ++r)
+    {                                  /* (it was compacted) */
+        xterm_screen_row(xterm, r);
+    }
+    if ((fd = shm_open(name, O_RDWR | O_CREAT, 0600)) < 0)
+    {
+        log_sys(LOG_ERR, "cannot open shared memory \"%s\"", name);
+        return -1;
+    }
+    if (fstat(fd, &segment) < 0 || segment.st_uid != geteuid())
+    {
+        err("%s(): \"%s\" isn't ours", __func__, name);
+        close(fd);
+        return -1;
+    }
+
+    int64_t tty_ctime = (int64_t) tty.st_ctim.tv_sec * 1000000000
+        + tty.st_ctim.tv_nsec;
+    int fresh = ((size_t) segment.st_size != size);
+
+    if (fresh && ftruncate(fd, (off_t) size) < 0)
+    {
+        log_sys(LOG_ERR, "cannot size shared memory \"%s\"", name);
+        close(fd);
+        return -1;
+    }
+    shadow = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shadow == MAP_FAILED)
+    {
+        log_sys(LOG_ERR, "cannot map shared memory \"%s\"", name);
+        return -1;
+    }
+    if (!fresh && shadow->magic == XT_SHADOW_MAGIC && shadow->pid != 0
+        && (kill(shadow->pid, 0) == 0 || errno == EPERM))
+    {                                  /* another process is using it */
+        err("%s(): \"%s\" is in use by process %d", __func__, name,
+            (int) shadow->pid);
+        munmap(shadow, size);
+        return -1;
+    }
+
+    xterm->adopted = !fresh && xterm_shadow_adopt(xterm, shadow, tty_ctime);
+    if (!xterm->adopted)
+    {                                  /* start afresh, from our screen */
+        memset(shadow, 0, XT_SHADOW_FRAME);
+        shadow->magic = XT_SHADOW_MAGIC;
+        shadow->rows = rows;
+        shadow->columns = columns;
+        shadow->tty_ctime = tty_ctime;
+        memcpy((char *) shadow + XT_SHADOW_FRAME, screen->frame,
+               TWIN_FRAME_SIZE(rows, columns));
+        xterm->shadow = shadow;
+        xterm_shadow_style(xterm, TWIN_STYLE_BLANK);
+    }
+    shadow->pid = getpid();
+    free(screen->frame);
+    screen->frame = (char *) shadow + XT_SHADOW_FRAME;
+    screen->styles = screen->frame;
+    screen->glyphs = (uint8_t *) (screen->styles + (size_t) rows * columns);
+
+    if (xterm->adopted)
+    {                                  /* diff everything against it */
+        TwinRegion all = { {0, 0}, {rows - 1, columns - 1} };
+
+        twin_damage(&xterm->root, all);
+        debug("%s(): adopted \"%s\"", __func__, name);
+    }
+    return xterm->adopted;
+}
+
+
+/*
+ * xterm_compact() --Compact an idle terminal's frames.
+ *
+ * Returns: (int)
+ * 1: compacted; 0: not idle (or persistent); -1: failure.
+ *
+ * Remarks:
+ * While nothing's damaged, the screen and root frames can be kept as
+ * run-length encoded rows, interned in a table shared by all
+ * terminals: blank rows, and rows that several terminals show, are
+ * stored once.  Since an idle root matches the screen, its rows are
+ * mostly the screen's.  The screen frame is reallocated by the next
+ * sync (or scroll), and its rows are expanded as damage touches them;
+ * root's is expanded all at once, by the first twin_*() call that
+ * reads or writes it (through root.wake), or by the next sync.
+ *
+ * A server with many attached terminals can call this from a timer,
+ * for those that haven't changed for a while.  A persistent screen
+ * (xterm_persist()) stays as it is: it's shared memory.
+ */
+int xterm_compact(Xterminator * xterm)
+{
+    Twindow *screen = &xterm->screen;
+    int rows = screen->geometry.size.row;
+    int columns = screen->geometry.size.column;
+    uint8_t *runs;
+
+    if (xterm->shadow != NULL
+        || (xterm->root.state & TwinRegiond) || xterm->flow.held_due != 0
+        || xterm->flow.blocked)
+    {
+        return 0;                      /* busy, or persistent */
+    }
+    if (screen->frame == NULL && xterm->root.frame == NULL)
+    {
+        return 0;                      /* compact */
+    }
+    if ((runs = malloc(XT_ROW_MAX(columns))) == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return -1;
+    }
+    if (screen->frame != NULL)
+    {
+        if (xterm->compact == NULL
+            && (xterm->compact = calloc((size_t) rows,
+                                        sizeof(XtRow *))) == NULL)
+        {
+            err("%s(): out of memory", __func__);
+            free(runs);
+            return -1;
+        }
+        for (int r = 0; r < rows; ++r)
+        {
+            if (xterm->compact[r] == NULL)
+            {                          /* (else: never expanded) */
+                size_t size = xterm_row_encode(screen, r, runs);
+
+                if ((xterm->compact[r] = xterm_row_intern(runs, size)) == NULL)
+                {
+                    free(runs);
+                    xterm_compact_release(xterm);
+                    return -1;
+                }
+                xterm->n_compact += 1;
+            }
+        }
+        free(screen->frame);
+        screen->frame = NULL;
+        screen->styles = NULL;
+        screen->glyphs = NULL;
+    }
+    if (xterm->root.frame != NULL && !xterm_root_compact(xterm, runs))
+    {
+        free(runs);
+        return -1;                     /* (root stays as it was) */
+    }
+    free(runs);
+    debug("%s(): %d rows, %zu rows shared", __func__, rows, xt_n_row);
+    return 1;
+}
+
+
+/*
+ * xterm_root_compact() --Encode root's rows, and release its frame.
+ *
+ * Returns: (int)
+ * Success: 1; Failure: 0 (out of memory).
+ */
+static int xterm_root_compact(Xterminator * xterm, uint8_t * runs)
+{
+    Twindow *root = &xterm->root;
+    int rows = root->geometry.size.row;
+    XtRow **compact = calloc((size_t) rows, sizeof(XtRow *));
+
+    if (compact == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return 0;
+    }
+    for (int r = 0; r < rows; ++r)
+    {
+        size_t size = xterm_row_encode(root, r, runs);
+
+        if ((compact[r] = xterm_row_intern(runs, size)) == NULL)
+        {
+            while (r-- > 0)
+            {
+                xterm_row_release(compact[r]);
+            }
+            free(compact);
+            return 0;
+        }
+    }
+    free(root->frame);
+    root->frame = NULL;
+    root->styles = NULL;
+    root->glyphs = NULL;
+    root->wake = xterm_root_wake;
+    xterm->root_compact = compact;
+    return 1;
+}
+
+
+/*
+ * xterm_root_wake() --Expand a compacted root, for twin.c (see twin_frame()).
+ */
+static int xterm_root_wake(Twindow * root)
+{
+    return xterm_root_expand((Xterminator *)
+                             ((char *) root - offsetof(Xterminator, root)));
+}
+
+
+/*
+ * xterm_root_expand() --Reallocate root's frame, and decode its rows.
+ *
+ * Returns: (int)
+ * 1: the frame's there; 0: no memory (root stays compact).
+ */
+static int xterm_root_expand(Xterminator * xterm)
+{
+    Twindow *root = &xterm->root;
+    int rows = root->geometry.size.row;
+    int columns = root->geometry.size.column;
+    void *frame;
+
+    if (xterm->root_compact == NULL)
+    {
+        return 1;
+    }
+    if ((frame = malloc(TWIN_FRAME_SIZE(rows, columns))) == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return 0;
+    }
+    root->frame = frame;
+    root->styles = frame;
+    root->glyphs = (uint8_t *) (root->styles + (size_t) rows * columns);
+    for (int r = 0; r < rows; ++r)
+    {
+        int offset = twin_cell(root->geometry, r, 0);
+
+        xterm_row_decode(xterm->root_compact[r], &root->styles[offset],
+                         &root->glyphs[offset]);
+        xterm_row_release(xterm->root_compact[r]);
+    }
+    free(xterm->root_compact);
+    xterm->root_compact = NULL;
+    return 1;
+}
+
+
+/*
+ * xterm_screen_wake() --Reallocate a compacted screen's frame.
+ *
+ * Returns: (int)
+ * 1: the frame's there (its rows expand when touched); 0: no memory.
+ */
+static int xterm_screen_wake(Xterminator * xterm)
+{
+    Twindow *screen = &xterm->screen;
+    int rows = screen->geometry.size.row;
+
+    if (screen->frame != NULL)
+    {
+        return 1;
+    }
+    if ((screen->frame = malloc(TWIN_FRAME_SIZE(rows,
+                                                screen->geometry.size.
+                                                column))) == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return 0;
+    }
+    screen->styles = screen->frame;
+    screen->glyphs = (uint8_t *) (screen->styles
+                                  + (size_t) rows
+                                  * screen->geometry.size.column);
+    return 1;
+}
+
+
+/*
+ * xterm_screen_row() --Expand a screen row, if it's still compact.
+ */
+static inline void xterm_screen_row(Xterminator * xterm, int row)
+{
+    if (xterm->compact != NULL && xterm->compact[row] != NULL)
+    {
+        xterm_row_expand(xterm, row);
+    }
+}
+
+
+/*
+ * xterm_row_encode() --Run-length encode a row of a frame.
+ *
+ * Returns: (size_t)
+ * The size of the runs.
+ *
+ * Remarks:
+ * Each run is a 16-bit count (XT_ROW_REPEAT set: one glyph, repeated),
+ * a 16-bit style id, and then its glyph(s).  Short repeats are left in
+ * literal runs, where they're cheaper.
+ */
+static size_t xterm_row_encode(const Twindow * twin, int row, uint8_t * runs)
+{
+    int columns = twin->geometry.size.column;
+    int offset = twin_cell(twin->geometry, row, 0);
+    const TwinStyle *style = &twin->styles[offset];
+    const uint8_t *glyph = &twin->glyphs[offset];
+    uint8_t *p = runs;
+
+    for (int c = 0; c < columns;)
+    {
+        int n = xterm_row_repeat(style, glyph, c, columns);
+        uint16_t header[2] = { (uint16_t) (n | XT_ROW_REPEAT), style[c] };
+
+        if (n < XT_ROW_SHORT)
+        {                              /* literal: until a repeat, or style */
+            n = 1;
+            while (c + n < columns && style[c + n] == style[c]
+                   && xterm_row_repeat(style, glyph, c + n, columns)
+                   < XT_ROW_SHORT)
+            {
+                ++n;
+            }
+            header[0] = (uint16_t) n;
+        }
+        memcpy(p, header, sizeof(header));
+        p += sizeof(header);
+        if (header[0] & XT_ROW_REPEAT)
+        {
+            *p++ = glyph[c];
+        }
+        else
+        {
+            memcpy(p, &glyph[c], (size_t) n);
+            p += n;
+        }
+        c += n;
+    }
+    return (size_t) (p - runs);
+}
+
+
+/*
+ * xterm_row_repeat() --Count the cells like the one at a column.
+ */
+static inline int xterm_row_repeat(const TwinStyle * style,
+                                   const uint8_t * glyph, int column,
+                                   int columns)
+{
+    int n = 1;
+
+    while (column + n < columns && glyph[column + n] == glyph[column]
+           && style[column + n] == style[column])
+    {
+        ++n;
+    }
+    return n;
+}
+
+
+/*
+ * xterm_row_expand() --Decode a compact row into the screen frame.
+ *
+ * Remarks:
+ * When the last row's expanded, the row table's released too.
+ */
+static void xterm_row_expand(Xterminator * xterm, int row)
+{
+    XtRow *compact = xterm->compact[row];
+    int offset = twin_cell(xterm->screen.geometry, row, 0);
+
+    xterm_row_decode(compact, &xterm->screen.styles[offset],
+                     &xterm->screen.glyphs[offset]);
+    xterm_row_release(compact);
+    xterm->compact[row] = NULL;
+    if (--xterm->n_compact == 0)
+    {
+        free(xterm->compact);
+        xterm->compact = NULL;
+    }
+}
+
+
+/*
+ * xterm_row_decode() --Decode a compact row's runs into a frame's row.
+ */
+static void xterm_row_decode(const XtRow * row, TwinStyle * style,
+                             uint8_t * glyph)
+{
+    const uint8_t *p = row->runs;
+    const uint8_t *end = p + row->size;
+
+    while (p < end)
+    {
+        uint16_t header[2];
+        int n;
+
+        memcpy(header, p, sizeof(header));
+        p += sizeof(header);
+        n = header[0] & ~XT_ROW_REPEAT;
+        for (int i = 0; i < n; ++i)
+        {
+            style[i] = header[1];
+        }
+        if (header[0] & XT_ROW_REPEAT)
+        {
+            memset(glyph, *p++, (size_t) n);
+        }
+        else
+        {
+            memcpy(glyph, p, (size_t) n);
+            p += n;
+        }
+        style += n, glyph += n;
+    }
+}
+
+
+/*
+ * xterm_row_intern() --Find or add a compact row in the shared table.
+ *
+ * Returns: (XtRow *)
+ * The row, with a reference for the caller; NULL: no memory.
+ *
+ * Remarks:
+ * Like the style table, the row table isn't thread-safe: it belongs
+ * to the render thread.
+ */
+static XtRow *xterm_row_intern(const uint8_t * runs, size_t size)
+{
+    uint32_t hash = 2166136261u;       /* FNV-1a */
+    XtRow *row;
+
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash = (hash ^ runs[i]) * 16777619u;
+    }
+    if (xt_n_row >= xt_n_bucket && !xterm_row_grow())
+    {
+        return NULL;
+    }
+    for (row = xt_row_table[hash & (xt_n_bucket - 1)]; row != NULL;
+         row = row->next)
+    {
+        if (row->hash == hash && row->size == size
+            && memcmp(row->runs, runs, size) == 0)
+        {
+            row->refs += 1;
+            return row;
+        }
+    }
+    if ((row = malloc(sizeof(XtRow) + size)) == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return NULL;
+    }
+    row->hash = hash;
+    row->refs = 1;
+    row->size = (uint32_t) size;
+    memcpy(row->runs, runs, size);
+    row->next = xt_row_table[hash & (xt_n_bucket - 1)];
+    xt_row_table[hash & (xt_n_bucket - 1)] = row;
+    xt_n_row += 1;
+    return row;
+}
+
+
+/*
+ * xterm_row_grow() --Double the row table's buckets, and rehash.
+ */
+static int xterm_row_grow(void)
+{
+    size_t n_bucket = (xt_n_bucket == 0) ? 256 : 2 * xt_n_bucket;
+    XtRow **table = calloc(n_bucket, sizeof(*table));
+
+    if (table == NULL)
+    {
+        err("%s(): out of memory", __func__);
+        return 0;
+    }
+    for (size_t i = 0; i < xt_n_bucket; ++i)
+    {
+        for (XtRow * row = xt_row_table[i], *next; row != NULL; row = next)
+        {
+            next = row->next;
+            row->next = table[row->hash & (n_bucket - 1)];
+            table[row->hash & (n_bucket - 1)] = row;
+        }
+    }
+    free(xt_row_table);
+    xt_row_table = table;
+    xt_n_bucket = n_bucket;
+    return 1;
+}
+
+
+static void xterm_row_release(XtRow * row)
+{
+    if (--row->refs == 0)
+    {
+        XtRow **link = &xt_row_table[row->hash & (xt_n_bucket - 1)];
+
+        while (*link != row)
+        {
+            link = &(*link)->next;
+        }
+        *link = row->next;
+        free(row);
+        xt_n_row -= 1;
+    }
+}
+
+
+/*
+ * xterm_compact_release() --Drop a screen's compact rows.
+ *
+ * Remarks:
+ * This is only for giving up: the rows' content is lost.
+ */
+static void xterm_compact_release(Xterminator * xterm)
+{
+    if (xterm->compact != NULL)
+    {
+        for (int r = 0; r < xterm->screen.geometry.size.row; ++r)
+        {
+            if (xterm->compact[r] != NULL)
+            {
+                xterm_row_release(xterm->compact[r]);
+            }
+        }
+        free(xterm->compact);
+        xterm->compact = NULL;
+        xterm->n_compact = 0;
+    }
+}
+
+
+/*
+ * xt_digits() --Count the decimal digits of a (positive) parameter.
+ */
+static inline int xt_digits(int n)
+{
+    int digits = 1;
+
+    for (; n >= 10; n /= 10)
+    {
+        ++digits;
+    }
+    return digits;
+}
+
+
+/*
+ * xt_csi_cost() --Bytes in a "ESC [ n X" command, with n omitted if 1.
+ */
+static inline int xt_csi_cost(int n)
+{
+    return (n == 1) ? 3 : 3 + xt_digits(n);
+}
+
+
+/*
+ * xterm_can_reprint() --Check if the screen's cells can be reprinted as-is.
+ *
+ * Parameters:
+ * xterm    --the terminal
+ * row      --the row to check
+ * from, to --the range of columns [from, to)
+ *
+ * Returns: (int)
+ * 1: the cells can be rewritten without a style change; 0: they can't.
+ *
+ * Remarks:
+ * This is a cursor motion: writing a cell that's already on the
+ * screen moves the cursor right without changing anything.
+ */
+static int xterm_can_reprint(Xterminator * xterm, int row, int from, int to)
+{
+    int offset = twin_cell(xterm->screen.geometry, row, from);
+    int alt = xterm->screen.style.attr & TwinAlt;
+
+    if (xterm->style_id < 0)
+    {
+        return 0;                      /* current style isn't a known id */
+    }
+    xterm_screen_row(xterm, row);
+    for (int i = 0; i < to - from; ++i)
+    {
+        uint8_t glyph = xterm->screen.glyphs[offset + i];
+
+        if (xterm->screen.styles[offset + i] != xterm->style_id)
+        {
+            return 0;
+        }
+        if (alt ? glyph >= 16 : (glyph < ' ' || glyph >= 0x7f))
+        {
+            return 0;                  /* not a plain (ASCII) glyph */
+        }
+    }
+    return 1;
+}
+
+
+/*
+ * xterm_right_cost() --Find the cheapest way to move right on a row.
+ *
+ * Parameters:
+ * xterm    --the terminal
+ * row      --the row of the cursor
+ * from, to --the current, target columns
+ * how      --returns the method: 'C' (CUF), 'p' (reprint), or 0
+ *
+ * Returns: (int)
+ * The cost of the move, in bytes.
+ */
+static int xterm_right_cost(Xterminator * xterm, int row, int from, int to,
+                            char *how)
+{
+    int n = to - from;
+    int cost = xt_csi_cost(n);
+
+    *how = 'C';
+    if (n == 0)
+    {
+        *how = 0;
+        return 0;
+    }
+    if (n < cost && xterm_can_reprint(xterm, row, from, to))
+    {                                  /* note: only checks a few cells */
+        *how = 'p';
+        return n;
+    }
+    return cost;
+}
+
+
+/*
+ * xterm_column_cost() --Find the cheapest way to reach a column.
+ *
+ * Parameters:
+ * xterm    --the terminal
+ * row      --the row of the cursor
+ * from, to --the current, target columns
+ * how      --returns the method: 'C', 'p', 'D' (CUB), '\b' (BS),
+ *            'G' (HPA), '\r' (CR, then right), or 0
+ *
+ * Returns: (int)
+ * The cost of the move, in bytes.
+ *
+ * Remarks:
+ * If from is past the right margin, the terminal has a pending wrap
+ * and relative motions are unreliable, so only CR and HPA are used.
+ */
+static int xterm_column_cost(Xterminator * xterm, int row, int from, int to,
+                             char *how)
+{
+    int best = (to == 0) ? 3 : 3 + xt_digits(to + 1);
+    int cost;
+    char right;
+
+    *how = 'G';
+    if (from < xterm->screen.geometry.size.column)
+    {
+        if (from == to)
+        {
+            *how = 0;
+            return 0;
+        }
+        if (to > from)
+        {
+            if ((cost = xterm_right_cost(xterm, row, from, to, &right)) < best)
+            {
+                best = cost;
+                *how = right;
+            }
+        }
+        else
+        {
+            if ((cost = from - to) < best)
+            {
+                best = cost;
+                *how = '\b';
+            }
+            if ((cost = xt_csi_cost(from - to)) < best)
+            {
+                best = cost;
+                *how = 'D';
+            }
+        }
+    }
+    if ((cost = 1 + xterm_right_cost(xterm, row, 0, to, &right)) < best)
+    {
+        best = cost;
+        *how = '\r';
+    }
+    return best;
+}
+
+
+/*
+ * xterm_move_column() --Move the cursor to a column, as planned.
+ */
+static void xterm_move_column(Xterminator * xterm, int row, int from,
+                              int to, char how)
+{
+    char right;
+
+    switch (how)
+    {
+    case 'C':
+    case 'D':
+        if (abs(to - from) == 1)
+        {
+            fprintf(xterm->output, ESC "[%c", how);
+        }
+        else
+        {
+            fprintf(xterm->output, ESC "[%d%c", abs(to - from), how);
+        }
+        break;
+    case 'G':
+        if (to == 0)
+        {
+            fputs(ESC "[G", xterm->output);
+        }
+        else
+        {
+            fprintf(xterm->output, ESC "[%dG", to + 1);
+        }
+        break;
+    case '\b':
+        for (int c = from; c > to; --c)
+        {
+            fputc('\b', xterm->output);
+        }
+        break;
+    case '\r':
+        fputc('\r', xterm->output);
+        xterm_right_cost(xterm, row, 0, to, &right);
+        xterm_move_column(xterm, row, 0, to, right);
+        break;
+    case 'p':
+        for (int c = from; c < to; ++c)
+        {
+            uint8_t glyph =
+                xterm->screen.glyphs[twin_cell(xterm->screen.geometry, row, c)];
+
+            fputc((xterm->screen.style.attr & TwinAlt)
+                  ? xt_line_map[glyph] : glyph, xterm->output);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+
+/*
+ * xterm_cursor() --Move the cursor, using the fewest bytes.
+ *
+ * Parameters:
+ * xterm       --the terminal
+ * row, column --the target position
+ *
+ * Remarks:
+ * The candidates are: CUP; or a vertical motion (CUU/CUD, VPA, LF)
+ * followed by a horizontal one (CUF/CUB, HPA, CR, BS, or reprinting
+ * the cells in between, if they're already in the current style).
+ * Each is costed in bytes, and the cheapest one wins.
+ *
+ * LF is only used when the tty's output mapping is known: with ONLCR
+ * it also returns the carriage, which is costed accordingly.  HPA and
+ * VPA are sent as CHA ("ESC [ n G") and VPA ("ESC [ n d").
+ */
+static void xterm_cursor(Xterminator * xterm, int row, int column)
+{
+    TwinCoordinate cursor = xterm->screen.cursor;
+    int n = row - cursor.row;
+    int best = 2 + xt_digits(row + 1) + 1 + xt_digits(column + 1) + 1;
+    int from = cursor.column;          /* column after vertical motion */
+    char vertical = 'H', horizontal = 0;
+    int cost;
+    char how;
+
+    if (cursor.row == row && cursor.column == column)
+    {
+        return;                        /* we're already there */
+    }
+    if (column == 0)
+    {                                  /* "ESC [ r H", or "ESC [ H" */
+        best = (row == 0) ? 3 : 3 + xt_digits(row + 1);
+    }
+
+    if (n == 0)
+    {
+        if ((cost = xterm_column_cost(xterm, row, from, column, &how)) < best)
+        {
+            best = cost;
+            vertical = 0;
+            horizontal = how;
+        }
+    }
+    else
+    {
+        int relative = xt_csi_cost(abs(n));
+        int absolute = 3 + xt_digits(row + 1);
+
+        cost = xterm_column_cost(xterm, row, from, column, &how);
+        if (relative + cost < best)
+        {
+            best = relative + cost;
+            vertical = (n > 0) ? 'B' : 'A';
+            horizontal = how;
+        }
+        if (absolute + cost < best)
+        {
+            best = absolute + cost;
+            vertical = 'd';
+            horizontal = how;
+        }
+        if (n > 0 && (xterm->features & XtNewlineKnown))
+        {                              /* LF: one byte per row */
+            int lf_from = (xterm->features & XtNewlineReturn) ? 0 : from;
+
+            if (lf_from < xterm->screen.geometry.size.column)
+            {
+                cost = n + xterm_column_cost(xterm, row, lf_from, column,
+                                             &how);
+                if (cost < best)
+                {
+                    best = cost;
+                    vertical = '\n';
+                    horizontal = how;
+                    from = lf_from;
+                }
+            }
+        }
+    }
+
+    switch (vertical)
+    {
+    case 'H':
+        if (column != 0)
+        {
+            fprintf(xterm->output, xt_cup_cmd, row + 1, column + 1);
+        }
+        else if (row != 0)
+        {
+            fprintf(xterm->output, ESC "[%dH", row + 1);
+        }
+        else
+        {
+            fputs(ESC "[H", xterm->output);
+        }
+        break;
+    case 'A':
+    case 'B':
+        if (abs(n) == 1)
+        {
+            fprintf(xterm->output, ESC "[%c", vertical);
+        }
+        else
+        {
+            fprintf(xterm->output, ESC "[%d%c", abs(n), vertical);
+        }
+        break;
+    case 'd':
+        fprintf(xterm->output, ESC "[%dd", row + 1);
+        break;
+    case '\n':
+        for (int r = cursor.row; r < row; ++r)
+        {
+            fputc('\n', xterm->output);
+        }
+        break;
+    default:
+        break;
+    }
+    xterm_move_column(xterm, row, from, column, horizontal);
+    xterm->screen.cursor.row = row;
+    xterm->screen.cursor.column = column;
+}
+
+
+/*
+ * free_xterminator() --Release any resources used by a Xterminator.
+ */
+void free_xterminator(Xterminator * xterm)
+{
+    if (xterm->output != xterm->tty)
+    {                                  /* (flushes into buffer) */
+        fclose(xterm->output);
+        xterm_out_drain(xterm, 1);
+    }
+    free(xterm->buffer);
+    if (xterm->shadow != NULL)
+    {                                  /* (screen's frame is in it) */
+        munmap(xterm->shadow, XT_SHADOW_SIZE(xterm->screen.geometry.size.row,
+                                             xterm->screen.geometry.size.
+                                             column));
+    }
+    else if (xterm->screen.frame != NULL)
+    {
+        free(xterm->screen.frame);
+    }
+    xterm_compact_release(xterm);
+    if (xterm->root_compact != NULL)
+    {                                  /* (root was compacted) */
+        for (int r = 0; r < xterm->root.geometry.size.row; ++r)
+        {
+            xterm_row_release(xterm->root_compact[r]);
+        }
+        free(xterm->root_compact);
     }
     if (xterm->root.frame != NULL)
     {
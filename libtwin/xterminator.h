@@ -7,6 +7,7 @@
 
 #include <stdio.h>
 #include <twin.h>
+#include <twutf8.h>
 
 #ifdef __cplusplus
 extern "C"
@@ -23,6 +24,7 @@ extern "C"
         TermGraphFormfeed,
         TermGraphReturn,
         TermGraphLinefeed,
+        TermGraphDegree,
         TermGraphPlusminus,
         TermGraphNewline,
         TermGraphVerticaltab,
@@ -50,10 +52,123 @@ extern "C"
     } TermGraphic;
 
 
+    /*
+     * XtFeature: --Optional terminal capabilities (bits).
+     */
+    typedef enum XtFeature_t
+    {
+        XtTrueColour = 0x01,           /* "\033[38;2;r;g;bm" colours */
+        XtNewlineKnown = 0x02,         /* tty output mapping is known... */
+        XtNewlineReturn = 0x04,        /* ...and LF implies CR (ONLCR) */
+        XtRepeat = 0x08,               /* REP: "\033[nb" repeats a glyph */
+        XtSyncOutput = 0x10,           /* mode 2026: atomic frames */
+        XtMargins = 0x20               /* DECSLRM: left/right margins */
+    } XtFeature;
+
+    /*
+     * XtProbeState: --Progress of the terminal capability queries.
+     */
+    typedef enum XtProbeState_t
+    {
+        XtProbeNone = 0,               /* not sent (e.g. input echoes) */
+        XtProbeSent,                   /* waiting for replies */
+        XtProbeDone                    /* DA1 answered, or timed out */
+    } XtProbeState;
+
+    /*
+     * XtRepaint: --Whether the next frame is a full repaint.
+     */
+    typedef enum XtRepaint_t
+    {
+        XtRepaintNone = 0,             /* diff against the screen frame */
+        XtRepaintClear,                /* clear, and draw (cursor's known) */
+        XtRepaintReset                 /* ...and the cursor/style aren't */
+    } XtRepaint;
+
+#define XT_PROBE_PENDING 128           /* longest reply we'll parse */
+
+    /*
+     * XtProbe: --Capability query state, and what's been learnt.
+     */
+    typedef struct XtProbe_t
+    {
+        int state;                     /* XtProbeState */
+        uint64_t deadline;             /* give up (ms), if no DA1 by then */
+        int da1_class;                 /* DA1: conformance level (62-65) */
+        int da2_id, da2_version;       /* DA2: terminal type, version */
+        int n_pending;
+        char pending[XT_PROBE_PENDING];     /* partial escape sequence */
+    } XtProbe;
+
+    /*
+     * XtFlow: --Output flow control state, for slow links.
+     */
+    typedef struct XtFlow_t
+    {
+        int blocked;                   /* frame not all written (EAGAIN) */
+        long rate;                     /* link throughput, bytes/s (0: unknown) */
+        uint64_t next;                 /* earliest time (ms) for a frame */
+        unsigned long skipped;         /* frames deferred, in total */
+        size_t bytes;                  /* the last frame's size... */
+        int changes;                   /* ...and cells sent */
+        uint64_t held_due;             /* slot (ms) for held damage, or 0 */
+        size_t budget;                 /* bytes per frame (0: no limit) */
+        size_t emitted;                /* ...encoded, this frame */
+    } XtFlow;
+
+    /*
+     * XtShadowState: --Whether a shared screen shadow matches the tty.
+     */
+    typedef enum XtShadowState_t
+    {
+        XtShadowSyncing = 0,           /* mid-frame: may not match */
+        XtShadowClean = 1              /* all sent: matches the screen */
+    } XtShadowState;
+
+    /*
+     * XtShadow: --Header of a persistent (shared memory) screen shadow.
+     *
+     * Remarks:
+     * It's followed by the style table (TWIN_STYLE_MAX TwinCells, so
+     * the frame's style ids can be reinterned by a new process), and
+     * then the screen frame itself.  Interned glyphs are reinterned
+     * the same way, via the (small) glyph table in the header.
+     */
+    typedef struct XtShadow_t
+    {
+        uint32_t magic;                /* XT_SHADOW_MAGIC */
+        uint32_t state;                /* XtShadowState */
+        pid_t pid;                     /* owner */
+        int rows, columns;
+        int64_t tty_ctime;             /* identifies this tty instance (ns) */
+        TwinCoordinate cursor;         /* the terminal's cursor... */
+        TwinCell style;                /* ...and SGR/charset state */
+        uint32_t n_style;              /* style table entries valid */
+        uint32_t glyph[TWIN_GLYPH_MAX - TWIN_GLYPH_EXT];  /* cp | width << 24 */
+        uint32_t n_glyph;              /* glyph table entries valid */
+    } XtShadow;
+
+    typedef struct XtRow_t XtRow;      /* a compacted frame row */
+
     typedef struct Xterminator_t
     {
         int input;
-        FILE *output;
+        int features;                  /* XtFeature */
+        FILE *output;                  /* encodes into buffer */
+        FILE *tty;                     /* the terminal (the caller's stream) */
+        char *buffer;                  /* output not yet written to tty */
+        size_t n_buffer;               /* bytes in buffer */
+        size_t buffer_sent;            /* ...of which written */
+        size_t buffer_alloc;
+        int style_id;                  /* TwinStyle last sent, or -1 */
+        XtFlow flow;
+        XtProbe probe;
+        XtShadow *shadow;              /* persistent screen, or NULL */
+        int adopted;                   /* screen was adopted: skip reset */
+        int repaint;                   /* XtRepaint */
+        XtRow **compact;               /* screen rows, while compacted */
+        int n_compact;                 /* ...that aren't expanded yet */
+        XtRow **root_compact;          /* root's rows, while compacted */
         Twindow screen;                /* frame */
         Twindow root;
         Twindow *focus;
@@ -63,13 +178,20 @@ extern "C"
     Xterminator *xterminator_init(Xterminator * xt, int input, FILE * output);
     void free_xterminator(Xterminator * xt);
 
+    int xterm_persist(Xterminator * xt);
+    int xterm_compact(Xterminator * xt);
     void open_xterminator(Xterminator * xt);
     void close_xterminator(Xterminator * xt);
 
     void resize_xterminator(Xterminator * xt);
     TwinCell xterm_cell(Xterminator * xt, int row, int col, TwinCell cell);
     int xterm_sync(Xterminator * xt);
+    int xterm_sync_region(Xterminator * xt, TwinRegion region);
+    int xterm_sync_timeout(Xterminator * xt);
+    ssize_t xterm_read(Xterminator * xt, char *buffer, size_t size);
+    int xterm_read_timeout(Xterminator * xt);
     int xterm_clear(Xterminator * xt);
+    uint8_t xterm_colour_256(TwinColour colour);
 #ifdef __cplusplus
 }
 #endif                                 /* C++ */